@@ -31,6 +31,7 @@
 
 extern options_t m_options; 
 extern charparser_t m_cp; 
+extern hashfun_t m_hf;
 extern options_t u_options; 
 
 extern empirical_t empirical;
@@ -143,7 +144,7 @@ char *print_user_options(options_t opt, char *buf) {
 }
 
 error_code_t sanitize_model_options(options_t *mopt, charparser_t *mcp,
-				    category_t *cat) {
+				    hashfun_t *mhf, category_t *cat) {
   options_t mask;
 
   /* things that always override mopt */
@@ -244,6 +245,16 @@ error_code_t sanitize_model_options(options_t *mopt, charparser_t *mcp,
     *mcp = cat->model.cp;
   }
 
+  /* token ids from different hash functions can't be compared */
+  if( (*mhf != HF_DEFAULT) && (*mhf != cat->model.hf) ) {
+    errormsg(E_FATAL,
+	    "category %s uses a different token hash (check -k switch)\n",
+	    cat->filename);
+    return 0;
+  } else {
+    *mhf = cat->model.hf;
+  }
+
   return 1;
 }
 
@@ -474,6 +485,7 @@ void init_category(category_t *cat) {
     cat->model.options = 0;
     cat->model.cp = 0;
     cat->model.dt = 0;
+    cat->model.hf = HF_LOOKUP2;
     cat->c_options = 0;
     cat->hash = NULL;
     cat->mmap_offset = 0;
@@ -486,10 +498,18 @@ bool_t create_category_hash(category_t *cat, FILE *input, int protf) {
   if( u_options & (1<<U_OPTION_MMAP) ) {
     cat->mmap_offset = ftell(input);
     if( cat->mmap_offset > 0 ) {
-      cat->mmap_start = 
-	(byte_t *)MMAP(0, sizeof(c_item_t) * cat->max_tokens + 
-		       cat->mmap_offset,
-		       protf, MAP_SHARED, fileno(input), 0);
+      /* the journal is replayed over a private copy of the pages */
+      if( cat->c_options & (1<<C_OPTION_JOURNAL) ) {
+	cat->mmap_start = 
+	  (byte_t *)MMAP(0, sizeof(c_item_t) * cat->max_tokens + 
+			 cat->mmap_offset,
+			 protf|PROT_WRITE, MAP_PRIVATE, fileno(input), 0);
+      } else {
+	cat->mmap_start = 
+	  (byte_t *)MMAP(0, sizeof(c_item_t) * cat->max_tokens + 
+			 cat->mmap_offset,
+			 protf, MAP_SHARED, fileno(input), 0);
+      }
       if( cat->mmap_start == MAP_FAILED ) { cat->mmap_start = NULL; }
       if( cat->mmap_start ) {
 	cat->hash = (c_item_t *)(cat->mmap_start + cat->mmap_offset);
@@ -925,11 +945,69 @@ confidence_t gamma_pvalue(category_t *cat, double obs) {
 /***********************************************************
  * FILE MANAGEMENT FUNCTIONS                               *
  ***********************************************************/
+/* reads the four lines of statistics which follow the signature;
+   a journal record repeats them */
+error_code_t load_category_stats(FILE *input, category_t *cat) {
+  char buf[MAGIC_BUFSIZE];
+  char scratchbuf[MAGIC_BUFSIZE];
+  short int shint_val;
+  long int lint_val1, lint_val2, lint_val3;
+
+  if( !fgets(buf, MAGIC_BUFSIZE, input) ||
+      (sscanf(buf, MAGIC2_i, &cat->divergence, &cat->logZ, 
+	      &shint_val, scratchbuf) < 4) ) {
+    errormsg(E_ERROR, "bad category file [2]\n");
+    return 0;
+  }
+  cat->max_order = (token_order_t)shint_val;
+  cat->delta = 1.0/(score_t)(cat->max_order);
+  cat->renorm = cat->delta * cat->logZ;
+  if( scratchbuf[0] == 'm' ) {
+    cat->model.type = simple;
+  } else {
+    cat->model.type = sequential;
+  }
+
+  if( !fgets(buf, MAGIC_BUFSIZE, input) ||
+      (sscanf(buf, MAGIC3, 
+	      &shint_val,
+	      &lint_val1,
+	      &lint_val2,
+	      &lint_val3) < 4) ) {
+    errormsg(E_ERROR, "bad category file [3]\n");
+    return 0;
+  }
+  cat->max_hash_bits = (token_order_t)shint_val;
+  cat->model_full_token_count = (token_count_t)lint_val1;
+  cat->model_unique_token_count = (token_count_t)lint_val2;
+  cat->model_num_docs = (document_count_t)lint_val3;
+
+  cat->max_tokens = (1<<cat->max_hash_bits);
+
+  if( !fgets(buf, MAGIC_BUFSIZE, input) ||
+      (sscanf(buf, MAGIC8_i, 
+	      &cat->shannon, &cat->shannon_s2) < 2) ) {
+    errormsg(E_ERROR, "bad category file [8]\n");
+    return 0;
+  }
+
+  if( !fgets(buf, MAGIC_BUFSIZE, input) ||
+      (sscanf(buf, MAGIC10_i, 
+	      &cat->alpha, &cat->beta,
+	      &cat->mu, &cat->s2) < 4) ) {
+    errormsg(E_ERROR, "bad category file [10]\n");
+    return 0;
+  }
+
+  return 1;
+}
+
 error_code_t load_category_header(FILE *input, category_t *cat) {
   char buf[MAGIC_BUFSIZE];
   char scratchbuf[MAGIC_BUFSIZE];
   short int shint_val, shint_val2;
-  long int lint_val1, lint_val2, lint_val3;
+  long int lint_val1;
+  hashfun_t hf;
 
   if( input ) {
     if( !fgets(buf, MAGIC_BUFSIZE, input) ||
@@ -940,51 +1018,23 @@ error_code_t load_category_header(FILE *input, category_t *cat) {
       return 0;
     } 
 
-    init_category(cat); /* changes filename */
-
-    if( !fgets(buf, MAGIC_BUFSIZE, input) ||
-	(sscanf(buf, MAGIC2_i, &cat->divergence, &cat->logZ, 
-		&shint_val, scratchbuf) < 4) ) {
-      errormsg(E_ERROR, "bad category file [2]\n");
-      return 0;
-    }
-    cat->max_order = (token_order_t)shint_val;
-    cat->delta = 1.0/(score_t)(cat->max_order);
-    cat->renorm = cat->delta * cat->logZ;
-    if( scratchbuf[0] == 'm' ) {
-      cat->model.type = simple;
+    /* the token hash, if any, follows the signature */
+    if( !strncmp(buf + MAGIC1_LEN, " category ", 10) ) {
+      hf = HF_LOOKUP2;
+    } else if( !strncmp(buf + MAGIC1_LEN, HASHTAG_MURMUR " category ", 
+			strlen(HASHTAG_MURMUR) + 10) ) {
+      hf = HF_MURMUR;
     } else {
-      cat->model.type = sequential;
-    }
-
-    if( !fgets(buf, MAGIC_BUFSIZE, input) ||
-	(sscanf(buf, MAGIC3, 
-		&shint_val,
-		&lint_val1,
-		&lint_val2,
-		&lint_val3) < 4) ) {
-      errormsg(E_ERROR, "bad category file [3]\n");
+      errormsg(E_ERROR,
+	       "category file %s uses an unknown token hash\n",
+	       cat->fullfilename);
       return 0;
     }
-    cat->max_hash_bits = (token_order_t)shint_val;
-    cat->model_full_token_count = (token_count_t)lint_val1;
-    cat->model_unique_token_count = (token_count_t)lint_val2;
-    cat->model_num_docs = (document_count_t)lint_val3;
-
-    cat->max_tokens = (1<<cat->max_hash_bits);
 
-    if( !fgets(buf, MAGIC_BUFSIZE, input) ||
-	(sscanf(buf, MAGIC8_i, 
-		&cat->shannon, &cat->shannon_s2) < 2) ) {
-      errormsg(E_ERROR, "bad category file [8]\n");
-      return 0;
-    }
+    init_category(cat); /* changes filename */
+    cat->model.hf = hf;
 
-    if( !fgets(buf, MAGIC_BUFSIZE, input) ||
-	(sscanf(buf, MAGIC10_i, 
-		&cat->alpha, &cat->beta,
-		&cat->mu, &cat->s2) < 4) ) {
-      errormsg(E_ERROR, "bad category file [10]\n");
+    if( !load_category_stats(input, cat) ) {
       return 0;
     }
 
@@ -1030,10 +1080,143 @@ error_code_t load_category_header(FILE *input, category_t *cat) {
 }
 
 
+/* name of the journal which accompanies a category file */
+char *journal_filename(char *fullfilename) {
+  char *name;
+
+  name = (char *)malloc(strlen(fullfilename) + strlen(JOURNAL_EXTN) + 1);
+  if( name ) {
+    strcpy(name, fullfilename);
+    strcat(name, JOURNAL_EXTN);
+  }
+  return name;
+}
+
+/* like stat(), but the size and modification time of a category
+   also account for its journal */
+int stat_category(char *path, struct stat *st) {
+  struct stat js;
+  char *name;
+
+  if( stat(path, st) != 0 ) {
+    return -1;
+  }
+  if( (name = journal_filename(path)) ) {
+    if( stat(name, &js) == 0 ) {
+      st->st_size += js.st_size;
+      if( js.st_mtime > st->st_mtime ) {
+	st->st_mtime = js.st_mtime;
+      }
+    }
+    free(name);
+  }
+  return 0;
+}
+
+/* opens the journal of a category, provided it was started for
+   this very category file - a rewritten file makes it stale */
+FILE *open_journal(category_t *cat, FILE *input) {
+  char buf[MAGIC_BUFSIZE];
+  struct stat st;
+  unsigned long int ino;
+  long int size, mtime;
+  char *name;
+  FILE *jnl = NULL;
+
+  if( (name = journal_filename(cat->fullfilename)) ) {
+    jnl = fopen(name, "rb");
+    free(name);
+  }
+  if( jnl ) {
+    if( (fstat(fileno(input), &st) != 0) ||
+	!fgets(buf, MAGIC_BUFSIZE, jnl) ||
+	(sscanf(buf, MAGIC_JOURNAL_i, &ino, &size, &mtime) < 3) ||
+	(ino != (unsigned long int)st.st_ino) || 
+	(size != (long int)st.st_size) ||
+	(mtime != (long int)st.st_mtime) ) {
+      fclose(jnl);
+      jnl = NULL;
+    }
+  }
+  return jnl;
+}
+
+/* replays the journal records over a freshly loaded category. Each
+   record is read in full before it is applied, so a record which is
+   still being appended is simply ignored */
+void apply_journal(category_t *cat, FILE *jnl) {
+  char buf[MAGIC_BUFSIZE];
+  long int n, m, k, pos, end;
+  hash_bit_count_t bits = cat->max_hash_bits;
+  byte_t *dpos = NULL;
+#if defined DIGITIZE_DIGRAMS
+  digitized_weight_t *dval = NULL;
+#else
+  weight_t *dval = NULL;
+#endif
+  c_item_t *items = NULL;
+  c_item_t *i;
+  bool_t ok = (bool_t)1;
+
+  while( ok && fgets(buf, MAGIC_BUFSIZE, jnl) ) {
+    ok = (sscanf(buf, MAGIC_RECORD, &n, &m) == 2) && (n >= 0) && (m >= 0);
+    if( !ok ) {
+      break;
+    }
+    pos = ftell(jnl);
+    for(k = 0; ok && (k < 4); k++) {
+      ok = fgets(buf, MAGIC_BUFSIZE, jnl) && strchr(buf, '\n');
+    }
+    dpos = (byte_t *)malloc(2 * n + 1);
+    dval = malloc(SIZEOF_DIGRAMS * n + 1);
+    items = (c_item_t *)malloc(sizeof(c_item_t) * m + 1);
+    ok = ok && dpos && dval && items &&
+      (fread(dpos, 2, (size_t)n, jnl) == (size_t)n) &&
+      (fread(dval, SIZEOF_DIGRAMS, (size_t)n, jnl) == (size_t)n) &&
+      (fread(items, sizeof(c_item_t), (size_t)m, jnl) == (size_t)m);
+    end = ftell(jnl);
+
+    if( ok ) {
+      /* the record is complete, anything wrong now is corruption */
+      fseek(jnl, pos, SEEK_SET);
+      if( !load_category_stats(jnl, cat) || (cat->max_hash_bits != bits) ) {
+	ok = 0;
+      }
+      for(k = 0; ok && (k < n); k++) {
+	cat->dig[dpos[2 * k]][dpos[2 * k + 1]] = NTOH_DIGRAM(dval[k]);
+      }
+      for(k = 0; ok && (k < m); k++) {
+	if( (i = find_in_category(cat, NTOH_ID(items[k].id))) ) {
+	  *i = items[k];
+	} else {
+	  ok = 0;
+	}
+      }
+      if( !ok ) {
+	errormsg(E_WARNING, "corrupt journal for category %s\n",
+		 cat->fullfilename);
+	cat->max_hash_bits = bits;
+	cat->max_tokens = (1<<bits);
+      }
+      fseek(jnl, end, SEEK_SET);
+    }
+
+    free(dpos);
+    free(dval);
+    free(items);
+  }
+
+  /* records appended after this point could never be read */
+  if( !ok ) {
+    cat->c_options |= (1<<C_OPTION_BAD_JOURNAL);
+  }
+}
+
 error_code_t explicit_load_category(category_t *cat, char *openf, int protf) {
   hash_count_t i, j;
 
   FILE *input;
+  FILE *jnl = NULL;
 
   /* this is needed in case we try to open with write permissions,
      which would otherwise create the file */
@@ -1050,6 +1233,10 @@ error_code_t explicit_load_category(category_t *cat, char *openf, int protf) {
       return 0;
     }
 
+    if( (jnl = open_journal(cat, input)) ) {
+      cat->c_options |= (1<<C_OPTION_JOURNAL);
+    }
+
     /* read character frequencies */
     i = ASIZE * ASIZE;
     j = 0;
@@ -1059,6 +1246,7 @@ error_code_t explicit_load_category(category_t *cat, char *openf, int protf) {
     if( j < i ) {
       errormsg(E_ERROR, "is this category corrupt: %s?\n",
 	      cat->fullfilename);
+      if( jnl ) { fclose(jnl); }
       fclose(input);
       return 0;
     }
@@ -1072,10 +1260,16 @@ error_code_t explicit_load_category(category_t *cat, char *openf, int protf) {
 #endif
 
     if( !create_category_hash(cat, input, protf) ) {
+      if( jnl ) { fclose(jnl); }
       fclose(input);
       return 0;
     }
 
+    if( jnl ) {
+      apply_journal(cat, jnl);
+      fclose(jnl);
+    }
+
     fclose(input);
 
     return 1;
@@ -1101,7 +1295,7 @@ error_code_t reload_category(category_t *cat) {
     /* free the hash, but keep the cat->fullfilename */
     free_category_hash(cat);
     return load_category(cat) && 
-      sanitize_model_options(&m_options,&m_cp,cat);
+      sanitize_model_options(&m_options,&m_cp,&m_hf,cat);
   }
   return 0;
 }
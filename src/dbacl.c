@@ -39,10 +39,18 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/time.h>
 
 #if defined HAVE_UNISTD_H
 #include <unistd.h> 
 #include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+#include <errno.h>
+
+#if defined HAVE_LIBPTHREAD
+#include <pthread.h>
 #endif
 
 #include <locale.h>
@@ -63,6 +71,9 @@
 
 extern signal_cleanup_t cleanup;
 
+extern long token_cache_hits;
+extern long token_cache_misses;
+
 extern hash_bit_count_t default_max_hash_bits;
 extern hash_count_t default_max_tokens;
 
@@ -71,8 +82,15 @@ extern hash_count_t default_max_grow_tokens;
 
 hash_bit_count_t decimation;
 int zthreshold = 0;
+long budget_features = 0;
+long budget_bytes = 0;
+hash_bit_count_t pruned_hash_bits = 0;
 
 learner_t learner;
+learner_workers_t workers = { 0, -1, 0, 0, NULL, NULL, NULL, 0, 0 };
+learner_features_t features;
+learner_delta_t delta;
+learner_emp_slots_t empslots = { NULL, 0, 1 };
 dirichlet_t dirichlet;
 int filter[MAX_CAT];
 category_count_t filter_count = 0;
@@ -88,10 +106,14 @@ extern empirical_t empirical;
 extern options_t u_options;
 extern options_t m_options;
 extern charparser_t m_cp;
+extern hashfun_t m_hf;
 extern digtype_t m_dt;
 extern char *extn;
 
 extern token_order_t ngram_order; /* defaults to 1 */
+extern int max_threads;
+extern void (*mbox_state_fun)(Mstate);
+extern bool_t (*claim_file_fun)(void);
 
 /* for counting emails */
 bool_t not_header; 
@@ -105,6 +127,8 @@ extern int optind, opterr, optopt;
 char *title = "";
 char *digtype = "";
 char *online = "";
+char *manifest = "";
+char *tokcache = "";
 char *ronline[MAX_CAT];
 category_count_t ronline_count = 0;
 extern char *progname;
@@ -134,6 +158,7 @@ double qtol_div = 0.01;
 double qtol_lam = CLIP_LAMBDA_TOL(0.05);
 double qtol_logz = 0.05;
 bool_t qtol_multipass = 0;
+double qtol_drift = 0.05;
 
 /***********************************************************
  * MISCELLANEOUS FUNCTIONS                                 *
@@ -155,7 +180,7 @@ static void usage(/*@unused@*/ char **argv) {
   fprintf(stderr, 
 	  "\n");
   fprintf(stderr, 
-	  "dbacl [-vnirNDL] [-h size] [-T type] -l CATEGORY \n");
+	  "dbacl [-vnirNDL] [-h size] [-s budget] [-T type] -l CATEGORY \n");
   fprintf(stderr, 
 	  "      [-g regex]... [FILE]...\n");
   fprintf(stderr, 
@@ -164,7 +189,27 @@ static void usage(/*@unused@*/ char **argv) {
 	  "      builds a maximum entropy model from the words in FILE or STDIN\n");
   fprintf(stderr, 
 	  "      or concatenated regex submatches if using the -g option.\n");
-  fprintf(stderr, 
+  fprintf(stderr,
+	  "\n");
+  fprintf(stderr,
+	  "dbacl [-vnirNDL] [-h size] [-T type] -b MANIFEST\n");
+  fprintf(stderr,
+	  "\n");
+  fprintf(stderr,
+	  "      builds every CATEGORY listed in MANIFEST, one \"CATEGORY FILE\"\n");
+  fprintf(stderr,
+	  "      pair per line, from the files listed with it.\n");
+  fprintf(stderr,
+	  "\n");
+  fprintf(stderr,
+	  "dbacl [-ij] [-T type] [-w max_order] -t CACHE [FILE]...\n");
+  fprintf(stderr,
+	  "\n");
+  fprintf(stderr,
+	  "      saves the tokens of FILE or STDIN to CACHE, which can be\n");
+  fprintf(stderr,
+	  "      learned or classified later instead of FILE.\n");
+  fprintf(stderr,
 	  "\n");
   fprintf(stderr, 
 	  "dbacl -V\n");
@@ -646,19 +691,11 @@ void write_mediaprobs(FILE *out, learner_t *learner) {
   fprintf(out, "\n");
 }
 
-bool_t write_category_headers(learner_t *learner, FILE *output) {
-  regex_count_t c;
-  char scratchbuf[MAGIC_BUFSIZE];
-  char smb[MAX_SUBMATCH+1];
-  token_order_t s;
-  char *p;
-
+/* the statistics lines of the category header, which are also
+   repeated in every journal record */
+bool_t write_category_stats(learner_t *learner, FILE *output) {
   bool_t ok = (bool_t)1;
 
-  /* print out standard category file headers */
-  ok = ok && 
-    (0 < fprintf(output, MAGIC1, learner->filename, 
-		 (m_options & (1<<M_OPTION_REFMODEL)) ? "(ref)" : ""));
   ok = ok &&
     (0 < fprintf(output, 
 		 MAGIC2_o, learner->divergence, learner->logZ, 
@@ -679,6 +716,23 @@ bool_t write_category_headers(learner_t *learner, FILE *output) {
     (0 < fprintf(output, MAGIC10_o,
 		 learner->alpha, learner->beta,
 		 learner->mu, learner->s2));
+  return ok;
+}
+
+bool_t write_category_headers(learner_t *learner, FILE *output) {
+  regex_count_t c;
+  char scratchbuf[MAGIC_BUFSIZE];
+  char smb[MAX_SUBMATCH+1];
+  token_order_t s;
+  char *p;
+
+  bool_t ok = (bool_t)1;
+
+  /* print out standard category file headers */
+  ok = ok && 
+    (0 < fprintf(output, MAGIC1, HASHTAG(m_hf), learner->filename, 
+		 (m_options & (1<<M_OPTION_REFMODEL)) ? "(ref)" : ""));
+  ok = ok && write_category_stats(learner, output);
 
   write_mediaprobs(output, learner);
 
@@ -713,6 +767,92 @@ typedef digitized_weight_t myweight_t;
 typedef weight_t myweight_t;
 #endif
 
+/* a full save makes the journal of a category obsolete */
+void remove_journal(char *filename) {
+  char *name;
+
+  if( (name = journal_filename(filename)) ) {
+    unlink(name);
+    free(name);
+  }
+}
+
+/* the part of a category file which doesn't depend on the features */
+long prune_overhead_bytes() {
+  return (long)((PRUNE_HEADER_LINES + regex_count) * MAGIC_BUFSIZE) +
+    (long)(ASIZE * ASIZE * SIZEOF_DIGRAMS);
+}
+
+static int compare_prune_items(const void *a, const void *b) {
+  const prune_item_t *x = (const prune_item_t *)a;
+  const prune_item_t *y = (const prune_item_t *)b;
+  if( x->score != y->score ) {
+    return (x->score > y->score) ? -1 : 1;
+  }
+  return (x->slot < y->slot) ? -1 : (x->slot > y->slot);
+}
+
+/* with -s, drops the features which contribute least to the model
+   (weight times count) until the rest fits the budget. The dropped
+   features are marked, so that their weights stay zero if the model
+   is optimized again, and pruned_hash_bits is set to the size of the
+   smallest table which holds the remaining features. Returns 1 if
+   some features were dropped. */
+bool_t prune_learner(learner_t *learner) {
+  hash_count_t i, m, n, slots;
+  prune_item_t *rank;
+  long avail;
+
+  if( budget_bytes > 0 ) {
+    avail = (budget_bytes - prune_overhead_bytes())/(long)sizeof(c_item_t);
+    for(slots = 2; (long)(slots<<1) <= avail; slots <<= 1);
+    n = (hash_count_t)(((double)HASH_FULL * slots - 1.0)/100.0);
+  } else {
+    n = (hash_count_t)budget_features;
+  }
+
+  m = 0;
+  for(i = 0; i < learner->max_tokens; i++) {
+    if( FILLEDP(&learner->hash[i]) && (learner->hash[i].lam != 0) ) {
+      m++;
+    }
+  }
+
+  if( m > n ) {
+    rank = (prune_item_t *)malloc(m * sizeof(prune_item_t));
+    if( !rank ) {
+      errormsg(E_WARNING, "not enough memory to prune the features\n");
+      return 0;
+    }
+    for(i = 0, m = 0; i < learner->max_tokens; i++) {
+      if( FILLEDP(&learner->hash[i]) && (learner->hash[i].lam != 0) ) {
+	rank[m].score = fabs(UNPACK_LAMBDA(learner->hash[i].lam)) * 
+	  (weight_t)learner->hash[i].count;
+	rank[m].slot = i;
+	m++;
+      }
+    }
+    qsort(rank, m, sizeof(prune_item_t), compare_prune_items);
+    for(i = n; i < m; i++) {
+      learner->hash[rank[i].slot].lam = PACK_LAMBDA(0.0);
+      learner->hash[rank[i].slot].typ.mark = 1;
+    }
+    free(rank);
+  }
+
+  for(pruned_hash_bits = 1; 
+      100.0 * MINIMUM(m, n) >= 
+	(double)HASH_FULL * ((hash_count_t)1<<pruned_hash_bits);
+      pruned_hash_bits++);
+
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    fprintf(stdout, "pruned %ld of %ld features, table size %ld\n",
+	    (long)((m > n) ? m - n : 0), (long)m, 
+	    (long)1<<pruned_hash_bits);
+  }
+  return (m > n);
+}
+
 /* writes the learner to a file for easily readable category */
 /* the category file is first constructed as a temporary file,
    then renamed if no problems occured. Because renames are 
@@ -735,6 +875,12 @@ error_code_t save_learner(learner_t *learner, char *opath) {
   long mmap_offset = 0;
   size_t mmap_length = 0;
   byte_t *mmap_start = NULL;
+
+  c_item_t *table = NULL;
+  hash_count_t slots = 0;
+  hash_count_t kept = 0;
+  hash_bit_count_t bits;
+  token_count_t unique;
   
 
   if( u_options & (1<<U_OPTION_VERBOSE) ) {
@@ -752,11 +898,14 @@ error_code_t save_learner(learner_t *learner, char *opath) {
      user knows that a single process must read/write the file at a time.
      Also, we don't try to create the file - if the file doesn't exist,
      we won't gain much time by using mmap on that single occasion. */
-  if( opath && *opath && (u_options & (1<<U_OPTION_MMAP)) ) {
+  if( opath && *opath && (u_options & (1<<U_OPTION_MMAP)) && 
+      !pruned_hash_bits ) {
     ok = (bool_t)0; 
     output = fopen(learner->filename, "r+b");
     if( output ) {
       ok = (bool_t)1;
+      /* the file is overwritten in place, so the journal must go first */
+      remove_journal(learner->filename);
       if( out_iobuf ) {
 	setvbuf(output, (char *)out_iobuf, (int)_IOFBF, (size_t)(BUFFER_MAG * system_pagesize));
       }
@@ -835,6 +984,31 @@ error_code_t save_learner(learner_t *learner, char *opath) {
     }
   }
 
+  /* a pruned category only keeps the features with a weight, in the
+     smallest table which holds them */
+  if( pruned_hash_bits ) {
+    slots = (hash_count_t)1<<pruned_hash_bits;
+    table = (c_item_t *)calloc(slots, sizeof(c_item_t));
+    if( !table ) {
+      errormsg(E_ERROR, "not enough memory to save %s\n", learner->filename);
+      return 0;
+    }
+    for(t = 0; t < learner->max_tokens; t++) {
+      if( FILLEDP(&learner->hash[t]) && (learner->hash[t].lam != 0) ) {
+	for(ci_ptr = &table[learner->hash[t].id & (slots - 1)]; 
+	    FILLEDP(ci_ptr); 
+	    ci_ptr = (ci_ptr + 1 < table + slots) ? ci_ptr + 1 : table);
+	SET(ci_ptr->id,learner->hash[t].id);
+	ci_ptr->lam = learner->hash[t].lam;
+	kept++;
+      }
+    }
+    for(t = 0; t < slots; t++) {
+      table[t].id = HTON_ID(table[t].id);
+      table[t].lam = HTON_LAMBDA(table[t].lam);
+    }
+  }
+
   /* this keeps track to see if writing is successful, 
      it's not foolproof, but probably good enough */
   ok = (bool_t)1; 
@@ -846,7 +1020,18 @@ error_code_t save_learner(learner_t *learner, char *opath) {
       setvbuf(output, (char *)out_iobuf, (int)_IOFBF, (size_t)(BUFFER_MAG * system_pagesize));
     }
 
-    ok = ok && write_category_headers(learner, output);
+    if( table ) {
+      /* the headers describe the table which is written */
+      bits = learner->max_hash_bits;
+      unique = learner->unique_token_count;
+      learner->max_hash_bits = pruned_hash_bits;
+      learner->unique_token_count = kept;
+      ok = ok && write_category_headers(learner, output);
+      learner->max_hash_bits = bits;
+      learner->unique_token_count = unique;
+    } else {
+      ok = ok && write_category_headers(learner, output);
+    }
 
     /* end of readable stuff */
     if( ok ) {
@@ -870,6 +1055,11 @@ error_code_t save_learner(learner_t *learner, char *opath) {
 	}
       }
 
+      if( table ) {
+	ok = (fwrite(table, sizeof(c_item_t), slots, output) == slots);
+	goto skip_remaining;
+      }
+
       MADVISE(learner->hash, sizeof(l_item_t) * learner->max_tokens, 
 	      MADV_SEQUENTIAL|MADV_WILLNEED);
 
@@ -902,12 +1092,16 @@ error_code_t save_learner(learner_t *learner, char *opath) {
 	       learner->filename);
       unlink(tempname);
       cleanup.tempfile = NULL;
+    } else {
+      remove_journal(learner->filename);
     }
     free(tempname);
   } else {
     errormsg(E_ERROR, "cannot open tempfile for writing %s\n", learner->filename);
+    if( table ) { free(table); }
     return 0;
   }
+  if( table ) { free(table); }
 
 
   return 1;
@@ -931,6 +1125,7 @@ error_code_t fast_partial_save_learner(learner_t *learner, category_t *xcat) {
   myweight_t *shval_ptr;
 
   if( xcat->mmap_start && 
+      !(xcat->c_options & (1<<C_OPTION_JOURNAL)) &&
       (xcat->model.options == learner->model.options) &&
       (xcat->max_order == learner->max_order) &&
       (xcat->max_hash_bits == learner->max_hash_bits) ) {
@@ -1015,6 +1210,163 @@ error_code_t fast_partial_save_learner(learner_t *learner, category_t *xcat) {
   return 0;
 }
 
+/* Instead of saving a full new category file, we append the digrams
+ * and weights which differ from the category file (as amended by its
+ * journal) to the journal. If the return value is 0, a full save is
+ * needed, either because the learner doesn't extend the category or
+ * because the journal has grown too large compared with the file.
+ */
+error_code_t journal_learner(learner_t *learner, category_t *xcat) {
+  category_t *ycat = xcat;
+  alphabet_size_t i, j;
+  hash_count_t t;
+  c_item_t *ci;
+  c_item_t cj;
+  myweight_t shval;
+  byte_t pos[2];
+  long int nd = 0, nm = 0, found = 0, filled = 0;
+  struct stat bs, js;
+  char *name = NULL;
+  FILE *jnl = NULL;
+  int fd;
+  bool_t ok;
+
+  if( !ycat ) {
+    ycat = &(cat[0]);
+    ycat->fullfilename = strdup(learner->filename);
+    if( !load_category(ycat) ) {
+      free(ycat->fullfilename);
+      return 0;
+    }
+  }
+
+  /* a record only replaces the statistics, so the rest of the
+     header must be unchanged */
+  ok = !(ycat->c_options & (1<<C_OPTION_BAD_JOURNAL)) &&
+    (ycat->model.options == m_options) &&
+    (ycat->model.cp == m_cp) && (ycat->model.dt == m_dt) &&
+    (ycat->model.hf == m_hf) && (ycat->retype == learner->retype) &&
+    (ycat->max_hash_bits == learner->max_hash_bits) &&
+    (stat(learner->filename, &bs) == 0);
+
+  if( ok ) {
+    for(i = 0; i < ASIZE; i++) {
+      for(j = 0; j < ASIZE; j++) {
+	if( ycat->dig[i][j] != PACK_DIGRAMS(learner->dig[i][j]) ) {
+	  nd++;
+	}
+      }
+    }
+    for(t = 0; t < ycat->max_tokens; t++) {
+      if( FILLEDP(&ycat->hash[t]) ) {
+	filled++;
+      }
+    }
+    for(t = 0; ok && (t < learner->max_tokens); t++) {
+      if( FILLEDP(&learner->hash[t]) ) {
+	ci = find_in_category(ycat, learner->hash[t].id);
+	if( !ci ) {
+	  ok = 0;
+	} else if( !FILLEDP(ci) ) {
+	  nm++;
+	} else {
+	  found++;
+	  if( ci->lam != HTON_LAMBDA(learner->hash[t].lam) ) {
+	    nm++;
+	  }
+	}
+      }
+    }
+    /* every feature of the category must still be learned */
+    ok = ok && (found == filled);
+  }
+
+  if( ok ) {
+    name = journal_filename(learner->filename);
+    js.st_size = 0;
+    if( !name || 
+	((ycat->c_options & (1<<C_OPTION_JOURNAL)) && 
+	 (stat(name, &js) != 0)) ) {
+      ok = 0;
+    }
+    /* fold the journal back into the category when it gets big */
+    ok = ok &&
+      (((long int)js.st_size + nd * (2 + (long int)SIZEOF_DIGRAMS) + 
+	nm * (long int)sizeof(c_item_t)) * JOURNAL_COMPACT <= (long int)bs.st_size);
+  }
+
+  if( ok ) {
+    /* a stale journal (or none) is started afresh */
+    if( ycat->c_options & (1<<C_OPTION_JOURNAL) ) {
+      jnl = fopen(name, "ab");
+    } else if( (fd = open(name, O_CREAT|O_TRUNC|O_WRONLY|O_BINARY, 0640)) != -1 ) {
+      if( !(jnl = fdopen(fd, "wb")) ) {
+	close(fd);
+      }
+      ok = jnl &&
+	(0 < fprintf(jnl, MAGIC_JOURNAL_o, (unsigned long int)bs.st_ino,
+		     (long int)bs.st_size, (long int)bs.st_mtime));
+    }
+    if( jnl && out_iobuf ) {
+      setvbuf(jnl, (char *)out_iobuf, (int)_IOFBF, (size_t)(BUFFER_MAG * system_pagesize));
+    }
+
+    ok = ok && jnl &&
+      (0 < fprintf(jnl, MAGIC_RECORD, nd, nm)) &&
+      write_category_stats(learner, jnl);
+
+    /* changed digram positions, then their values */
+    for(i = 0; ok && (i < ASIZE); i++) {
+      for(j = 0; ok && (j < ASIZE); j++) {
+	if( ycat->dig[i][j] != PACK_DIGRAMS(learner->dig[i][j]) ) {
+	  pos[0] = (byte_t)i;
+	  pos[1] = (byte_t)j;
+	  ok = (fwrite(pos, 2, (size_t)1, jnl) == 1);
+	}
+      }
+    }
+    for(i = 0; ok && (i < ASIZE); i++) {
+      for(j = 0; ok && (j < ASIZE); j++) {
+	if( ycat->dig[i][j] != PACK_DIGRAMS(learner->dig[i][j]) ) {
+	  shval = HTON_DIGRAM(PACK_DIGRAMS(learner->dig[i][j]));
+	  ok = (fwrite(&shval, SIZEOF_DIGRAMS, (size_t)1, jnl) == 1);
+	}
+      }
+    }
+
+    /* new and changed token/feature weights */
+    for(t = 0; ok && (t < learner->max_tokens); t++) {
+      if( FILLEDP(&learner->hash[t]) ) {
+	ci = find_in_category(ycat, learner->hash[t].id);
+	if( !FILLEDP(ci) || (ci->lam != HTON_LAMBDA(learner->hash[t].lam)) ) {
+	  SET(cj.id,learner->hash[t].id);
+	  cj.lam = learner->hash[t].lam;
+
+	  cj.id = HTON_ID(cj.id);
+	  cj.lam = HTON_LAMBDA(cj.lam);
+	  ok = (fwrite(&cj, sizeof(cj), (size_t)1, jnl) == 1);
+	}
+      }
+    }
+
+    if( jnl ) {
+      ok = (fclose(jnl) == 0) && ok;
+    }
+    if( !ok ) {
+      /* a partial record would hide any later ones */
+      errormsg(E_WARNING, "could not write journal %s\n", name);
+      unlink(name);
+    } else if( u_options & (1<<U_OPTION_VERBOSE) ) {
+      fprintf(stdout, "appending %ld digrams and %ld weights to journal %s\n",
+	      nd, nm, name);
+    }
+  }
+
+  if( name ) { free(name); }
+  if( !xcat ) { free_category(ycat); }
+  return ok;
+}
+
 
 bool_t tmp_seek_start(learner_t *learner) {
   if( learner->tmp.mmap_start ) {
@@ -1066,11 +1418,86 @@ size_t tmp_read_block(learner_t *learner, byte_t *buf, size_t bufsiz,
   return 0;
 }
 
-/* must unmap/ftruncate/remap if using mmap, don't touch mmap_cursor */
+/* opens a temporary file for writing tokens */
+bool_t tmp_open_file(learner_t *learner) {
+  learner->tmp.file = 
+    mytmpfile(learner->filename ? learner->filename : progname, 
+	      &learner->tmp.filename);
+  /* set this: in case of a fatal signal, we can unlink the temprile */
+  cleanup.tempfile = learner->tmp.filename;
+
+  learner->tmp.iobuf = NULL;   /* can't reuse in_iobuf or out_iobuf */
+
+  if( learner->tmp.file ) {
+#if defined HAVE_POSIX_MEMALIGN
+    /* buffer must exist until after fclose() */
+    if( 0 != posix_memalign(&learner->tmp.iobuf, system_pagesize, 
+			    BUFFER_MAG * system_pagesize) ) {
+      learner->tmp.iobuf = NULL;
+    }
+#elif defined HAVE_MEMALIGN
+    /* buffer can't be free()'d */
+    learner->tmp.iobuf = (void *)memalign(system_pagesize, 
+					  BUFFER_MAG * system_pagesize);
+#elif defined HAVE_VALLOC
+    /* buffer can't be free()'d */
+    learner->tmp.iobuf = (void *)valloc(BUFFER_MAG * system_pagesize);
+#endif
+    if( learner->tmp.iobuf ) {
+      setvbuf(learner->tmp.file, (char *)learner->tmp.iobuf, (int)_IOFBF, 
+	      (size_t)(BUFFER_MAG * system_pagesize));
+    }
+  }
+  return (learner->tmp.file != NULL);
+}
+
+/* tokens kept in memory are moved to a temporary file once they
+   reach TOKEN_LIST_MEMORY bytes */
+bool_t tmp_grow_memory(learner_t *learner) {
+  byte_t *p = learner->tmp.mmap_start;
+  long n;
+
+  if( learner->tmp.avail < TOKEN_LIST_MEMORY ) {
+    p = (byte_t *)realloc(p, 2 * learner->tmp.avail);
+    if( p ) {
+      learner->tmp.mmap_start = p;
+      learner->tmp.avail *= 2;
+      learner->tmp.mmap_length = learner->tmp.avail;
+      return (bool_t)1;
+    }
+    p = learner->tmp.mmap_start;
+  }
+
+  if( !tmp_open_file(learner) ) {
+    errormsg(E_FATAL,
+	     "could not create a tempfile, unable to proceed.\n"); 
+  }
+  for(n = 0; n < learner->tmp.used; n += fwrite(p + n, 1, learner->tmp.used - n,
+						 learner->tmp.file)) {
+    if( ferror(learner->tmp.file) ) {
+      errormsg(E_FATAL,
+	       "could not write to the tempfile, unable to proceed.\n"); 
+    }
+  }
+  free(p);
+  learner->tmp.mmap_start = NULL;
+  learner->tmp.mmap_length = 0;
+  learner->tmp.mmap_offset = 0;
+  learner->tmp.mmap_cursor = 0;
+  learner->tmp.avail = learner->tmp.used;
+  return (bool_t)1;
+}
+
+/* must unmap/ftruncate/remap if using mmap, don't touch mmap_cursor.
+   Afterwards there is room for at least one more token of any length */
 bool_t tmp_grow(learner_t *learner) {
   long offset;
+  if( !learner->tmp.file && learner->tmp.mmap_start &&
+      ((learner->tmp.used + MAX_FULL_TOKEN_LEN) >= learner->tmp.avail) ) {
+    tmp_grow_memory(learner);
+  }
   if( learner->tmp.file &&
-      ((learner->tmp.used + 2 * MAX_TOKEN_LEN) >= learner->tmp.avail) ) {
+      ((learner->tmp.used + MAX_FULL_TOKEN_LEN) >= learner->tmp.avail) ) {
 
     if( learner->tmp.mmap_start ) {
       MUNLOCK(learner->tmp.mmap_start, learner->tmp.mmap_length);
@@ -1146,8 +1573,12 @@ void tmp_write_token(learner_t *learner, const char *tok) {
 
 void tmp_close(learner_t *learner) {
   if( learner->tmp.mmap_start ) {
-    MUNLOCK(learner->tmp.mmap_start, learner->tmp.mmap_length);
-    MUNMAP(learner->tmp.mmap_start, learner->tmp.mmap_length);
+    if( !learner->tmp.file ) {
+      free(learner->tmp.mmap_start);
+    } else {
+      MUNLOCK(learner->tmp.mmap_start, learner->tmp.mmap_length);
+      MUNMAP(learner->tmp.mmap_start, learner->tmp.mmap_length);
+    }
     learner->tmp.mmap_start = NULL;
   }
   if( learner->tmp.file ) {
@@ -1232,89 +1663,181 @@ void emplist_add_to_reservoir(emplist_t *reservoir, document_count_t docno,
   }
 }
 
+/* makes room for max slots, or gives up on them if out of memory */
+void emp_slots_grow(hash_count_t max) {
+  l_item_t **n;
+
+  n = (l_item_t **)realloc(empslots.slot, sizeof(l_item_t *) * max);
+  if( n ) {
+    empslots.slot = n;
+    empslots.max = max;
+  } else {
+    empslots.valid = 0;
+  }
+}
+
+void free_emp_slots() {
+  if( empslots.slot ) {
+    free(empslots.slot);
+    empslots.slot = NULL;
+  }
+  empslots.max = 0;
+  empslots.valid = 1;
+}
+
 /***********************************************************
  * LEARNER FUNCTIONS                                       *
  ***********************************************************/
+/* releases the smaller table once every entry was moved out of it */
+void free_old_learner_hash(learner_t *learner) {
+  if( learner->old.hash ) {
+    if( learner->old.mmap_start ) {
+      MUNMAP(learner->old.mmap_start, learner->old.mmap_length);
+    } else {
+      if( u_options & (1<<U_OPTION_MMAP) ) {
+	MUNLOCK(learner->old.hash, sizeof(l_item_t) * learner->old.max_tokens);
+      }
+      free(learner->old.hash);
+      if( learner->old.B ) {
+	free(learner->old.B);
+      }
+    }
+    learner->old.hash = NULL;
+    learner->old.B = NULL;
+    learner->old.max_tokens = 0;
+    learner->old.next = 0;
+    learner->old.mmap_start = NULL;
+    learner->old.mmap_length = 0;
+  }
+}
+
 void free_learner_hash(learner_t *learner) {
+  free_old_learner_hash(learner);
   if( learner->hash ) {
     if( learner->mmap_start != NULL ) {
-      MUNMAP(learner->mmap_start, 
-	     learner->mmap_hash_offset + cat->max_tokens * sizeof(c_item_t));
+      MUNMAP(learner->mmap_start, learner->mmap_length);
       learner->mmap_start = NULL;
+      learner->mmap_length = 0;
       learner->mmap_learner_offset = 0;
       learner->mmap_hash_offset = 0;
+      learner->mmap_capacity = 0;
       learner->hash = NULL;
+      learner->B = NULL;
     }
     if( learner->hash ) {
       free(learner->hash);
       learner->hash = NULL;
     }
+    if( learner->B ) {
+      free(learner->B);
+      learner->B = NULL;
+    }
+  }
+}
+
+/* fills in the section offsets of an online memory dump whose hash
+   has room for capacity slots */
+void layout_online_header(online_header_t *h, learner_t *learner, 
+			  hash_count_t capacity) {
+  h->byteorder = ONLINE_BYTEORDER;
+  h->version = ONLINE_VERSION;
+  h->learner_size = sizeof(learner_t);
+  h->item_size = sizeof(l_item_t);
+  h->weight_size = sizeof(weight_t);
+  h->reserved = 0;
+  h->capacity = capacity;
+  h->learner_offset = PAGEROUND(strlen(MAGIC_ONLINE) + sizeof(online_header_t));
+  h->hash_offset = PAGEROUND(h->learner_offset + sizeof(learner_t));
+  h->B_offset = 0;
+  h->token_offset = PAGEROUND(h->hash_offset + capacity * sizeof(l_item_t));
+  if( learner->B ) {
+    h->B_offset = h->token_offset;
+    h->token_offset = PAGEROUND(h->B_offset + capacity * sizeof(weight_t));
   }
 }
 
-bool_t create_learner_hash(learner_t *learner, FILE *input, bool_t readonly) {
+/* reads the header which follows MAGIC_ONLINE, and checks that the
+   dump was written with the same structure layout */
+bool_t read_online_header(FILE *input, online_header_t *h) {
+  return (fread(h, sizeof(online_header_t), 1, input) == 1) &&
+    (h->byteorder == ONLINE_BYTEORDER) &&
+    (h->version == ONLINE_VERSION) &&
+    (h->learner_size == sizeof(learner_t)) &&
+    (h->item_size == sizeof(l_item_t)) &&
+    (h->weight_size == sizeof(weight_t)) &&
+    (h->hash_offset >= h->learner_offset + sizeof(learner_t)) &&
+    (h->B_offset ? 
+     ((h->B_offset >= h->hash_offset + h->capacity * sizeof(l_item_t)) &&
+      (h->token_offset >= h->B_offset + h->capacity * sizeof(weight_t))) :
+     (h->token_offset >= h->hash_offset + h->capacity * sizeof(l_item_t)));
+}
+
+bool_t create_learner_hash(learner_t *learner, online_header_t *h,
+			   FILE *input, bool_t readonly) {
   size_t j, n;
   byte_t *mmap_start;
-  long mmap_learner_offset;
-  long mmap_hash_offset;
+  size_t mmap_length;
   
   if( learner->hash ) { free_learner_hash(learner); }
 
   if( u_options & (1<<U_OPTION_MMAP) ) {
-    /* here we mmap the fixed size portion of the dump file. First
-       we mmap the learner structure portion as a fast way of loading 
-       the learner variable, then we must undo/redo the mmap because
-       we cannot know the hash table size until we've read the dumped learner_t.
-    */
-
-    mmap_learner_offset = strlen(MAGIC_ONLINE);
-    mmap_hash_offset = mmap_learner_offset + sizeof(learner_t);
+    /* here we mmap everything up to the token list, and copy the
+       learner structure out of it. The hash table and entropy sums
+       are used in place. */
+    mmap_length = h->B_offset ?
+      h->B_offset + sizeof(weight_t) * h->capacity :
+      h->hash_offset + sizeof(l_item_t) * h->capacity;
 
     mmap_start =
-      (byte_t *)MMAP(0, mmap_hash_offset,
+      (byte_t *)MMAP(0, mmap_length,
 		     PROT_READ|(readonly ? 0 : PROT_WRITE),
 		     MAP_SHARED, fileno(input), 0);
     if( mmap_start == MAP_FAILED ) { mmap_start = NULL; }
     if( mmap_start ) {
-      /* first we overwrite the learner struct with the contents of
-	 the mmapped region */
-      memcpy(learner, mmap_start + mmap_learner_offset, sizeof(learner_t));
-      
-      MUNMAP(mmap_start, mmap_hash_offset);
-      
-      mmap_start =
-	(byte_t *)MMAP(mmap_start,
-		       mmap_hash_offset + sizeof(l_item_t) * learner->max_tokens,
-		       PROT_READ|(readonly ? 0 : PROT_WRITE), 
-		       MAP_SHARED, fileno(input), 0);
-      if( mmap_start == MAP_FAILED ) { mmap_start = NULL; }
-      if( mmap_start ) {
-	/* now fill some member variables */
-	learner->mmap_start = mmap_start;
-	learner->mmap_learner_offset = mmap_learner_offset;
-	learner->mmap_hash_offset = mmap_hash_offset;
-	learner->hash = (l_item_t *)(mmap_start + mmap_hash_offset);
-	MADVISE(learner->mmap_start, 
-		learner->mmap_hash_offset + sizeof(l_item_t) * learner->max_tokens,
-		MADV_SEQUENTIAL|MADV_WILLNEED);
-	/* lock the pages to prevent swapping - on Linux, this
-	   works without root privs so long as the user limits
-	   are big enough - mine are unlimited ;-) 
-	   On other OSes, root may me necessary. */
-	MLOCK(learner->mmap_start,
-	      learner->mmap_hash_offset + sizeof(l_item_t) * learner->max_tokens);
+      memcpy(learner, mmap_start + h->learner_offset, sizeof(learner_t));
+      if( learner->max_tokens > h->capacity ) {
+	MUNMAP(mmap_start, mmap_length);
+	return 0;
       }
+
+      /* now fill some member variables */
+      learner->mmap_start = mmap_start;
+      learner->mmap_length = mmap_length;
+      learner->mmap_learner_offset = h->learner_offset;
+      learner->mmap_hash_offset = h->hash_offset;
+      /* the hash can only grow in place if we may write to it */
+      learner->mmap_capacity = readonly ? 0 : h->capacity;
+      learner->hash = (l_item_t *)(mmap_start + h->hash_offset);
+      learner->B = h->B_offset ? (weight_t *)(mmap_start + h->B_offset) : NULL;
+      MADVISE(learner->mmap_start, learner->mmap_length,
+	      MADV_SEQUENTIAL|MADV_WILLNEED);
+      /* lock the pages to prevent swapping - on Linux, this
+	 works without root privs so long as the user limits
+	 are big enough - mine are unlimited ;-) 
+	 On other OSes, root may me necessary. */
+      MLOCK(learner->mmap_start, learner->mmap_length);
     }
   }
 
   if( !learner->hash ) {
     
+    if( fseek(input, h->learner_offset, SEEK_SET) != 0 ) {
+      return 0;
+    }
     for(n = 0; n < 1; ) {
       n = fread(learner, sizeof(learner_t), 1, input);
-      if( (n == 0) && ferror(input) ) {
+      if( (n == 0) && (ferror(input) || feof(input)) ) {
 	return 0;
       }
     }
+    learner->mmap_start = NULL;
+    learner->mmap_length = 0;
+    learner->mmap_capacity = 0;
+    learner->B = NULL;
+    if( (learner->max_tokens > h->capacity) ||
+	(fseek(input, h->hash_offset, SEEK_SET) != 0) ) {
+      return 0;
+    }
 
     /* allocate hash table normally */
     learner->hash = (l_item_t *)malloc(learner->max_tokens * sizeof(l_item_t));
@@ -1332,23 +1855,83 @@ bool_t create_learner_hash(learner_t *learner, FILE *input, bool_t readonly) {
     for(n = j = 0; n < learner->max_tokens; n += j) {
       j = fread(&learner->hash[n], sizeof(l_item_t), 
 		learner->max_tokens - n, input);
-      if( (j == 0) && ferror(input) ) {
+      if( (j == 0) && (ferror(input) || feof(input)) ) {
 	errormsg(E_WARNING, "could not read online learner dump, ignoring.\n");
 	return 0;
       }
     }
 
+    if( h->B_offset ) {
+      learner->B = (weight_t *)malloc(learner->max_tokens * sizeof(weight_t));
+      if( !learner->B ) {
+	errormsg(E_WARNING, "failed to allocate %li bytes for learner hash.\n",
+		 (sizeof(weight_t) * ((long int)learner->max_tokens)));
+	return 0;
+      }
+      if( fseek(input, h->B_offset, SEEK_SET) != 0 ) {
+	return 0;
+      }
+      for(n = j = 0; n < learner->max_tokens; n += j) {
+	j = fread(&learner->B[n], sizeof(weight_t), 
+		  learner->max_tokens - n, input);
+	if( (j == 0) && (ferror(input) || feof(input)) ) {
+	  errormsg(E_WARNING, "could not read online learner dump, ignoring.\n");
+	  return 0;
+	}
+      }
+    }
+
   }
   return (learner->hash != NULL);
 }
 
+/* moves the next few entries of the smaller table into the grown
+   hash. This must not be called while holding pointers returned by
+   find_in_learner(), as they might be in the smaller table. It is
+   called once before each new token is added, and not for each
+   occurrence, so that merging the -J workers places the tokens
+   exactly as learning the files one after the other does. */
+void grow_learner_step(learner_t *learner) {
+  l_item_t *i, *k;
+  hash_count_t n;
+
+  if( learner->old.hash ) {
+    empslots.valid = 0;
+  }
+  for(n = 0; learner->old.hash && (n < LEARNER_GROW_STEP); n++) {
+    i = &learner->old.hash[learner->old.next++];
+    if( FILLEDP(i) ) {
+      k = &learner->hash[i->id & (learner->max_tokens - 1)];
+      while( FILLEDP(k) ) {
+	k++;
+	k = (k >= &learner->hash[learner->max_tokens]) ? learner->hash : k;
+      } /* guaranteed to exit since hash is larger than the old one */
+      memcpy(k, i, sizeof(l_item_t));
+      if( learner->B ) {
+	learner->B[k - learner->hash] = learner->old.B[i - learner->old.hash];
+      }
+    }
+    if( learner->old.next >= learner->old.max_tokens ) {
+      free_old_learner_hash(learner);
+    }
+  }
+}
+
+/* moves all remaining entries, before the whole hash is needed */
+void finish_learner_growth(learner_t *learner) {
+  while( learner->old.hash ) {
+    grow_learner_step(learner);
+  }
+}
+
 /* returns true if the hash could be grown, false otherwise.
-   When the hash is grown, the old values must be redistributed.
-   To do this, we reuse the l_item.lam member as a flag, since this
-   is only needed later during minimization */
+   The hash is doubled at once, but the old entries are only moved
+   over a few at a time by grow_learner_step(), so that learning
+   doesn't stall on large tables. Meanwhile, find_in_learner() also
+   looks in the smaller table. */
 bool_t grow_learner_hash(learner_t *learner) {
-  hash_count_t c, new_size;
-  l_item_t *i, temp_item;
+  l_item_t *i;
+  weight_t *b = NULL;
 
   if( !(u_options & (1<<U_OPTION_GROWHASH)) ) {
     return 0;
@@ -1364,101 +1947,81 @@ bool_t grow_learner_hash(learner_t *learner) {
 
       */
 
-      /* there are two cases - if learner is mmapped, we must malloc a
-       * new hash, otherwise we can realloc. An easy way to reduce the
-       * first case to the second is to create a throwaway hash with
-       * the old size and copy the mmapped contents to it. 
-       */
-      if( learner->mmap_start ) {
-	if( (i = (l_item_t *)malloc(learner->max_tokens * 
-				    sizeof(l_item_t))) == NULL ) {
+      /* the previous growth must be complete */
+      finish_learner_growth(learner);
+
+      if( learner->mmap_start &&
+	  ((learner->max_tokens << 1) <= learner->mmap_capacity) ) {
+	/* the mapped file has room, so the smaller table is copied
+	   out and the hash grows in place */
+	i = (l_item_t *)malloc(sizeof(l_item_t) * learner->max_tokens);
+	if( i && learner->B ) {
+	  b = (weight_t *)malloc(sizeof(weight_t) * learner->max_tokens);
+	}
+	if( !i || (learner->B && !b) ) {
+	  if( i ) { free(i); }
 	  errormsg(E_WARNING,
-		   "failed to malloc hash table for growing.\n");
+		   "failed to grow hash table.\n");
 	  return 0;
 	}
 	memcpy(i, learner->hash, sizeof(l_item_t) * learner->max_tokens);
-	free_learner_hash(learner);
-	learner->hash = i;
-
-	/* there's a MUNLOCK call below, so in theory we should
-	   balance this out by calling MLOCK here, since the i pointed
-	   region was never locked. However mlock/munlock calls do not nest,
-	   so there's no need. 
-	*/
-/* 	if( u_options & (1<<U_OPTION_MMAP) ) { */
-/* 	  MLOCK(learner->hash, sizeof(l_item_t) * learner->max_tokens); */
-/* 	} */
-      }
-
-
-      if( u_options & (1<<U_OPTION_MMAP) ) {
-	MUNLOCK(learner->hash, sizeof(l_item_t) * learner->max_tokens);
-      }
-
-      /* grow the memory around the hash */
-      if( (i = (l_item_t *)realloc(learner->hash, 
-		       sizeof(l_item_t) * 
-		       (1<<(learner->max_hash_bits+1)))) == NULL ) {
-	errormsg(E_WARNING,
-		"failed to grow hash table.\n");
-	return 0;
-      }
-      /* we need the old value of learner->max_tokens for a while yet */
-      learner->max_hash_bits++;
-
-      if( u_options & (1<<U_OPTION_MMAP) ) {
-	MLOCK(i, sizeof(l_item_t) * (1<<learner->max_hash_bits));
-      }
+	memset(learner->hash, 0, sizeof(l_item_t) * (learner->max_tokens << 1));
+	if( b ) {
+	  memcpy(b, learner->B, sizeof(weight_t) * learner->max_tokens);
+	  memset(learner->B, 0, sizeof(weight_t) * (learner->max_tokens << 1));
+	}
 
-      MADVISE(i, sizeof(l_item_t) * (1<<learner->max_hash_bits), MADV_SEQUENTIAL);
+	learner->old.hash = i;
+	learner->old.B = b;
+	learner->old.mmap_start = NULL;
+	learner->old.mmap_length = 0;
+      } else {
 
-      /* realloc doesn't initialize the memory */
-      memset(&((l_item_t *)i)[learner->max_tokens], 0, 
-	     ((1<<learner->max_hash_bits) - learner->max_tokens) * 
-	     sizeof(l_item_t));
-      learner->hash = i; 
-      
-      /* now mark every used slot */
-      for(c = 0; c < learner->max_tokens; c++) {
-	if( FILLEDP(&learner->hash[c]) ) {
-	  SETMARK(&learner->hash[c]);
+	if( (i = (l_item_t *)calloc((size_t)1<<(learner->max_hash_bits+1), 
+				    sizeof(l_item_t))) == NULL ) {
+	  errormsg(E_WARNING,
+		   "failed to grow hash table.\n");
+	  return 0;
+	}
+	if( learner->B &&
+	    ((b = (weight_t *)calloc((size_t)1<<(learner->max_hash_bits+1), 
+				     sizeof(weight_t))) == NULL) ) {
+	  free(i);
+	  errormsg(E_WARNING,
+		   "failed to grow hash table.\n");
+	  return 0;
 	}
-      }
 
-      MADVISE(i, sizeof(l_item_t) * (1<<learner->max_hash_bits), MADV_RANDOM);
-
-      /* now relocate each marked slot and clear it */
-      new_size = (1<<learner->max_hash_bits) - 1;
-      for(c = 0; c < learner->max_tokens; c++) {
-	while( MARKEDP(&learner->hash[c]) ) {
-	  /* find where it belongs */
-	  i = &learner->hash[learner->hash[c].id & new_size];
-	  while( FILLEDP(i) && !MARKEDP(i) ) {
-	    i++;
-	    i = (i > &learner->hash[new_size]) ? learner->hash : i;
-	  } /* guaranteed to exit since hash is larger than original */
-
-	  /* clear the mark - this must happen after we look for i,
-	   since it should be possible to find i == learner->hash[c] */
-	  UNSETMARK(&learner->hash[c]); 
-
-	  /* now refile */
-	  if( i != &learner->hash[c] ) {
-	    if( MARKEDP(i) ) {
-	      /* swap */
-	      memcpy(&temp_item, i, sizeof(l_item_t));
-	      memcpy(i, &learner->hash[c], sizeof(l_item_t));
-	      memcpy(&learner->hash[c], &temp_item, sizeof(l_item_t));
-	    } else {
-	      /* copy and clear */
-	      memcpy(i, &learner->hash[c], sizeof(l_item_t));
-	      memset(&learner->hash[c], 0, sizeof(l_item_t));
-	    }
-	  } 
-	  /* now &learner->hash[c] is marked iff there was a swap */
+	if( u_options & (1<<U_OPTION_MMAP) ) {
+	  MLOCK(i, sizeof(l_item_t) * (1<<(learner->max_hash_bits+1)));
 	}
+
+	MADVISE(i, sizeof(l_item_t) * (1<<(learner->max_hash_bits+1)), MADV_RANDOM);
+
+	/* if the learner is mmapped, the mapping stays until the
+	   last entry is moved */
+	learner->old.hash = learner->hash;
+	learner->old.B = learner->B;
+	learner->old.mmap_start = learner->mmap_start;
+	learner->old.mmap_length = learner->mmap_length;
+	learner->mmap_start = NULL;
+	learner->mmap_length = 0;
+	learner->mmap_learner_offset = 0;
+	learner->mmap_hash_offset = 0;
+	learner->mmap_capacity = 0;
+
+	learner->hash = i; 
+	learner->B = b;
       }
+      learner->old.max_tokens = learner->max_tokens;
+      learner->old.next = 0;
+
+      learner->max_hash_bits++;
       learner->max_tokens = (1<<learner->max_hash_bits);
+
+      /* the slots have moved, so -Q must optimize everything */
+      free_learner_delta();
+      empslots.valid = 0;
     } else {
       u_options &= ~(1<<U_OPTION_GROWHASH); /* it's the law */
       errormsg(E_WARNING,
@@ -1476,6 +2039,8 @@ bool_t read_online_learner_struct(learner_t *learner, char *path, bool_t readonl
   char *sav_filename;
   long offset;
   l_item_t *p, *e;
+  hashfun_t hf;
+  online_header_t h;
 
   /* 
    * This code malloc()s and fread()s the learner structure, or alternatively
@@ -1500,6 +2065,10 @@ bool_t read_online_learner_struct(learner_t *learner, char *path, bool_t readonl
 		  "the file %s is not a dbacl online memory dump, it will be ignored\n", 
 		  path);
 	}
+    } else if( !read_online_header(input, &h) ) {
+      errormsg(E_WARNING,
+	       "the file %s was dumped with a different layout, it will be ignored\n",
+	       path);
     } else {
       /* from here on, if a problem arises then learner is hosed, so we exit */
       ok = 1;
@@ -1507,12 +2076,28 @@ bool_t read_online_learner_struct(learner_t *learner, char *path, bool_t readonl
       /* must save some prefilled members because learner is read from disk */
       sav_filename = learner->filename;
 
-      if( !create_learner_hash(learner, input, readonly) ) {
+      if( !create_learner_hash(learner, &h, input, readonly) ) {
 	ok = 0;
 	goto skip_read_online;
       }
       /* restore members */
       learner->filename = sav_filename;
+      /* the dumped document lists point nowhere */
+      learner->doc.emp.top = 0;
+      learner->doc.emp.max = 0;
+      learner->doc.emp.stack = NULL;
+      memset(learner->doc.reservoir, 0, RESERVOIR_SIZE * sizeof(emplist_t));
+
+      /* token ids are only meaningful with the hash that made them */
+      hf = (learner->model.options & (1<<M_OPTION_HASH_MURMUR)) ? 
+	HF_MURMUR : HF_LOOKUP2;
+      learner->model.options &= ~(1<<M_OPTION_HASH_MURMUR);
+      if( (m_hf != HF_DEFAULT) && (m_hf != hf) ) {
+	errormsg(E_FATAL,
+		 "the file %s uses a different token hash (check -k switch)\n",
+		 path);
+      }
+      m_hf = hf;
 
       /* override options */
       if( (m_options != learner->model.options) ||
@@ -1536,9 +2121,12 @@ bool_t read_online_learner_struct(learner_t *learner, char *path, bool_t readonl
        tokens */
       learner->tmp.file = input;
       learner->tmp.filename = NULL;
-      learner->tmp.offset = strlen(MAGIC_ONLINE) + sizeof(learner_t) + 
-	sizeof(l_item_t) * learner->max_tokens;
+      learner->tmp.offset = h.token_offset;
       learner->tmp.iobuf = NULL;
+      learner->tmp.mmap_start = NULL;
+      learner->tmp.mmap_length = 0;
+      learner->tmp.mmap_offset = 0;
+      learner->tmp.mmap_cursor = 0;
 
       if( u_options & (1<<U_OPTION_MMAP) ) {
 	offset = PAGEALIGN(learner->tmp.offset);
@@ -1620,11 +2208,7 @@ void write_online_learner_struct(learner_t *learner, char *path) {
   FILE *output;
   char *tempname = NULL;
   bool_t ok;
-  byte_t buf[BUFSIZ+1];
-  size_t t, j, n;
   learner_t *mml;
-  long tokoff;
-  const byte_t *sp;
 
   if( !check_magic_write(path, MAGIC_ONLINE, strlen(MAGIC_ONLINE)) ) {
     /* we simply ignore this. Note that check_magic_write() already
@@ -1632,18 +2216,35 @@ void write_online_learner_struct(learner_t *learner, char *path) {
     return;
   }
 
+  finish_learner_growth(learner);
+
 
   /* if the hash table is memory mapped, then we simply update the 
-     learner structure and exit */
+     learner structure, flush the mapped pages and exit */
 
   if( learner->mmap_start != NULL ) {
     mml = (learner_t *)(learner->mmap_start + learner->mmap_learner_offset);
     memcpy(mml, learner, sizeof(learner_t));
+    if( m_hf == HF_MURMUR ) {
+      mml->model.options |= (1<<M_OPTION_HASH_MURMUR);
+    }
     /* clear some variables just to be safe */
     mml->mmap_start = NULL;
+    mml->mmap_length = 0;
     mml->mmap_learner_offset = 0;
     mml->mmap_hash_offset = 0;
+    mml->mmap_capacity = 0;
     mml->hash = NULL;
+    mml->B = NULL;
+    mml->doc.emp.top = 0;
+    mml->doc.emp.max = 0;
+    mml->doc.emp.stack = NULL;
+    memset(mml->doc.reservoir, 0, RESERVOIR_SIZE * sizeof(emplist_t));
+
+    MSYNC(learner->mmap_start, learner->mmap_length, MS_ASYNC);
+    if( learner->tmp.file && learner->tmp.mmap_start ) {
+      MSYNC(learner->tmp.mmap_start, learner->tmp.mmap_length, MS_ASYNC);
+    }
 
     return;
   }
@@ -1655,89 +2256,145 @@ void write_online_learner_struct(learner_t *learner, char *path) {
   output = mytmpfile(path, &tempname);
   if( output ) {
 
-    if( out_iobuf ) {
-      setvbuf(output, (char *)out_iobuf, (int)_IOFBF, (size_t)(BUFFER_MAG * system_pagesize));
+    ok = write_online_learner_file(learner, output);
+
+    /* the rename is atomic on posix */
+    if( !ok || (rename(tempname, path) < 0) ) {
+      errormsg(E_ERROR,
+	       "due to a potential file corruption, %s was not updated\n", 
+	       path);
+      unlink(tempname);
     }
 
-    ok = 1;
-    ok = ok &&
-      (0 < fprintf(output, MAGIC_ONLINE));
+    free(tempname);
+  }
+}
 
-    /* save current model options - don't want them to change next time we learn */
-    learner->model.options = m_options;
-    learner->model.cp = m_cp;
-    learner->model.dt = m_dt;
-    learner->u_options = u_options;
-
-    /* make sure some stuff is zeroed out */
-    /* but leave others untouched, eg doc.A, doc.S, doc.count for shannon */
-    learner->mmap_start = NULL; /* assert mmap_start == NULL */
-    learner->mmap_learner_offset = 0;
-    learner->mmap_hash_offset = 0;
-    learner->doc.emp.top = 0;
-    learner->doc.emp.max = 0;
-    learner->doc.emp.stack = NULL;
-    memset(learner->doc.reservoir, 0, RESERVOIR_SIZE * sizeof(emplist_t));
+/* writes the memory dump to output, which is closed afterwards */
+bool_t write_online_learner_file(learner_t *learner, FILE *output) {
+  bool_t ok;
+  byte_t buf[BUFSIZ+1];
+  size_t t, j, n;
+  long tokoff;
+  const byte_t *sp;
+  online_header_t h;
+  hash_count_t capacity;
 
-    /* write learner */
-    ok = ok &&
-      (0 < fwrite(learner, sizeof(learner_t), 1, output));
-    for(t = j = 0; t < learner->max_tokens; t += j) {
-      j = fwrite(&(learner->hash[t]), sizeof(l_item_t), 
-		 learner->max_tokens - t, output);
-      if( (j == 0) && ferror(output) ) {
-	ok = 0;
-	goto skip_write_online;
-      }
-    }
+  if( out_iobuf ) {
+    setvbuf(output, (char *)out_iobuf, (int)_IOFBF, (size_t)(BUFFER_MAG * system_pagesize));
+  }
+
+  finish_learner_growth(learner);
+
+  ok = 1;
+  ok = ok &&
+    (0 < fprintf(output, MAGIC_ONLINE));
+
+  /* save current model options - don't want them to change next time we learn */
+  learner->model.options = m_options;
+  learner->model.cp = m_cp;
+  learner->model.dt = m_dt;
+  learner->u_options = u_options;
+  /* the token hash travels with the model options */
+  if( m_hf == HF_MURMUR ) {
+    learner->model.options |= (1<<M_OPTION_HASH_MURMUR);
+  }
+
+  /* leave room for the hash to double in place next time */
+  capacity = learner->max_tokens;
+  if( (u_options & (1<<U_OPTION_GROWHASH)) &&
+      (learner->max_hash_bits < default_max_grow_hash_bits) ) {
+    capacity <<= 1;
+  }
+  layout_online_header(&h, learner, capacity);
+  ok = ok &&
+    (0 < fwrite(&h, sizeof(online_header_t), 1, output));
+
+  /* make sure some stuff is zeroed out */
+  /* but leave others untouched, eg doc.A, doc.S, doc.count for shannon */
+  learner->mmap_start = NULL; /* assert mmap_start == NULL */
+  learner->mmap_length = 0;
+  learner->mmap_learner_offset = 0;
+  learner->mmap_hash_offset = 0;
+  learner->mmap_capacity = 0;
+  learner->doc.emp.top = 0;
+  learner->doc.emp.max = 0;
+  learner->doc.emp.stack = NULL;
+  memset(learner->doc.reservoir, 0, RESERVOIR_SIZE * sizeof(emplist_t));
 
-    tokoff = ftell(output);
-    /* extend the size ofthe file - this is needed mostly for mmapping,
-     but it might also marginally speed up the repeated writes below */
-    if( -1 == ftruncate(fileno(output), tokoff + learner->tmp.avail) ) {
+  /* write learner, the gaps between sections are left as holes */
+  ok = ok &&
+    (fseek(output, h.learner_offset, SEEK_SET) == 0) &&
+    (0 < fwrite(learner, sizeof(learner_t), 1, output)) &&
+    (fseek(output, h.hash_offset, SEEK_SET) == 0);
+  if( !ok ) {
+    goto skip_write_online;
+  }
+  for(t = j = 0; t < learner->max_tokens; t += j) {
+    j = fwrite(&(learner->hash[t]), sizeof(l_item_t), 
+	       learner->max_tokens - t, output);
+    if( (j == 0) && ferror(output) ) {
       ok = 0;
       goto skip_write_online;
     }
-
-    /* write temporary tokens */
-    if( !tmp_seek_start(learner) ) {
-      errormsg(E_ERROR, "cannot seek in online token file %s\n", tempname);
+  }
+  /* the entropy partial sums follow, see create_learner_hash() */
+  if( learner->B ) {
+    if( fseek(output, h.B_offset, SEEK_SET) != 0 ) {
       ok = 0;
       goto skip_write_online;
     }
-    n = 0;
-    while( (n = tmp_read_block(learner, buf, BUFSIZ, &sp)) > 0 ) {
-      for(t = j = 0; t < n; t += j) {
-	j = fwrite(sp + t, 1, n - t, output);
-	if( (j == 0) && ferror(output) ) {
-	  ok = 0;
-	  goto skip_write_online;
-	}
+    for(t = j = 0; t < learner->max_tokens; t += j) {
+      j = fwrite(&(learner->B[t]), sizeof(weight_t), 
+		 learner->max_tokens - t, output);
+      if( (j == 0) && ferror(output) ) {
+	ok = 0;
+	goto skip_write_online;
       }
     }
-    /* consistency check */
-    if( (tokoff + learner->tmp.used) != ftell(output) ) {
-      ok = 0;
-      goto skip_write_online;
-    } 
+  }
 
-  skip_write_online:
-    fclose(output);
+  tokoff = h.token_offset;
+  /* extend the size ofthe file - this is needed mostly for mmapping,
+   but it might also marginally speed up the repeated writes below */
+  if( (fflush(output) != 0) ||
+      (-1 == ftruncate(fileno(output), tokoff + learner->tmp.avail)) ||
+      (fseek(output, tokoff, SEEK_SET) != 0) ) {
+    ok = 0;
+    goto skip_write_online;
+  }
 
-    if( u_options & (1<<U_OPTION_VERBOSE) ) {
-      fprintf(stdout, "writing online memory dump: %s\n", ok ? "success" : "failed");
+  /* write temporary tokens */
+  if( !tmp_seek_start(learner) ) {
+    errormsg(E_ERROR, "cannot seek in temporary token file [%s]\n", 
+	     learner->filename);
+    ok = 0;
+    goto skip_write_online;
+  }
+  n = 0;
+  while( (n = tmp_read_block(learner, buf, BUFSIZ, &sp)) > 0 ) {
+    for(t = j = 0; t < n; t += j) {
+      j = fwrite(sp + t, 1, n - t, output);
+      if( (j == 0) && ferror(output) ) {
+	ok = 0;
+	goto skip_write_online;
+      }
     }
+  }
+  /* consistency check */
+  if( (tokoff + learner->tmp.used) != ftell(output) ) {
+    ok = 0;
+    goto skip_write_online;
+  } 
 
-    /* the rename is atomic on posix */
-    if( !ok || (rename(tempname, path) < 0) ) {
-      errormsg(E_ERROR,
-	       "due to a potential file corruption, %s was not updated\n", 
-	       path);
-      unlink(tempname);
-    }
+ skip_write_online:
+  fclose(output);
 
-    free(tempname);
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    fprintf(stdout, "writing online memory dump: %s\n", ok ? "success" : "failed");
   }
+
+  return ok;
 }
 
 bool_t merge_temp_tokens(learner_t *dest, learner_t *src) {
@@ -1796,6 +2453,10 @@ bool_t merge_hashes(learner_t *dest, learner_t *src) {
   for(j = src->hash ; j != e; j++) {
     if( FILLEDP(j) ) {
       i = find_in_learner(dest, j->id);
+      if( i && !FILLEDP(i) && dest->old.hash ) {
+	grow_learner_step(dest);
+	i = find_in_learner(dest, j->id);
+      }
       if( i && !FILLEDP(i) &&
 	((100 * dest->unique_token_count) >= 
 	 (HASH_FULL * dest->max_tokens)) && grow_learner_hash(dest) ) {
@@ -1828,6 +2489,9 @@ bool_t merge_hashes(learner_t *dest, learner_t *src) {
 
 	INCREASE(i->count, j->count, 
 		 K_TOKEN_COUNT_MAX, overflow_warning);
+	if( delta.active ) {
+	  learner_delta_add(i - dest->hash);
+	}
 
 	dest->tmax = MAXIMUM(dest->tmax, i->count);
 
@@ -1841,9 +2505,12 @@ bool_t merge_hashes(learner_t *dest, learner_t *src) {
     }
   }
 
+  /* the counts are floats, so learning stops incrementing them at
+     2^FLT_MANT_DIG, and so must the sums */
   for(ci = 0; ci < ASIZE; ci++) { 
     for(cj = 0; cj < ASIZE; cj++) { 
-      dest->dig[ci][cj] += src->dig[ci][cj];
+      dest->dig[ci][cj] = MINIMUM(dest->dig[ci][cj] + src->dig[ci][cj],
+				  K_DIGRAM_COUNT_EXACT);
     }
   }
 
@@ -1905,6 +2572,344 @@ bool_t merge_learner_struct(learner_t *learner, char *path) {
   return ok;
 }
 
+/***********************************************************
+ * LEARNING WITH WORKER PROCESSES                          *
+ * the parsing state is global, so several input files are *
+ * learned by forked copies of dbacl, each with its own    *
+ * learner. The parent then merges the workers in input    *
+ * file order, which yields exactly the category that      *
+ * learning the files one after the other would have.      *
+ ***********************************************************/
+
+/* merges the tokens of src up to position end in its token list,
+   in order, filling the hash of dest exactly like hash_word_and_learn().
+   Fails if dest is full, because the token would have been dropped. */
+bool_t merge_temp_tokens_upto(learner_t *dest, learner_t *src, long end) {
+  hash_value_t id;
+  byte_t buf[BUFSIZ+1];
+  char tok[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  size_t n = 0;
+  long pos;
+
+  const byte_t *p;
+  char *q;
+
+  l_item_t *i, *j;
+
+  if( !tmp_seek_end(dest) ) {
+    errormsg(E_ERROR, "cannot seek in temporary token file [%s]\n", 
+	     dest->filename);
+    return 0;
+  }
+
+  q = tok;
+  while( ((pos = tmp_get_pos(src)) < end) &&
+	 ((n = tmp_read_block(src, buf, (size_t)MINIMUM(BUFSIZ, end - pos), 
+			      &p)) > 0) ) {
+    while( n-- > 0 ) {
+      if( *p != TOKENSEP) {
+	*q++ = *p; /* copy into tok */
+      } else { /* interword space */ 
+	*q = 0; /* append NUL to tok */
+	id = hash_full_token(tok);
+	i = find_in_learner(dest, id);
+	if( i && !FILLEDP(i) && dest->old.hash ) {
+	  grow_learner_step(dest);
+	  i = find_in_learner(dest, id);
+	}
+	if( i && !FILLEDP(i) &&
+	    ((100 * dest->unique_token_count) >= 
+	     (HASH_FULL * dest->max_tokens)) && grow_learner_hash(dest) ) {
+	  i = find_in_learner(dest, id);
+	}
+	if( !i || 
+	    (!FILLEDP(i) && ((100 * dest->unique_token_count) >= 
+			     (HASH_FULL * dest->max_tokens))) ) {
+	  return 0;
+	}
+	if( !FILLEDP(i) ) {
+	  j = find_in_learner(src, id);
+	  if( !j || !FILLEDP(j) ) {
+	    return 0;
+	  }
+
+	  SET(i->id, id);
+
+	  INCREMENT(dest->unique_token_count, 
+		    K_TOKEN_COUNT_MAX, overflow_warning);
+
+	  i->typ = j->typ;
+
+	  /* order accounting */
+	  dest->max_order = MAXIMUM(dest->max_order,i->typ.order);
+
+	  INCREMENT(dest->fixed_order_unique_token_count[i->typ.order],
+		    K_TOKEN_COUNT_MAX, overflow_warning);
+
+	  tmp_grow(dest); /* just in case we're full */
+	  tmp_write_token(dest, tok);
+	}
+	q = tok; /* reset q */
+      }
+      p++;
+    }
+  }
+
+  return (tmp_get_pos(src) == end);
+}
+
+/* the parent merges the workers one input file at a time: first
+   the new tokens of that file, then the document entropies in order.
+   The counts are simply added at the end. */
+bool_t merge_learner_workers(learner_t *learner) {
+  learner_t *part;
+  FILE **in;
+  options_t m_sav, u_sav;
+  score_t *v = NULL;
+  document_count_t top, max = 0, d;
+  long f, end;
+  int k;
+  bool_t ok = 1;
+
+  part = (learner_t *)calloc(workers.count, sizeof(learner_t));
+  in = (FILE **)calloc(workers.count, sizeof(FILE *));
+  if( !part || !in ) {
+    errormsg(E_FATAL, "not enough memory to merge the workers\n");
+  }
+
+  m_sav = m_options;
+  u_sav = u_options;
+  /* the dumps are read once, no point mapping them */
+  u_options &= ~(1<<U_OPTION_MMAP);
+
+  for(k = 0; k < workers.count; k++) {
+    init_learner(&part[k], workers.w[k].dump, 1);
+    /* a loaded dump has no temporary token file of its own */
+    ok = ok && !part[k].tmp.filename && tmp_seek_start(&part[k]);
+    in[k] = fopen(workers.w[k].part, "rb");
+    ok = ok && in[k];
+  }
+
+  m_options = m_sav;
+  u_options = u_sav;
+
+  for(f = 0; ok; f++) {
+    k = f % workers.count;
+    if( fread(&end, sizeof(long), 1, in[k]) != 1 ) {
+      break; /* no more files */
+    }
+    ok = (fread(&top, sizeof(document_count_t), 1, in[k]) == 1);
+    if( ok && (top > max) ) {
+      max = top;
+      v = (score_t *)realloc(v, max * sizeof(score_t));
+      if( !v ) {
+	errormsg(E_FATAL, "not enough memory to merge the workers\n");
+      }
+    }
+    ok = ok && 
+      ((top == 0) || (fread(v, sizeof(score_t), top, in[k]) == top)) &&
+      merge_temp_tokens_upto(learner, &part[k], end);
+    for(d = 0; ok && (d < top); d++) {
+      learner->doc.A += -v[d];
+      learner->doc.S += (v[d] * v[d]);
+    }
+  }
+
+  for(k = 0; k < workers.count; k++) {
+    if( ok ) {
+      ok = 
+	(fgetc(in[k]) == EOF) &&
+	(tmp_get_pos(&part[k]) == part[k].tmp.used) &&
+	merge_hashes(learner, &part[k]);
+      learner->doc.count += part[k].doc.count;
+      learner->doc.nullcount += part[k].doc.nullcount;
+    }
+    if( in[k] ) { fclose(in[k]); }
+    free_learner(&part[k]);
+  }
+
+  if( v ) { free(v); }
+  free(in);
+  free(part);
+
+  return ok;
+}
+
+/* the worker writes where its last file ends in the token list, and
+   the entropies of the documents in that file */
+void write_worker_part(learner_t *learner) {
+  long end = learner->tmp.used;
+  if( (fwrite(&end, sizeof(long), 1, workers.part) == 1) &&
+      (fwrite(&workers.top, sizeof(document_count_t), 1, workers.part) == 1) &&
+      (workers.top > 0) ) {
+    fwrite(workers.shannon, sizeof(score_t), workers.top, workers.part);
+  }
+  workers.top = 0;
+}
+
+void log_worker_shannon(score_t shannon) {
+  if( workers.top >= workers.max ) {
+    workers.max = 2 * workers.max + 64;
+    workers.shannon = (score_t *)realloc(workers.shannon,
+					 workers.max * sizeof(score_t));
+    if( !workers.shannon ) {
+      errormsg(E_FATAL, "not enough memory for document entropies\n");
+    }
+  }
+  workers.shannon[workers.top++] = shannon;
+}
+
+/* the workers take turns reading the input files */
+bool_t learner_claim_file() {
+  if( (workers.file++ % workers.count) != workers.id ) {
+    return 0;
+  }
+  /* what we learned so far belongs to our previous file */
+  if( workers.claimed ) {
+    write_worker_part(&learner);
+  }
+  workers.claimed = 1;
+  return 1;
+}
+
+/* instead of optimizing, a worker leaves its learner to the parent */
+void finish_learner_worker(learner_t *learner) {
+  FILE *output;
+  bool_t ok;
+
+  if( workers.claimed ) {
+    write_worker_part(learner);
+  }
+  ok = !ferror(workers.part);
+  ok = (fclose(workers.part) == 0) && ok;
+
+  /* a worker whose hash could not grow any more has dropped tokens */
+  ok = ok && !overflow_warning && !digramic_overflow_warning &&
+    ((learner->max_hash_bits < default_max_grow_hash_bits) ||
+     ((100 * learner->unique_token_count) < 
+      (HASH_FULL * learner->max_tokens)));
+
+  output = fopen(workers.w[workers.id].dump, "wb");
+  if( output ) {
+    ok = write_online_learner_file(learner, output) && ok;
+  } else {
+    ok = 0;
+  }
+
+  exit_code = ok ? 0 : 1;
+}
+
+/* returns 1 in the parent, once the workers have learned all the
+   files, otherwise the caller learns the files itself */
+bool_t learner_fork_workers(char **files) {
+  struct stat statinfo;
+  FILE *f;
+  pid_t pid;
+  options_t u_sav;
+  int k, n, status;
+  bool_t ok, dirs = 0;
+
+  if( (max_threads < 2) || regex_count || *online || ronline_count ||
+      (u_options & (1<<U_OPTION_CONFIDENCE)) ||
+      (u_options & (1<<U_OPTION_DECIMATE)) ||
+      (u_options & (1<<U_OPTION_DEBUG)) ) {
+    return 0;
+  }
+  /* files which can't be read are reported as usual */
+  for(n = 0; files[n]; n++) {
+    if( (access(files[n], R_OK) != 0) || (stat(files[n], &statinfo) != 0) ) {
+      return 0;
+    }
+    dirs = dirs || S_ISDIR(statinfo.st_mode);
+  }
+  if( (n < 2) && !dirs ) {
+    return 0;
+  }
+
+  workers.count = max_threads;
+  workers.w = (learner_worker_t *)calloc(workers.count, 
+					 sizeof(learner_worker_t));
+  if( !workers.w ) {
+    errormsg(E_FATAL, "not enough memory for the workers\n");
+  }
+  ok = 1;
+  for(k = 0; ok && (k < workers.count); k++) {
+    /* reserve the file names now, the workers overwrite them */
+    if( (f = mytmpfile(learner.filename, &workers.w[k].dump)) ) {
+      fclose(f);
+    }
+    if( (f = mytmpfile(learner.filename, &workers.w[k].part)) ) {
+      fclose(f);
+    }
+    ok = workers.w[k].dump && workers.w[k].part;
+  }
+
+  fflush(stdout);
+  fflush(stderr);
+  for(k = 0; ok && (k < workers.count); k++) {
+    workers.w[k].pid = fork();
+    if( workers.w[k].pid == 0 ) {
+      workers.id = k;
+      workers.part = fopen(workers.w[k].part, "wb");
+      if( !workers.part ) {
+	errormsg(E_FATAL, "cannot open %s\n", workers.w[k].part);
+      }
+      claim_file_fun = learner_claim_file;
+      max_threads = 1;
+      /* the parent does the talking */
+      u_options &= ~(1<<U_OPTION_VERBOSE);
+      /* the merge can reproduce a full hash, but not tokens a worker
+	 dropped on its own */
+      u_options |= (1<<U_OPTION_GROWHASH);
+      default_max_grow_hash_bits = MAX_HASH_BITS;
+      return 0;
+    }
+    ok = (workers.w[k].pid != -1);
+  }
+
+  for(k = 0; k < workers.count; k++) {
+    if( workers.w[k].pid > 0 ) {
+      do {
+	pid = waitpid(workers.w[k].pid, &status, 0);
+      } while( (pid == -1) && (errno == EINTR) );
+      ok = ok && (pid == workers.w[k].pid) && 
+	WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+    }
+  }
+
+  if( !ok ) {
+    errormsg(E_WARNING, 
+	     "could not learn with worker processes, learning serially\n");
+  } else {
+    u_sav = u_options;
+    init_learner(&learner, online, 0);
+    ok = merge_learner_workers(&learner);
+    if( !ok ) {
+      free_learner(&learner);
+      u_options = u_sav;
+      errormsg(E_WARNING, 
+	       "the workers could not be merged (try a bigger hash with -H), "
+	       "learning serially\n");
+    }
+  }
+
+  for(k = 0; k < workers.count; k++) {
+    if( workers.w[k].dump ) {
+      unlink(workers.w[k].dump);
+      free(workers.w[k].dump);
+    }
+    if( workers.w[k].part ) {
+      unlink(workers.w[k].part);
+      free(workers.w[k].part);
+    }
+  }
+  free(workers.w);
+  workers.w = NULL;
+  workers.count = 0;
+
+  return ok;
+}
+
 /* returns an approximate binomial r.v.; if np < 10 and n > 20, 
  * a Poisson approximation is used, else the variable is exact.
  */   
@@ -1947,15 +2952,18 @@ void update_shannon_partials(learner_t *learner, bool_t fulldoc) {
     if( learner->doc.emp.top > 0 ) {
       /* assume all marks are zero to start with */
       for(i = 0; i < learner->doc.emp.top; i++) {
-	l_item_t *p = find_in_learner(learner, learner->doc.emp.stack[i]);
-	if( p && !MARKEDP(p) ) {
+	l_item_t *p = empslots.valid ? empslots.slot[i] :
+	  find_in_learner(learner, learner->doc.emp.stack[i]);
+	if( p && FILLEDP(p) && !MARKEDP(p) ) {
 	  ell = ((weight_t)p->tmp.read.eff)/learner->doc.emp.top;
 
-	  /* it would be nice to be able to digitize p->B, but ell is
+	  /* it would be nice to be able to digitize B, but ell is
 	     often smaller than the smallest value, and if there are
 	     many documents, there could simultaneously be overflow on the most
-	     frequent features. So we need p->B to be a floating point type. */
-	  p->B += ell;
+	     frequent features. So we need B to be a floating point type. */
+	  if( learner->B ) {
+	    *find_learner_B(learner, p) += ell;
+	  }
 
 	  /* the standard entropy convention is that 0*inf = 0. here, if
 	   * ell is so small that log(ell) is infinite, we pretend ell
@@ -1982,11 +2990,15 @@ void update_shannon_partials(learner_t *learner, bool_t fulldoc) {
 /* 	      -learner->doc.emp.shannon, (learner->doc.emp.shannon * learner->doc.emp.shannon)); */
       learner->doc.A += -learner->doc.emp.shannon;
       learner->doc.S += (learner->doc.emp.shannon * learner->doc.emp.shannon);
+      if( workers.id > -1 ) {
+	log_worker_shannon(learner->doc.emp.shannon);
+      }
 
       /* clear the empirical counts and marks */
       for(i = 0; i < learner->doc.emp.top; i++) {
-	l_item_t *p = find_in_learner(learner, learner->doc.emp.stack[i]);
-	if( p && MARKEDP(p) ) {
+	l_item_t *p = empslots.valid ? empslots.slot[i] :
+	  find_in_learner(learner, learner->doc.emp.stack[i]);
+	if( p && FILLEDP(p) && MARKEDP(p) ) {
 	  p->tmp.read.eff = 0;
 	  UNSETMARK(p);
 	}
@@ -1994,6 +3006,7 @@ void update_shannon_partials(learner_t *learner, bool_t fulldoc) {
 
       /* now reset the empirical features */
       learner->doc.emp.top = 0;
+      empslots.valid = 1;
 
     }
   }
@@ -2002,12 +3015,85 @@ void update_shannon_partials(learner_t *learner, bool_t fulldoc) {
   }
 }
 
-void calc_shannon(learner_t *learner) {
-  l_item_t *i, *e;
-  document_count_t c, n;
+/* sums the weights of the tokens of a reservoir document */
+static score_t reservoir_lambda(learner_t *learner, emplist_t *empl) {
+  l_item_t *i;
   hash_count_t q;
+  score_t score = 0;
+  double Lambda;
+
+  for(q = 0; q < empl->top; q++) {
+    i = find_in_learner(learner, empl->stack[q]);
+    if( i && NOTNULL(i->lam) ) {
+      Lambda = UNPACK_LAMBDA(i->lam);
+      if( i->typ.order == 1 ) {
+	Lambda += UNPACK_RWEIGHTS(i->tmp.min.dref) - learner->logZ;
+      }
+      score += Lambda;
+    }
+  }
+  return score;
+}
+
+static void *learner_reservoir_thread(void *arg) {
+  learner_reservoir_t *lv = (learner_reservoir_t *)arg;
+  int c;
+  for(c = lv->thread; c < RESERVOIR_SIZE; c += lv->threads) {
+    if( lv->learner->doc.reservoir[c].stack ) {
+      lv->score[c] = 
+	reservoir_lambda(lv->learner, &lv->learner->doc.reservoir[c]);
+    }
+  }
+  return NULL;
+}
+
+/* scores the reservoir documents on up to max_threads threads. The
+   hash is only read, so the documents are independent. */
+static void score_reservoir(learner_t *learner, score_t *score) {
+  learner_reservoir_t lv;
+#if defined HAVE_LIBPTHREAD
+  learner_reservoir_t tlv[RESERVOIR_SIZE];
+  pthread_t tid[RESERVOIR_SIZE];
+  int z, n;
+#endif
+
+  lv.learner = learner;
+  lv.score = score;
+  lv.thread = 0;
+  lv.threads = 1;
+#if defined HAVE_LIBPTHREAD
+  lv.threads = MINIMUM(max_threads, RESERVOIR_SIZE);
+  if( lv.threads > 1 ) {
+    for(z = 0; z < lv.threads; z++) {
+      tlv[z] = lv;
+      tlv[z].thread = z;
+    }
+    /* documents of threads which can't be created are done here */
+    for(n = 1; n < lv.threads; n++) {
+      if( pthread_create(&tid[n], NULL, 
+			 learner_reservoir_thread, &tlv[n]) != 0 ) {
+	break;
+      }
+    }
+    for(z = n; z < lv.threads; z++) {
+      learner_reservoir_thread(&tlv[z]);
+    }
+    learner_reservoir_thread(&tlv[0]);
+    for(z = 1; z < n; z++) {
+      pthread_join(tid[z], NULL);
+    }
+    return;
+  }
+#endif
+  learner_reservoir_thread(&lv);
+}
+
+void calc_shannon(learner_t *learner) {
+  l_item_t *i, *e;
+  document_count_t c, n;
   emplist_t *empl;
   score_t score;
+  score_t rscore[RESERVOIR_SIZE];
   score_t effective_count = 0.0;
   double Lambda, jensen, s2, mu;
  
@@ -2053,13 +3139,13 @@ void calc_shannon(learner_t *learner) {
     jensen = 0.0;
     e = learner->hash + learner->max_tokens;
     for(i = learner->hash; i != e; i++) {
-      if( NOTNULL(i->lam) ) {
+      if( NOTNULL(i->lam) && learner->B ) {
 	Lambda = UNPACK_LAMBDA(i->lam);
 	if( i->typ.order == 1 ) {
 	  Lambda += UNPACK_RWEIGHTS(i->tmp.min.dref) - learner->logZ;
 	}
-	learner->mu += (Lambda * i->B);
-	jensen += (Lambda * Lambda * i->B);
+	learner->mu += (Lambda * learner->B[i - learner->hash]);
+	jensen += (Lambda * Lambda * learner->B[i - learner->hash]);
       }
     }
 
@@ -2069,25 +3155,14 @@ void calc_shannon(learner_t *learner) {
     mu = 0.0;
     s2 = 0.0;
     n = 1;
+    score_reservoir(learner, rscore);
     for(c = 0; c < RESERVOIR_SIZE; c++) {
       empl = &(learner->doc.reservoir[c]);
       if( !empl->stack  ) {
 	n++;
 	continue;
       } else {
-	score = 0;
-	for(q = 0; q < empl->top; q++) {
-	  i = find_in_learner(learner, empl->stack[q]);
-	  if( i && NOTNULL(i->lam) ) {
-	    Lambda = UNPACK_LAMBDA(i->lam);
-	    if( i->typ.order == 1 ) {
-	      Lambda += UNPACK_RWEIGHTS(i->tmp.min.dref) - learner->logZ;
-	    }
-	    score += Lambda;
-	  }
-	}
-
-	score = score/empl->top + empl->shannon;
+	score = rscore[c]/empl->top + empl->shannon;
 	if( u_options & (1<<U_OPTION_VERBOSE) &&
 	    u_options & (1<<U_OPTION_CONFIDENCE) ) {
 	  fprintf(stdout, 
@@ -2186,6 +3261,7 @@ void count_mbox_messages(learner_t *learner, Mstate mbox_state, char *textbuf) {
 
 l_item_t *find_in_learner(learner_t *learner, hash_value_t id) {
     register l_item_t *i, *loop;
+    l_item_t *k;
     /* start at id */
     i = loop = &learner->hash[id & (learner->max_tokens - 1)];
 
@@ -2202,11 +3278,35 @@ l_item_t *find_in_learner(learner_t *learner, hash_value_t id) {
 	}
     }
 
-    /* empty slot, so not found */
+    /* empty slot, so not found - unless it wasn't moved yet */
+    if( learner->old.hash ) {
+	k = loop = &learner->old.hash[id & (learner->old.max_tokens - 1)];
+	while( FILLEDP(k) ) {
+	    if( EQUALP(k->id,id) ) {
+		return k;
+	    }
+	    k++;
+	    k = (k >= &learner->old.hash[learner->old.max_tokens]) ? 
+		learner->old.hash : k; 
+	    if( k == loop ) {
+		break;
+	    }
+	}
+    }
 
     return i; 
 }
 
+/* the entropy partial sums are kept apart from the hash, with one
+   per slot, since they are only needed at the end of each document */
+weight_t *find_learner_B(learner_t *learner, l_item_t *i) {
+  if( learner->old.hash && (i >= learner->old.hash) &&
+      (i < learner->old.hash + learner->old.max_tokens) ) {
+    return &learner->old.B[i - learner->old.hash];
+  }
+  return &learner->B[i - learner->hash];
+}
+
 
 /* places the token in the global hash and writes the
    token to a temporary file for later, then updates
@@ -2242,6 +3342,10 @@ void hash_word_and_learn(learner_t *learner,
 
     id = hash_full_token(tok);
     i = find_in_learner(learner, id);
+    if( i && !FILLEDP(i) && learner->old.hash ) {
+      grow_learner_step(learner);
+      i = find_in_learner(learner, id);
+    }
 
     if( i && !FILLEDP(i) &&
 	((100 * learner->unique_token_count) >= 
@@ -2285,14 +3389,29 @@ void hash_word_and_learn(learner_t *learner,
 	tmp_write_token(learner, tok);
       }
 
-      INCREMENT(i->count, K_TOKEN_COUNT_MAX, overflow_warning);
-      learner->tmax = MAXIMUM(learner->tmax, i->count);
+      /* when the table is full, the token is dropped, but it still
+	 counts towards the document length */
+      if( FILLEDP(i) ) {
+	INCREMENT(i->count, K_TOKEN_COUNT_MAX, overflow_warning);
+	if( delta.active ) {
+	  learner_delta_add(i - learner->hash);
+	}
+	learner->tmax = MAXIMUM(learner->tmax, i->count);
+      }
 
       if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
 	if( (learner->doc.emp.top < learner->doc.emp.max) ||
 	    emplist_grow(&learner->doc.emp) ) {
-	  i->tmp.read.eff++; /* this can never overflow before i->count */
-	  UNSETMARK(i); /* needed for calculating shannon */
+	  if( FILLEDP(i) ) {
+	    i->tmp.read.eff++; /* this can never overflow before i->count */
+	    UNSETMARK(i); /* needed for calculating shannon */
+	  }
+	  if( empslots.valid && (learner->doc.emp.top >= empslots.max) ) {
+	    emp_slots_grow(learner->doc.emp.max);
+	  }
+	  if( empslots.valid ) {
+	    empslots.slot[learner->doc.emp.top] = FILLEDP(i) ? i : NULL;
+	  }
 	  learner->doc.emp.stack[learner->doc.emp.top++] = i->id;
 	}
       }
@@ -2368,6 +3487,7 @@ void init_learner(learner_t *learner, char *opath, bool_t readonly) {
   learner->s2 = 0.0;
   learner->max_order = 0;
   memset(learner->mediaprobs, 0 , TOKEN_CLASS_MAX * sizeof(score_t));
+  memset(&learner->delta, 0, sizeof(learner->delta));
 
   learner->doc.A = 0.0;
   learner->doc.S = 0.0;
@@ -2385,9 +3505,12 @@ void init_learner(learner_t *learner, char *opath, bool_t readonly) {
   learner->u_options = u_options;
 
   learner->mmap_start = NULL;
+  learner->mmap_length = 0;
   learner->mmap_learner_offset = 0;
   learner->mmap_hash_offset = 0;
+  learner->mmap_capacity = 0;
   learner->hash = NULL;
+  learner->B = NULL;
 
   /* init character frequencies */
   for(i = 0; i < ASIZE; i++) { 
@@ -2421,45 +3544,35 @@ void init_learner(learner_t *learner, char *opath, bool_t readonly) {
 	       (sizeof(l_item_t) * ((long int)learner->max_tokens)));
     }
 
-    /* open temporary file for writing tokens */
-    learner->tmp.file = 
-      mytmpfile(learner->filename ? learner->filename : progname, 
-		&learner->tmp.filename);
-    /* set this: in case of a fatal signal, we can unlink the temprile */
-    cleanup.tempfile = learner->tmp.filename;
-
-    learner->tmp.iobuf = NULL;   /* can't reuse in_iobuf or out_iobuf */
+    learner->tmp.file = NULL;
+    learner->tmp.filename = NULL;
+    learner->tmp.iobuf = NULL;
     learner->tmp.offset = 0;
     learner->tmp.avail = 0;
     learner->tmp.used = 0;
-    learner->tmp.mmap_start = NULL;
     learner->tmp.mmap_offset = 0;
     learner->tmp.mmap_length = 0;
     learner->tmp.mmap_cursor = 0;
 
-    if( learner->tmp.file ) {
-#if defined HAVE_POSIX_MEMALIGN
-      /* buffer must exist until after fclose() */
-      if( 0 != posix_memalign(&learner->tmp.iobuf, system_pagesize, 
-			      BUFFER_MAG * system_pagesize) ) {
-	learner->tmp.iobuf = NULL;
-      }
-#elif defined HAVE_MEMALIGN
-      /* buffer can't be free()'d */
-      learner->tmpiobuf = (void *)memalign(system_pagesize, 
-					   BUFFER_MAG * system_pagesize);
-#elif defined HAVE_VALLOC
-      /* buffer can't be free()'d */
-      learner->tmpiobuf = (void *)valloc(BUFFER_MAG * system_pagesize);
-#endif
-      if( learner->tmp.iobuf ) {
-	setvbuf(learner->tmp.file, (char *)learner->tmp.iobuf, (int)_IOFBF, 
-		(size_t)(BUFFER_MAG * system_pagesize));
-      }
+    /* temporary tokens are kept in memory until there are too many */
+    learner->tmp.mmap_start = (byte_t *)malloc(TOKEN_LIST_GROW);
+    if( learner->tmp.mmap_start ) {
+      learner->tmp.avail = TOKEN_LIST_GROW;
+      learner->tmp.mmap_length = TOKEN_LIST_GROW;
+    } else {
+      tmp_open_file(learner);
     }
 
   }
 
+  /* a dump is only written once the hash has finished growing */
+  learner->old.hash = NULL;
+  learner->old.B = NULL;
+  learner->old.max_tokens = 0;
+  learner->old.next = 0;
+  learner->old.mmap_start = NULL;
+  learner->old.mmap_length = 0;
+
   if( u_options & (1<<U_OPTION_MMAP) ) {
     MLOCK(learner->hash, sizeof(l_item_t) * learner->max_tokens);
   }
@@ -2467,6 +3580,16 @@ void init_learner(learner_t *learner, char *opath, bool_t readonly) {
   MADVISE(learner->hash, sizeof(l_item_t) * learner->max_tokens, 
 	  MADV_SEQUENTIAL);
 
+  if( (m_options & (1<<M_OPTION_CALCENTROPY)) && !learner->B ) {
+    learner->B = (weight_t *)calloc(learner->max_tokens, sizeof(weight_t));
+    if( !learner->B ) {
+      errormsg(E_WARNING,
+	       "disabling entropy. Not enough memory? I couldn't allocate %li bytes\n",
+	       sizeof(weight_t) * ((long int)learner->max_tokens));
+      m_options &= ~(1<<M_OPTION_CALCENTROPY);
+    }
+  }
+
   if( m_options & (1<<M_OPTION_CALCENTROPY) ) {
     learner->doc.emp.max = system_pagesize/sizeof(hash_count_t);
     learner->doc.emp.stack = 
@@ -2498,10 +3621,9 @@ void free_learner(learner_t *learner) {
     }
   }
 
-  if( learner->tmp.file ) {
-    fclose(learner->tmp.file);
-    learner->tmp.file = NULL;
-  }
+  free_emp_slots();
+
+  tmp_close(learner);
 
   cleanup_tempfiles();
 }
@@ -2540,6 +3662,7 @@ void make_dirichlet_digrams(learner_t *learner) {
   float H[ASIZE];
   float V[ASIZE];
   float F[ASIZE];
+  weight_t x[ASIZE];
   double prev_alpha;
   double K, t;
 
@@ -2615,12 +3738,14 @@ void make_dirichlet_digrams(learner_t *learner) {
     for(j = AMIN; j < ASIZE; j++) {
       t += learner->dig[i][j];
     }
+    t = 1.0/(t + dirichlet.alpha);
+    for(j = 0; j < ASIZE; j++) {
+      x[j] = ((weight_t)learner->dig[i][j] + dirichlet.u[j]) * t;
+    }
+    log_weights(x, ASIZE);
     for(j = AMIN; j < ASIZE; j++) {
       /* note: simulate the effect of digitizing the digrams */
-      learner->dig[i][j] = 
-	UNPACK_DIGRAMS(PACK_DIGRAMS(log(((weight_t)learner->dig[i][j] + 
-					 dirichlet.u[j]) / 
-					(t + dirichlet.alpha)))); 
+      learner->dig[i][j] = UNPACK_DIGRAMS(PACK_DIGRAMS(MINIMUM(x[j], 0.0)));
       if( 1 && u_options & (1<<U_OPTION_DEBUG) ) {
 	fprintf(stdout,
 		"learner->dig[%d][%d] = %f\n", 
@@ -2702,6 +3827,7 @@ void make_mle_digrams(learner_t *learner) {
   alphabet_size_t i, j;
   double total;
   double missing;
+  weight_t x[ASIZE];
 
   /* for the mle we use a slightly modified emprirical frequency histogram.
      This is necessary because the true mle causes a singularity in classification
@@ -2723,15 +3849,17 @@ void make_mle_digrams(learner_t *learner) {
     if( total > 0.0 ) {
       if( missing > 0.0 ) {
 	missing = 1.0/missing;
-	for(j = AMIN; j < ASIZE; j++) {
-	  learner->dig[i][j] =
-	    UNPACK_DIGRAMS(PACK_DIGRAMS(log((learner->dig[i][j]/total) * (1.0 - missing) + missing)));
-	}	
+	total = (1.0 - missing)/total;
       } else {
-	for(j = AMIN; j < ASIZE; j++) {
-	  learner->dig[i][j] = 
-	    UNPACK_DIGRAMS(PACK_DIGRAMS(log(learner->dig[i][j] / total)));
-	}
+	total = 1.0/total;
+      }
+      for(j = 0; j < ASIZE; j++) {
+	x[j] = learner->dig[i][j] * total + missing;
+      }
+      log_weights(x, ASIZE);
+      for(j = AMIN; j < ASIZE; j++) {
+	learner->dig[i][j] = 
+	  UNPACK_DIGRAMS(PACK_DIGRAMS(MINIMUM(x[j], 0.0)));
       }
     } else {
       for(j = AMIN; j < ASIZE; j++) {
@@ -2820,33 +3948,47 @@ void transpose_digrams(learner_t *learner) {
   }
 }
 
-void recompute_ed(learner_t *learner, weight_t *plogzon, weight_t *pdiv, 
-		  int i, weight_t lam[ASIZE], weight_t Xi) {
-  register alphabet_size_t j;
+/* lam[] and dig[] hold the weights and transition counts of the n
+   columns of a row which have any transitions */
+void recompute_ed(weight_t *plogzon, weight_t *pdiv, int n,
+		  weight_t lam[ASIZE], weight_t dig[ASIZE], weight_t Xi) {
+  int k;
   weight_t logA = log((weight_t)(ASIZE - AMIN));
   weight_t logzon, div;
-  weight_t maxlogz, maxlogz2, tmp;
+  weight_t maxlogz, tmp, etmp;
+  weight_t x[ASIZE];
+
+  /* log(1 - exp(-lam)) is -inf for zero weights */
+  for(k = 0; k < n; k++) {
+    x[k] = -lam[k];
+  }
+  exp_weights(x, n);
+  for(k = 0; k < n; k++) {
+    x[k] = 1.0 - x[k];
+  }
+  log_weights(x, n);
 
   maxlogz = 0.0;
-  maxlogz2 = log(0.0);
-  for(j = AMIN; j < ASIZE; j++) {
-    if( lam[j] > 0.0 ) {
-      tmp = lam[j] + log(1.0 - exp(-lam[j])) - logA;
-      if( maxlogz < tmp ) {
-	maxlogz2 = maxlogz;
-	maxlogz = tmp;
-      }
+  for(k = 0; k < n; k++) {
+    tmp = lam[k] + x[k] - logA;
+    if( maxlogz < tmp ) {
+      maxlogz = tmp;
     }
   }
 
+  tmp = -logA - maxlogz;
+  etmp = exp(tmp);
+  for(k = 0; k < n; k++) {
+    x[k] = lam[k] + tmp;
+  }
+  exp_weights(x, n);
 
   logzon = exp(0.0 - maxlogz);
   div = 0.0;
-  for(j = AMIN; j < ASIZE; j++) {
-    if( lam[j] > 0.0 ) {
-      tmp = -logA - maxlogz;
-      logzon += (exp( lam[j] + tmp) - exp(tmp));
-      div += lam[j] * learner->dig[i][j];
+  for(k = 0; k < n; k++) {
+    if( lam[k] > 0.0 ) {
+      logzon += (x[k] - etmp);
+      div += lam[k] * dig[k];
     }
   }
 
@@ -2866,23 +4008,36 @@ void recompute_ed(learner_t *learner, weight_t *plogzon, weight_t *pdiv,
 
 void make_entropic_digrams(learner_t *learner) {
   weight_t lam[ASIZE];
-  weight_t lam_delta, old_lam, logt, maxlogt;
+  weight_t cnt[ASIZE];
+  weight_t logp[ASIZE];
+  alphabet_size_t col[ASIZE];
+  weight_t lam_delta, old_lam, logt, maxlogt, w;
   weight_t Xi, logXi, logzon, div, old_logzon, old_div;
   weight_t logA = log((weight_t)(ASIZE - AMIN));
   register alphabet_size_t i, j;
-  int itcount;
+  int itcount, k, n;
 
   for(i = AMIN; i < ASIZE; i++) {
 
-    /* initializations */
+    /* initializations. Only the columns with transitions can get
+       a positive weight, so they are packed together */
     Xi = 0.0;
+    n = 0;
     for(j = AMIN; j < ASIZE; j++) {
       Xi += learner->dig[i][j];
-      lam[j] = 0.0;
+      if( learner->dig[i][j] > 0.0 ) {
+	col[n] = j;
+	cnt[n] = learner->dig[i][j];
+	logp[n] = learner->dig[i][j];
+	lam[n] = 0.0;
+	n++;
+      }
     }
     logXi = log(Xi);
+    /* the empirical log frequencies don't change while iterating */
+    log_weights(logp, n);
 
-    recompute_ed(learner, &logzon, &div, i, lam, Xi);
+    recompute_ed(&logzon, &div, n, lam, cnt, Xi);
 
     /* now iterate - this is like minimize_learner_divergence() */
     itcount = 0;
@@ -2893,38 +4048,36 @@ void make_entropic_digrams(learner_t *learner) {
       old_div = div;
 
       lam_delta = 0.0;
-      for(j = AMIN; j < ASIZE; j++) {
-	if( learner->dig[i][j] > 0.0 ) {
-
-	  old_lam = lam[j];
-	  lam[j] = log(learner->dig[i][j]) - logXi + logA + logzon;
+      for(k = 0; k < n; k++) {
 
-	  if( isnan(lam[j]) ) {
+	old_lam = lam[k];
+	lam[k] = logp[k] - logXi + logA + logzon;
 
-	    lam[j] = old_lam;
-	    recompute_ed(learner, &logzon, &div, i, lam, Xi);
+	if( isnan(lam[k]) ) {
 
-	  } else {
+	  lam[k] = old_lam;
+	  recompute_ed(&logzon, &div, n, lam, cnt, Xi);
 
-	    if( lam[j] > (old_lam + MAX_LAMBDA_JUMP) ) {
-	      lam[j] = (old_lam + MAX_LAMBDA_JUMP);
-	    } else if( lam[j] < (old_lam - MAX_LAMBDA_JUMP) ) {
-	      lam[j] = (old_lam - MAX_LAMBDA_JUMP);
-	    }
+	} else {
 
-	    /* don't want negative weights */
-	    if( lam[j] < 0.0 ) { lam[j] = 0.0; }
+	  if( lam[k] > (old_lam + MAX_LAMBDA_JUMP) ) {
+	    lam[k] = (old_lam + MAX_LAMBDA_JUMP);
+	  } else if( lam[k] < (old_lam - MAX_LAMBDA_JUMP) ) {
+	    lam[k] = (old_lam - MAX_LAMBDA_JUMP);
+	  }
 
-	    if( lam_delta < fabs(lam[j] - old_lam) ) {
-	      lam_delta = fabs(lam[j] - old_lam);
-	    }
+	  /* don't want negative weights */
+	  if( lam[k] < 0.0 ) { lam[k] = 0.0; }
 
+	  if( lam_delta < fabs(lam[k] - old_lam) ) {
+	    lam_delta = fabs(lam[k] - old_lam);
 	  }
+
 	}
       }
 
 
-      recompute_ed(learner, &logzon, &div, i, lam, Xi);
+      recompute_ed(&logzon, &div, n, lam, cnt, Xi);
 
       if( u_options & (1<<U_OPTION_VERBOSE) ) {
 	fprintf(stdout, "digramic (%d) entropy change %" FMT_printf_score_t \
@@ -2932,35 +4085,42 @@ void make_entropic_digrams(learner_t *learner) {
 		old_div, div, lam_delta, fabs(logzon - old_logzon));
       }
 
-    
+
     } while( ((fabs(div - old_div) > 0.001) || (lam_delta > 0.001) ||
 	      (fabs(logzon - old_logzon) > 0.001)) && (itcount < 500) );
 
 
     /* now make the probabilities */
 
-    /* transitions should already sum to 1, but better safe than sorry */
-    maxlogt = log(0.0);
-    for(j = AMIN; j < ASIZE; j++) {
-      if( maxlogt < lam[j] ) {
-	maxlogt = lam[j];
+    /* transitions should already sum to 1, but better safe than sorry.
+       The weights are never negative, and zero off the packed columns */
+    maxlogt = 0.0;
+    for(k = 0; k < n; k++) {
+      if( maxlogt < lam[k] ) {
+	maxlogt = lam[k];
       }
     }
     maxlogt += -logA -logzon;
-    logt = 0.0;
-    for(j = AMIN; j < ASIZE; j++) {
-      logt += exp(lam[j] - logA - logzon - maxlogt);
+    for(k = 0; k < n; k++) {
+      logp[k] = lam[k] - logA - logzon - maxlogt;
+    }
+    exp_weights(logp, n);
+    logt = (ASIZE - AMIN - n) * exp(-logA - logzon - maxlogt);
+    for(k = 0; k < n; k++) {
+      logt += logp[k];
     }
     logt = maxlogt + log(logt);
 
+    k = 0;
     for(j = AMIN; j < ASIZE; j++) {
+      w = ((k < n) && (col[k] == j)) ? lam[k++] : 0.0;
       /* note: simulate the effect of digitizing the digrams */
-      learner->dig[i][j] = 
-	UNPACK_DIGRAMS(PACK_DIGRAMS(lam[j] - logA - logzon - logt));
+      learner->dig[i][j] =
+	UNPACK_DIGRAMS(PACK_DIGRAMS(MINIMUM(w - logA - logzon - logt, 0.0)));
 
       if(0 && u_options & (1<<U_OPTION_DEBUG) ) {
 	fprintf(stdout,
-		"learner->dig[%d][%d] = %f\n", 
+		"learner->dig[%d][%d] = %f\n",
 		i, j, learner->dig[i][j]);
       }
     }
@@ -3018,96 +4178,113 @@ weight_t calc_learner_digramic_excursion(learner_t *learner, char *tok) {
   return t;
 }
 
-/* calculates the rth-order divergence but needs normalizing constant
-   note: this isn't the full divergence from digref, just the bits
-   needed for the r-th optimization - fwd indicates the traversal
-   direction in the hash (alternate between them to reduce numerical
-   errors */
-score_t learner_divergence(learner_t *learner, 
-			   score_t logzonr, score_t Xi,
-			   token_order_t r, bool_t fwd) {
-  register l_item_t *i, *e;
-  register token_count_t c = 0;
-  score_t t = 0.0;
-
-  e = fwd ? (learner->hash + learner->max_tokens) : learner->hash - 1;
-  for(i = fwd ? learner->hash : learner->hash + learner->max_tokens - 1; 
-      i != e; fwd ? i++ : i--) {
-    if( FILLEDP(i) && (i->typ.order == r) ) {
-
-      t += UNPACK_LAMBDA(i->lam) * (score_t)i->count;
-
-      if( ++c >= learner->fixed_order_unique_token_count[r] ) {
-	c = 0;
-	break;
-      }
-    }
+/* starts recording the tokens learned after loading an online dump */
+void init_learner_delta(learner_t *learner) {
+  if( learner->logZ == 0.0 ) {
+    /* the weights in the dump were never optimized */
+    return;
   }
-
-  return -logzonr + t/Xi;
+  delta.base = learner->doc.count;
+  delta.active = (byte_t *)calloc(learner->max_tokens, sizeof(byte_t));
+  delta.slot = NULL;
+  delta.count = 0;
+  delta.slot_max = 0;
 }
 
-/* calculates the normalizing constant - fwd indicates the traversal
-   direction in the hash (alternate between them to reduce numerical
-   errors */
-score_t learner_logZ(learner_t *learner, token_order_t r, 
-		     score_t log_unchanging_part, bool_t fwd) {
-  register l_item_t *i, *e;
-  register token_count_t c = 0;
-
-  score_t maxlogz, maxlogz2, tmp;
-  score_t t =0.0;
-  score_t R = (score_t)r;
-
-/*   printf("learner_logZ(%d, %f)\n", r, log_unchanging_part); */
-
-  e = fwd ? (learner->hash + learner->max_tokens) : learner->hash - 1;
-  maxlogz = log_unchanging_part;
-  maxlogz2 = log(0.0);
-  for(i = fwd ? learner->hash : learner->hash + learner->max_tokens - 1; 
-      i != e; fwd ? i++ : i--) {
-    if( FILLEDP(i) && (i->typ.order == r) ) {
-
-      tmp = R * UNPACK_LAMBDA(i->lam) + R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
-	UNPACK_RWEIGHTS(i->tmp.min.dref);
-
-      if( maxlogz < tmp ) {
-	maxlogz2 = maxlogz;
-	maxlogz = tmp;
-      }
-
-      if( ++c >= learner->fixed_order_unique_token_count[r] ) {
-	c = 0;
-	break;
+void learner_delta_add(token_count_t s) {
+  if( !delta.active[s] ) {
+    if( delta.count >= delta.slot_max ) {
+      delta.slot_max = 2 * delta.slot_max + 1024;
+      delta.slot = (token_count_t *)
+	realloc(delta.slot, delta.slot_max * sizeof(token_count_t));
+      if( !delta.slot ) {
+	errormsg(E_FATAL, "not enough memory for the optimizer\n");
       }
     }
+    delta.active[s] = 1;
+    delta.slot[delta.count++] = s;
   }
+}
 
-  t =  exp(log_unchanging_part - maxlogz);
-  for(i = fwd ? learner->hash : learner->hash + learner->max_tokens - 1; 
-      i != e; fwd ? i++ : i--) {
-    if( FILLEDP(i) && (i->typ.order == r) ) {
-
-      tmp = R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
-	UNPACK_RWEIGHTS(i->tmp.min.dref) - maxlogz;
-      t += (exp(R * UNPACK_LAMBDA(i->lam) + tmp) - exp(tmp)); 
+void free_learner_delta() {
+  if( delta.active ) { free(delta.active); }
+  if( delta.slot ) { free(delta.slot); }
+  delta.active = NULL;
+  delta.slot = NULL;
+  delta.count = 0;
+  delta.slot_max = 0;
+}
 
-      if( ++c >= learner->fixed_order_unique_token_count[r] ) {
-	c = 0;
-	break;
-      }
-    }
+/* decides if the weights can be updated incrementally */
+static bool_t build_learner_delta(learner_t *learner) {
+  if( !delta.active || (delta.interval == 0) ||
+      (learner->doc.count <= delta.base) ||
+      (learner->doc.count/delta.interval != delta.base/delta.interval) ||
+      (m_options & (1<<M_OPTION_REFMODEL)) ) {
+    free_learner_delta();
+    return 0;
   }
+  return 1;
+}
 
-  tmp =  (maxlogz + log(t))/R;
-/*   printf("t =%f maxlogz = %f logZ/R = %f\n", t, maxlogz, tmp); */
+/* writes the optimized weights back into the online memory dump, so
+   the next incremental run can start from them. After an incremental
+   run, only the slots in delta.slot have changed. The logZ of the dump
+   is only nonzero once this was done */
+bool_t update_online_lambdas(learner_t *learner, char *path) {
+  FILE *f;
+  char buf[MAGIC_BUFSIZE+1];
+  online_header_t h;
+  learner_t dump;
+  l_item_t item[256];
+  hash_count_t t, n, j;
+  bool_t ok;
 
-  /* investigate this someday */
-  if( isnan(tmp) ) {
-    errormsg(E_FATAL,"sorry, partition function went kaboom.\n");
+  f = fopen(path, "r+b");
+  if( !f ) {
+    return 0;
   }
-
-  return tmp;
+  ok = fgets(buf, MAGIC_BUFSIZE, f) && 
+    (strncmp(buf, MAGIC_ONLINE, strlen(MAGIC_ONLINE)) == 0) &&
+    read_online_header(f, &h) &&
+    (fseek(f, h.learner_offset, SEEK_SET) == 0) &&
+    (fread(&dump, sizeof(learner_t), 1, f) == 1) &&
+    (dump.max_tokens == learner->max_tokens) &&
+    (fseek(f, h.hash_offset, SEEK_SET) == 0);
+  /* with -m, the weights were optimized in place */
+  for(t = 0; ok && !learner->mmap_start && delta.slot && (t < delta.count); 
+      t++) {
+    j = delta.slot[t];
+    ok = (fseek(f, (long)(h.hash_offset + j * sizeof(l_item_t)), 
+		 SEEK_SET) == 0) &&
+      (fread(item, sizeof(l_item_t), 1, f) == 1);
+    item[0].lam = learner->hash[j].lam;
+    ok = ok && 
+      (fseek(f, -(long)sizeof(l_item_t), SEEK_CUR) == 0) &&
+      (fwrite(item, sizeof(l_item_t), 1, f) == 1);
+  }
+  for(t = 0; ok && !learner->mmap_start && !delta.slot && 
+	(t < learner->max_tokens); t += n) {
+    n = fread(item, sizeof(l_item_t), 
+	      MINIMUM(256, learner->max_tokens - t), f);
+    for(j = 0; j < n; j++) {
+      item[j].lam = learner->hash[t + j].lam;
+    }
+    ok = (n > 0) &&
+      (fseek(f, -(long)(n * sizeof(l_item_t)), SEEK_CUR) == 0) &&
+      (fwrite(item, sizeof(l_item_t), n, f) == n) &&
+      (fseek(f, 0, SEEK_CUR) == 0);
+  }
+  dump.logZ = learner->logZ;
+  dump.delta = learner->delta;
+  ok = ok && 
+    (fseek(f, h.learner_offset, SEEK_SET) == 0) &&
+    (fwrite(&dump, sizeof(learner_t), 1, f) == 1);
+  ok = (fclose(f) == 0) && ok;
+  if( !ok ) {
+    errormsg(E_WARNING, "could not update the weights in %s\n", path);
+  }
+  return ok;
 }
 
 /* reconstructs the order of a token (can be zero for empty token) */
@@ -3123,19 +4300,35 @@ token_order_t get_token_order(char *tok) {
   return o;
 }
 
-
-/* fills the hash with partial calculations */
-void fill_ref_vars(learner_t *learner, l_item_t *k, char *tok) {
+/* adds a slot to the resolved tokens, growing the arrays as needed */
+static void add_learner_token(learner_t *learner, l_item_t *k, char *tok) {
   hash_value_t id;
   char *t, *e;
   l_item_t *l;
+  token_count_t n = features.tok.count;
 
-  /* weight of the r-th order excursion */
-  k->tmp.min.dref = PACK_RWEIGHTS(calc_learner_digramic_excursion(learner,tok));
+  if( n + 1 >= features.tok.max ) {
+    features.tok.max = 2 * features.tok.max + 1024;
+    features.tok.slot = (token_count_t *)
+      realloc(features.tok.slot, features.tok.max * sizeof(token_count_t));
+    features.tok.dref = (weight_t *)
+      realloc(features.tok.dref, features.tok.max * sizeof(weight_t));
+    features.tok.suffix_start = (token_count_t *)
+      realloc(features.tok.suffix_start, 
+	      (features.tok.max + 1) * sizeof(token_count_t));
+    if( !features.tok.slot || !features.tok.dref || 
+	!features.tok.suffix_start ) {
+      errormsg(E_FATAL, "not enough memory for the optimizer\n");
+    }
+    if( n == 0 ) { features.tok.suffix_start[0] = 0; }
+  }
 
-  /* for each suffix of tok, add its weight */
-  k->tmp.min.ltrms = PACK_LWEIGHTS(0.0);
+  features.tok.slot[n] = k - learner->hash;
+  /* weight of the r-th order excursion */
+  features.tok.dref[n] = calc_learner_digramic_excursion(learner,tok);
+  features.tok.suffix_start[n + 1] = features.tok.suffix_start[n];
 
+  /* slot of each suffix of tok */
   if( tok && *tok ) {
     e = strchr(tok + 1, EOTOKEN);
     for( t = tok + 1; t + 1 < e; t++ ) {
@@ -3143,93 +4336,57 @@ void fill_ref_vars(learner_t *learner, l_item_t *k, char *tok) {
 	id = hash_partial_token(t, e - t, e);
 	l = find_in_learner(learner, id); 
 	if( l ) {
-	  k->tmp.min.ltrms += PACK_LWEIGHTS(UNPACK_LAMBDA(l->lam));
-	}
-      }
-    }
-
-    /* extra smoothing doesn't seem that good */
-#undef EXTRA_SMOOTHING
-#if defined EXTRA_SMOOTHING
-    /* rather than adding only suffixes, this adds all 
-     * the prefixes also, then divides by two. */
-    if( e ) {
-      /* for each prefix of tok, add its weight */
-      for(t = e - 2; t > tok; t--) {
-	if( *t == DIAMOND ) {
-	  id = hash_partial_token(tok, t - tok + 1, e);
-	  l = find_in_learner(id);
-	  if( l ) {
-	    k->ltrms += PACK_LWEIGHTS(UNPACK_LAMBDA(l->lam));
+	  if( features.tok.suffix_start[n + 1] >= features.tok.suffix_max ) {
+	    features.tok.suffix_max = 2 * features.tok.suffix_max + 1024;
+	    features.tok.suffix = (token_count_t *)
+	      realloc(features.tok.suffix, 
+		      features.tok.suffix_max * sizeof(token_count_t));
+	    if( !features.tok.suffix ) {
+	      errormsg(E_FATAL, "not enough memory for the optimizer\n");
+	    }
 	  }
+	  features.tok.suffix[features.tok.suffix_start[n + 1]++] = 
+	    l - learner->hash;
 	}
       }
-      /* now we have twice as many weights as we need */
-      k->ltrms /= 2;
-    }  
-#endif
+    }
   }
-
+  features.tok.count++;
 }
 
-/* fills hash with partial calculations and returns the
- * log unchanging part of the normalizing constant, for all
- * orders < r (not r). On return, kappa contains the reference probability
- * mass of the set of all features <= r (including r).
- */
-score_t recalculate_reference_measure(learner_t *learner, token_order_t r, score_t *kappa) {
+/* reads the temporary token file once, instead of rehashing its
+   tokens for every order in recalculate_reference_measure() */
+static void index_learner_tokens(learner_t *learner) {
   hash_value_t id;
   byte_t buf[BUFSIZ+1];
   char tok[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
   size_t n = 0;
-
   const byte_t *p;
   char *q;
+  l_item_t *k;
 
-  l_item_t *k, *i;
-
-  score_t tmp, lunch;
-  score_t R = (score_t)r;
-  score_t max = 0.0;
-  score_t mykappa = 0.0;
-
-  /* for r == 1, the partial_z is not modified, but
-     we still have to go through the tokens and prebuild k-dref */
+  features.tok.count = 0;
+  features.tok.max = 0;
+  features.tok.slot = NULL;
+  features.tok.dref = NULL;
+  features.tok.suffix_start = NULL;
+  features.tok.suffix = NULL;
+  features.tok.suffix_max = 0;
 
-  /* now we calculate the logarithmic word weight
-     from the digram model, for each token in the hash */
   if( !tmp_seek_start(learner) ) {
     errormsg(E_ERROR, "cannot seek in temporary token file, reference weights not calculated.\n");
   } else {
     q = tok;
     while( (n = tmp_read_block(learner, buf, BUFSIZ, &p)) > 0 ) {
-/*       p = buf; */
-/*       p[n] = '\0'; */
       while( n-- > 0 ) {
 	if( *p != TOKENSEP) {
 	  *q++ = *p; /* copy into tok */
 	} else { /* interword space */ 
 	  *q = 0; /* append NUL to tok */
-	  /* now write weight in hash */
 	  id = hash_full_token(tok);
 	  k = find_in_learner(learner, id); 
 	  if( k && (get_token_order(tok) == k->typ.order) ) {
-	    if( k->typ.order <= r) {
-	      if( k->typ.order == r ) {
-		fill_ref_vars(learner, k, tok);
-	      } else if(k->typ.order < r) {
-		/* assume ref_vars were already filled */
-		if( NOTNULL(k->lam) ) {
-		  tmp = R * UNPACK_LAMBDA(k->lam) + 
-		    R * UNPACK_LWEIGHTS(k->tmp.min.ltrms) +
-		    UNPACK_RWEIGHTS(k->tmp.min.dref);
-		  if( max < tmp ) {
-		    max = tmp;
-		  }
-		}
-	      }
-	      mykappa += exp(UNPACK_RWEIGHTS(k->tmp.min.dref));
-	    }
+	    add_learner_token(learner, k, tok);
 	  }
 	  q = tok; /* reset q */
 	}
@@ -3237,21 +4394,434 @@ score_t recalculate_reference_measure(learner_t *learner, token_order_t r, score
       }
     }
   }
+}
 
-  lunch = 1.0;
-  k = learner->hash + learner->max_tokens;
-  for(i = learner->hash; i != k; i++) {
-    if( FILLEDP(i) ) {
-      if( i->typ.order < r ) {
-	if( NOTNULL(i->lam) ) {
-	  tmp = -max + R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
-	    UNPACK_RWEIGHTS(i->tmp.min.dref);
-	  lunch += (exp(R * UNPACK_LAMBDA(i->lam) + tmp) - exp(tmp));
+/* indexes the features of the learner hash by chunk and order. The
+   hash must not change until free_learner_features() */
+void build_learner_features(learner_t *learner) {
+  token_count_t s, z, n;
+  token_count_t pos[MAX_SUBMATCH];
+  token_order_t o;
+  long k;
+
+  features.orders = MINIMUM(learner->max_order + 1, MAX_SUBMATCH);
+  features.chunks = (learner->max_tokens + LEARNER_CHUNK - 1)/LEARNER_CHUNK;
+  n = features.chunks * features.orders;
+  features.start = (token_count_t *)calloc(n + 1, sizeof(token_count_t));
+  if( !features.start ) {
+    errormsg(E_FATAL, "not enough memory for the optimizer\n");
+  }
+
+  /* count, then place each feature at the end of its group */
+  for(s = 0; s < learner->max_tokens; s++) {
+    if( FILLEDP(&learner->hash[s]) && 
+	(learner->hash[s].typ.order < features.orders) ) {
+      features.start[(s >> LEARNER_CHUNK_BITS) * features.orders + 
+		     learner->hash[s].typ.order + 1]++;
+    }
+  }
+  for(z = 0; z < n; z++) {
+    features.start[z + 1] += features.start[z];
+  }
+  features.slot = (token_count_t *)malloc((features.start[n] + 1) *
+					  sizeof(token_count_t));
+  if( !features.slot ) {
+    errormsg(E_FATAL, "not enough memory for the optimizer\n");
+  }
+  for(k = 0; k < features.chunks; k++) {
+    for(o = 0; o < features.orders; o++) {
+      pos[o] = features.start[k * features.orders + o];
+    }
+    z = MINIMUM((k + 1) * LEARNER_CHUNK, learner->max_tokens);
+    for(s = k * LEARNER_CHUNK; s < z; s++) {
+      if( FILLEDP(&learner->hash[s]) && 
+	  (learner->hash[s].typ.order < features.orders) ) {
+	features.slot[pos[learner->hash[s].typ.order]++] = s;
+      }
+    }
+  }
+
+  index_learner_tokens(learner);
+}
+
+void free_learner_features() {
+  if( features.start ) { free(features.start); }
+  if( features.slot ) { free(features.slot); }
+  if( features.tok.slot ) { free(features.tok.slot); }
+  if( features.tok.dref ) { free(features.tok.dref); }
+  if( features.tok.suffix_start ) { free(features.tok.suffix_start); }
+  if( features.tok.suffix ) { free(features.tok.suffix); }
+  memset(&features, 0, sizeof(learner_features_t));
+}
+
+/* one "iterative scaling" step for the weight of feature i, the
+   number of zero weights and largest change are kept in p */
+static void scale_learner_lambda(learner_reduce_t *lr, l_item_t *i, 
+				 learner_reduce_part_t *p) {
+  score_t R = (score_t)lr->r;
+  score_t old_lam, new_lam;
+
+  old_lam = UNPACK_LAMBDA(i->lam);
+
+  if( (i->count > lr->zcut) && !i->typ.mark ) {
+    /* "iterative scaling" lower bound */
+    new_lam = (log((score_t)i->count) - lr->logXi -  
+	       UNPACK_RWEIGHTS(i->tmp.min.dref))/R + lr->logzonr -
+      UNPACK_LWEIGHTS(i->tmp.min.ltrms);
+  } else {
+    new_lam = 0.0;
+  }
+
+  /* precision problem, just ignore, don't change lambda (logZ
+     is recalculated after all the chunks) */
+  if( !isnan(new_lam) ) {
+    /* this code shouldn't be necessary, but is crucial */
+    if( new_lam > (old_lam + MAX_LAMBDA_JUMP) ) {
+      new_lam = (old_lam + MAX_LAMBDA_JUMP);
+    } else if( new_lam < (old_lam - MAX_LAMBDA_JUMP) ) {
+      new_lam = (old_lam - MAX_LAMBDA_JUMP);
+    }
+
+    /* don't want negative weights */
+    if( new_lam < 0.0 ) { new_lam = 0.0; p->count++; }
+
+    if( p->max < fabs(new_lam - old_lam) ) {
+      p->max = fabs(new_lam - old_lam);
+    }
+    i->lam = PACK_LAMBDA(new_lam);
+  }
+}
+
+/* applies one reduction step of the optimizer to chunk k of the
+   learner hash - fwd indicates the traversal direction */
+static void learner_reduce_chunk(learner_reduce_t *lr, long k) {
+  register l_item_t *i;
+  register token_count_t *j, *e;
+  token_count_t *s, *t;
+  learner_features_t *f = lr->features;
+  learner_reduce_part_t *p = &lr->part[k];
+  score_t R = (score_t)lr->r;
+  score_t tmp;
+
+  p->sum = 0.0;
+  p->max = (lr->op == lrLAMBDA) ? 0.0 : log(0.0);
+  p->count = 0;
+
+  /* features of order < r, or of order r */
+  if( (lr->op == lrEXTRABITS) || (lr->op == lrLUNCH) ) {
+    s = f->slot + f->start[k * f->orders];
+    t = f->slot + f->start[k * f->orders + MINIMUM(lr->r, f->orders)];
+  } else if( lr->r < f->orders ) {
+    s = f->slot + f->start[k * f->orders + lr->r];
+    t = f->slot + f->start[k * f->orders + lr->r + 1];
+  } else {
+    return;
+  }
+
+  e = lr->fwd ? t : s - 1;
+  for(j = lr->fwd ? s : t - 1; j != e; lr->fwd ? j++ : j--) {
+    i = lr->learner->hash + *j;
+
+    switch(lr->op) {
+    case lrMAXLOGZ:
+      tmp = R * UNPACK_LAMBDA(i->lam) + R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
+	UNPACK_RWEIGHTS(i->tmp.min.dref);
+      if( p->max < tmp ) {
+	p->max = tmp;
+      }
+      break;
+    case lrLOGZ:
+      tmp = R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
+	UNPACK_RWEIGHTS(i->tmp.min.dref) - lr->maxlogz;
+      p->sum += (exp(R * UNPACK_LAMBDA(i->lam) + tmp) - exp(tmp)); 
+      break;
+    case lrDIVERGENCE:
+    case lrEXTRABITS:
+      p->sum += UNPACK_LAMBDA(i->lam) * (score_t)i->count;
+      break;
+    case lrSLOPE:
+      if( NOTNULL(i->lam) ) {
+	p->sum += exp(R * UNPACK_LAMBDA(i->lam) + 
+		      R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
+		      UNPACK_RWEIGHTS(i->tmp.min.dref) - lr->maxlogz);
+      }
+      break;
+    case lrLUNCH:
+      if( NOTNULL(i->lam) ) {
+	tmp = -lr->maxlogz + R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
+	  UNPACK_RWEIGHTS(i->tmp.min.dref);
+	p->sum += (exp(R * UNPACK_LAMBDA(i->lam) + tmp) - exp(tmp));
+      }
+      break;
+    case lrLAMBDA:
+      scale_learner_lambda(lr, i, p);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+#if defined HAVE_LIBPTHREAD
+static void *learner_reduce_thread(void *arg) {
+  learner_reduce_t *lr = (learner_reduce_t *)arg;
+  long k;
+  for(k = lr->thread; k < lr->chunks; k += lr->threads) {
+    learner_reduce_chunk(lr, k);
+  }
+  return NULL;
+}
+#endif
+
+/* runs a reduction over every chunk of the learner hash, on up to
+   max_threads threads, then combines the partial results in chunk
+   order (reversed if !fwd) */
+static void learner_reduce(learner_reduce_t *lr) {
+  long k;
+#if defined HAVE_LIBPTHREAD
+  learner_reduce_t *tlr = NULL;
+  pthread_t *tid = NULL;
+  int z, n;
+#endif
+
+  lr->chunks = lr->features->chunks;
+  lr->part = (learner_reduce_part_t *)malloc(lr->chunks * 
+					     sizeof(learner_reduce_part_t));
+  if( !lr->part ) {
+    errormsg(E_FATAL, "not enough memory for the optimizer\n");
+  }
+
+  lr->thread = 0;
+  lr->threads = 1;
+#if defined HAVE_LIBPTHREAD
+  if( (max_threads > 1) && (lr->chunks > 1) ) {
+    lr->threads = MINIMUM(max_threads, lr->chunks);
+    tlr = (learner_reduce_t *)malloc(lr->threads * sizeof(learner_reduce_t));
+    tid = (pthread_t *)malloc(lr->threads * sizeof(pthread_t));
+  }
+  if( tlr && tid ) {
+    for(z = 0; z < lr->threads; z++) {
+      tlr[z] = *lr;
+      tlr[z].thread = z;
+    }
+    /* chunks of threads which can't be created are done here */
+    for(n = 1; n < lr->threads; n++) {
+      if( pthread_create(&tid[n], NULL, learner_reduce_thread, &tlr[n]) != 0 ) {
+	break;
+      }
+    }
+    for(z = n; z < lr->threads; z++) {
+      learner_reduce_thread(&tlr[z]);
+    }
+    learner_reduce_thread(&tlr[0]);
+    for(z = 1; z < n; z++) {
+      pthread_join(tid[z], NULL);
+    }
+  } else
+#endif
+    {
+      for(k = 0; k < lr->chunks; k++) {
+	learner_reduce_chunk(lr, k);
+      }
+    }
+#if defined HAVE_LIBPTHREAD
+  if( tlr ) { free(tlr); }
+  if( tid ) { free(tid); }
+#endif
+
+  lr->total = lr->part[lr->fwd ? 0 : lr->chunks - 1];
+  for(k = 1; k < lr->chunks; k++) {
+    learner_reduce_part_t *p = &lr->part[lr->fwd ? k : lr->chunks - 1 - k];
+    lr->total.sum += p->sum;
+    lr->total.max = MAXIMUM(lr->total.max, p->max);
+    lr->total.count += p->count;
+  }
+
+  free(lr->part);
+  lr->part = NULL;
+}
+
+static void init_learner_reduce(learner_reduce_t *lr, learner_t *learner,
+				learner_reduce_op_t op, token_order_t r,
+				bool_t fwd) {
+  memset(lr, 0, sizeof(learner_reduce_t));
+  lr->learner = learner;
+  lr->features = &features;
+  lr->op = op;
+  lr->r = r;
+  lr->fwd = fwd;
+}
+
+/* calculates the rth-order divergence but needs normalizing constant
+   note: this isn't the full divergence from digref, just the bits
+   needed for the r-th optimization - fwd indicates the traversal
+   direction in the hash (alternate between them to reduce numerical
+   errors */
+score_t learner_divergence(learner_t *learner, 
+			   score_t logzonr, score_t Xi,
+			   token_order_t r, bool_t fwd) {
+  learner_reduce_t lr;
+
+  init_learner_reduce(&lr, learner, lrDIVERGENCE, r, fwd);
+  learner_reduce(&lr);
+
+  return -logzonr + lr.total.sum/Xi;
+}
+
+/* calculates the normalizing constant - fwd indicates the traversal
+   direction in the hash (alternate between them to reduce numerical
+   errors. The result is (*pmax + log(*psum))/r */
+static score_t learner_logZ_parts(learner_t *learner, token_order_t r, 
+				  score_t log_unchanging_part, bool_t fwd,
+				  score_t *pmax, score_t *psum) {
+  learner_reduce_t lr;
+  score_t maxlogz, tmp;
+  score_t t =0.0;
+  score_t R = (score_t)r;
+
+/*   printf("learner_logZ(%d, %f)\n", r, log_unchanging_part); */
+
+  init_learner_reduce(&lr, learner, lrMAXLOGZ, r, fwd);
+  learner_reduce(&lr);
+  maxlogz = MAXIMUM(log_unchanging_part, lr.total.max);
+
+  lr.op = lrLOGZ;
+  lr.maxlogz = maxlogz;
+  learner_reduce(&lr);
+  t = exp(log_unchanging_part - maxlogz) + lr.total.sum;
+
+  tmp =  (maxlogz + log(t))/R;
+/*   printf("t =%f maxlogz = %f logZ/R = %f\n", t, maxlogz, tmp); */
+
+  /* investigate this someday */
+  if( isnan(tmp) ) {
+    errormsg(E_FATAL,"sorry, partition function went kaboom.\n");
+  }
+
+  *pmax = maxlogz;
+  *psum = t;
+  return tmp;
+}
+
+score_t learner_logZ(learner_t *learner, token_order_t r, 
+		     score_t log_unchanging_part, bool_t fwd) {
+  score_t m, t;
+  return learner_logZ_parts(learner, r, log_unchanging_part, fwd, &m, &t);
+}
+
+/* the active features of order r are optimized from scratch, while
+   the others keep their weights */
+static void clear_learner_delta(learner_t *learner, token_order_t r) {
+  token_count_t z;
+  l_item_t *i;
+
+  for(z = 0; z < delta.count; z++) {
+    i = learner->hash + delta.slot[z];
+    if( i->typ.order == r ) {
+      i->lam = PACK_LAMBDA(0.0);
+    }
+  }
+}
+
+/* one "iterative scaling" step for the active features of order r.
+   The sum *psum of the partition function (relative to *pmax) and the
+   weighted sum *pdiv of the divergence are updated along the way. If
+   a weight outgrows *pmax, the partition function must be recomputed
+   in full, and 0 is returned */
+static bool_t learner_delta_step(learner_t *learner, learner_reduce_t *lr,
+				 score_t *pmax, score_t *psum, score_t *pdiv) {
+  token_count_t z;
+  l_item_t *i;
+  score_t R = (score_t)lr->r;
+  score_t old_lam, new_lam, tmp;
+  bool_t ok = 1;
+
+  lr->total.sum = 0.0;
+  lr->total.max = 0.0;
+  lr->total.count = 0;
+  for(z = 0; z < delta.count; z++) {
+    i = learner->hash + delta.slot[z];
+    if( i->typ.order == lr->r ) {
+      old_lam = UNPACK_LAMBDA(i->lam);
+      scale_learner_lambda(lr, i, &lr->total);
+      new_lam = UNPACK_LAMBDA(i->lam);
+      if( new_lam != old_lam ) {
+	tmp = R * UNPACK_LWEIGHTS(i->tmp.min.ltrms) + 
+	  UNPACK_RWEIGHTS(i->tmp.min.dref) - *pmax;
+	if( R * new_lam + tmp > 0.0 ) {
+	  ok = 0;
+	}
+	*psum += exp(R * new_lam + tmp) - exp(R * old_lam + tmp);
+	*pdiv += (new_lam - old_lam) * (score_t)i->count;
+      }
+    }
+  }
+  return ok;
+}
+
+
+
+/* fills hash with partial calculations and returns the
+ * log unchanging part of the normalizing constant, for all
+ * orders < r (not r). On return, kappa contains the reference probability
+ * mass of the set of all features <= r (including r).
+ */
+score_t recalculate_reference_measure(learner_t *learner, token_order_t r, score_t *kappa) {
+  learner_reduce_t lr;
+  token_count_t j, s;
+  l_item_t *k;
+
+  score_t tmp, lunch;
+  score_t R = (score_t)r;
+  score_t max = 0.0;
+  score_t mykappa = 0.0;
+
+  /* for r == 1, the partial_z is not modified, but
+     we still have to go through the tokens and prebuild k-dref */
+
+  /* now we calculate the logarithmic word weight
+     from the digram model, for each token in the hash */
+  for(j = 0; j < features.tok.count; j++) {
+    k = learner->hash + features.tok.slot[j];
+    if( k->typ.order <= r) {
+      if( k->typ.order == r ) {
+	/* with -Q, a feature whose suffix changed must change too */
+	if( delta.active && !delta.active[features.tok.slot[j]] ) {
+	  for(s = features.tok.suffix_start[j]; 
+	      s < features.tok.suffix_start[j + 1]; s++) {
+	    if( delta.active[features.tok.suffix[s]] ) {
+	      learner_delta_add(features.tok.slot[j]);
+	      break;
+	    }
+	  }
+	}
+	k->tmp.min.dref = PACK_RWEIGHTS(features.tok.dref[j]);
+	/* for each suffix of tok, add its weight */
+	k->tmp.min.ltrms = PACK_LWEIGHTS(0.0);
+	for(s = features.tok.suffix_start[j]; 
+	    s < features.tok.suffix_start[j + 1]; s++) {
+	  k->tmp.min.ltrms += 
+	    PACK_LWEIGHTS(UNPACK_LAMBDA(learner->hash[features.tok.suffix[s]].lam));
+	}
+      } else if(k->typ.order < r) {
+	/* assume ref_vars were already filled */
+	if( NOTNULL(k->lam) ) {
+	  tmp = R * UNPACK_LAMBDA(k->lam) + 
+	    R * UNPACK_LWEIGHTS(k->tmp.min.ltrms) +
+	    UNPACK_RWEIGHTS(k->tmp.min.dref);
+	  if( max < tmp ) {
+	    max = tmp;
+	  }
 	}
       }
+      mykappa += exp(UNPACK_RWEIGHTS(k->tmp.min.dref));
     }
   }
-  lunch = max + log(lunch);
+
+  init_learner_reduce(&lr, learner, lrLUNCH, r, 1);
+  lr.maxlogz = max;
+  learner_reduce(&lr);
+  lunch = max + log(1.0 + lr.total.sum);
 
   /* kappa is the reference mass of all features <= rth order. */
   *kappa = mykappa;
@@ -3419,26 +4989,30 @@ void compute_mediaprobs(learner_t *learner) {
 /* minimizes the divergence by solving for lambda one 
    component at a time.  */
 void minimize_learner_divergence(learner_t *learner) {
-  l_item_t *i, *e;
+  learner_reduce_t lr;
   token_order_t r;
-  token_count_t lzero, c = 0;
   token_count_t zcut = 0;
   int itcount, mcount;
-  score_t d, dd, b;
-  score_t lam_delta, old_lam, new_lam;
+  score_t d, dd;
+  score_t lam_delta;
   score_t logzonr, old_logzonr;
   score_t logupz, div_extra_bits, kappa, thresh;
-  score_t R, Xi, logXi;
-  score_t mp_logz;
-  bool_t fwd = 1;
+  score_t Xi, logXi;
+  score_t maxlogz, sumz, divsum;
+  score_t mp_logz, drift;
+  score_t next_logzonr, prev_logzonr, resid, prev_resid, slope;
+  bool_t fwd = 1, secant;
+  hash_count_t j;
+  long passes = 0;
+  struct timeval start, stop;
 
   if( u_options & (1<<U_OPTION_VERBOSE) ) {
     fprintf(stdout, "now maximizing model entropy\n");
   }
+  gettimeofday(&start, NULL);
 
   learner->logZ = 0.0;
   learner->divergence = 0.0;
-  mp_logz = 0.0;
 
   /* disable multipass if we only have one order to play with */
   if( (m_options & (1<<M_OPTION_MULTINOMIAL)) || 
@@ -3455,8 +5029,30 @@ void minimize_learner_divergence(learner_t *learner) {
     }
   }
 
-  e = learner->hash + learner->max_tokens;
-  for(mcount = 0; mcount < (qtol_multipass ? 50 : 1); mcount++) {
+  build_learner_features(learner);
+
+  if( build_learner_delta(learner) ) {
+    if( u_options & (1<<U_OPTION_VERBOSE) ) {
+      fprintf(stdout, "updating the weights incrementally\n");
+    }
+  }
+
+ full_pass:
+  if( !delta.active ) {
+    learner->delta.drift = 0.0;
+    /* an online dump updated with -Q holds the last weights, but a
+       full pass starts afresh */
+    if( !(u_options & (1<<U_OPTION_NOZEROLEARN)) ) {
+      for(j = 0; j < learner->max_tokens; j++) {
+	learner->hash[j].lam = PACK_LAMBDA(0.0);
+      }
+    }
+  }
+
+  drift = 0.0;
+  mp_logz = 0.0;
+  for(mcount = 0; mcount < ((qtol_multipass && !delta.active) ? 50 : 1); 
+      mcount++) {
     for(r = 1; 
 	r <= ((m_options & (1<<M_OPTION_MULTINOMIAL)) ? 1 : learner->max_order); 
 	r++) {
@@ -3465,7 +5061,6 @@ void minimize_learner_divergence(learner_t *learner) {
 	 which aren't going to change during this iteration */
       logupz = recalculate_reference_measure(learner, r, &kappa);
 
-      R = (score_t)r;
       Xi = (score_t)learner->fixed_order_token_count[r];
       logXi = log(Xi);
 
@@ -3474,14 +5069,9 @@ void minimize_learner_divergence(learner_t *learner) {
 	div_extra_bits = 0.0;
       } else {
       /* calculate extra bits for divergence score display */
-	b = 0.0;
-
-	for(i = learner->hash; i != e; i++) {
-	  if( FILLEDP(i) && (i->typ.order < r) ) {
-	    b += UNPACK_LAMBDA(i->lam) * (score_t)i->count;
-	  }
-	}
-	div_extra_bits = b/Xi;
+	init_learner_reduce(&lr, learner, lrEXTRABITS, r, 1);
+	learner_reduce(&lr);
+	div_extra_bits = lr.total.sum/Xi;
       }
 
       if( m_options & (1<<M_OPTION_REFMODEL) ) {
@@ -3495,77 +5085,76 @@ void minimize_learner_divergence(learner_t *learner) {
 		learner->fixed_order_unique_token_count[r], kappa);
       }
 
-      logzonr = learner_logZ(learner, r, logupz, fwd);
-      dd = learner_divergence(learner, logzonr, Xi, r, fwd);
+      if( delta.active ) {
+	clear_learner_delta(learner, r);
+      }
+      logzonr = learner_logZ_parts(learner, r, logupz, fwd, &maxlogz, &sumz);
+      init_learner_reduce(&lr, learner, lrDIVERGENCE, r, fwd);
+      learner_reduce(&lr);
+      divsum = lr.total.sum;
+      dd = -logzonr + divsum/Xi;
       fwd = 1 - fwd;
 /*       printf("logzonr = %f dd = %f logupz = %f Xi = %f\n", logzonr, dd, logupz, Xi); */
       itcount = 0;
       thresh = 0.0;
+      next_logzonr = logzonr;
+      prev_logzonr = prev_resid = 0.0;
+      secant = 0;
       do {
 	itcount++;
-	lzero= 0;
-
-	d = dd;     /* save old divergence */
-	old_logzonr = logzonr;
-
-	lam_delta = 0.0;
-
-	c = 0;
-	for(i = learner->hash; i != e; i++) {
-	  if( FILLEDP(i) && (i->typ.order == r) 
-/* 	    && (rand() > RAND_MAX/2)  */
-	      ) { 
-
-	    old_lam = UNPACK_LAMBDA(i->lam);
-
-	    if( /* (i->typ.order == 1) ||  */
-		(i->count > zcut) ) {
-	      /* "iterative scaling" lower bound */
-	      new_lam = (log((score_t)i->count) - logXi -  
-			 UNPACK_RWEIGHTS(i->tmp.min.dref))/R + logzonr -
-		UNPACK_LWEIGHTS(i->tmp.min.ltrms);
-	    } else {
-	      new_lam = 0.0;
-	    }
-
-	    if( isnan(new_lam) ) {
-	      /* precision problem, just ignore, don't change lambda */
-	      logzonr = learner_logZ(learner, r, logupz, fwd);
-	      thresh = 0.0;
-	    } else {
-	      
-	      /* this code shouldn't be necessary, but is crucial */
-	      if( new_lam > (old_lam + MAX_LAMBDA_JUMP) ) {
-		new_lam = (old_lam + MAX_LAMBDA_JUMP);
-	      } else if( new_lam < (old_lam - MAX_LAMBDA_JUMP) ) {
-		new_lam = (old_lam - MAX_LAMBDA_JUMP);
-	      }
-
-	      /* don't want negative weights */
-	      if( new_lam < 0.0 ) { new_lam = 0.0; lzero++; }
-
-	      if( lam_delta < fabs(new_lam - old_lam) ) {
-		lam_delta = fabs(new_lam - old_lam);
-	      }
-	      i->lam = PACK_LAMBDA(new_lam);
-	    }
 
-	    if( ++c >= learner->fixed_order_unique_token_count[r] ) {
-	      c = 0;
-	      break;
-	    }
+	d = dd;     /* save old divergence */
+	old_logzonr = next_logzonr;
+
+	/* each weight only depends on logzonr, so the chunks can be
+	   updated in any order */
+	init_learner_reduce(&lr, learner, lrLAMBDA, r, fwd);
+	lr.logzonr = old_logzonr;
+	lr.logXi = logXi;
+	lr.zcut = zcut;
+	if( delta.active ) {
+	  /* only the active weights move, so logZ and the divergence
+	     are updated rather than recomputed */
+	  if( learner_delta_step(learner, &lr, &maxlogz, &sumz, &divsum) ) {
+	    logzonr = (maxlogz + log(sumz))/(score_t)r;
+	  } else {
+	    logzonr = learner_logZ_parts(learner, r, logupz, fwd, 
+					 &maxlogz, &sumz);
 	  }
-	}
+	  dd = -logzonr + divsum/Xi;
+	} else {
+	  learner_reduce(&lr);
 
 /* 	theta_rescale(r, logupz, Xi, fwd); */
 
-	/* update values */
-	logzonr = learner_logZ(learner, r, logupz, fwd);
-	dd = learner_divergence(learner, logzonr, Xi, r, fwd);
+	  /* update values */
+	  logzonr = learner_logZ(learner, r, logupz, fwd);
+	  dd = learner_divergence(learner, logzonr, Xi, r, fwd);
+	}
+	lam_delta = lr.total.max;
 	fwd = 1 - fwd;
 
+	/* a scaling step moves logzonr to the logZ it yields. Since all
+	   the weights follow logzonr, the optimum is where both agree,
+	   and -E finds it by the secant method instead */
+	next_logzonr = logzonr;
+	resid = logzonr - old_logzonr;
+	if( u_options & (1<<U_OPTION_ACCELERATE) ) {
+	  if( secant && (lam_delta < MAX_LAMBDA_JUMP) && 
+	      (old_logzonr != prev_logzonr) ) {
+	    slope = (resid - prev_resid)/(old_logzonr - prev_logzonr);
+	    if( (slope < 0.0) && (fabs(resid/slope) < MAX_LAMBDA_JUMP) ) {
+	      next_logzonr = old_logzonr - resid/slope;
+	    }
+	  }
+	  /* weights clipped by MAX_LAMBDA_JUMP aren't on the curve */
+	  secant = (lam_delta < MAX_LAMBDA_JUMP);
+	  prev_logzonr = old_logzonr;
+	  prev_resid = resid;
+	}
+
 	if( u_options & (1<<U_OPTION_VERBOSE) ) {
-/* 	fprintf(stdout, "lzero = %ld\n", lzero); */
+/* 	fprintf(stdout, "lzero = %ld\n", lr.total.count); */
 	  fprintf(stdout, "entropy change %" FMT_printf_score_t \
 		  " --> %" FMT_printf_score_t " (%10f, %10f)\n", 
 		  d + div_extra_bits, 
@@ -3580,6 +5169,25 @@ void minimize_learner_divergence(learner_t *learner) {
 
       learner->logZ = logzonr;
       learner->divergence = dd + div_extra_bits;
+      passes += itcount;
+
+      /* the weights which weren't optimized again are off their
+	 fixed point by the change of logzonr - logXi/r. A full pass
+	 would move them, and logZ with them, by slope/(1 - slope) as
+	 much again, where the slope is the share of the partition
+	 function which follows logzonr */
+      if( delta.active ) {
+	init_learner_reduce(&lr, learner, lrSLOPE, r, fwd);
+	lr.maxlogz = maxlogz;
+	learner_reduce(&lr);
+	slope = lr.total.sum/sumz;
+	drift += (slope < 1.0) ? 
+	  fabs(logzonr - learner->delta.logzonr[r] -
+	       (logXi - learner->delta.logXi[r])/(score_t)r) * 
+	  slope/(1.0 - slope) : HUGE_VAL;
+      }
+      learner->delta.logzonr[r] = logzonr;
+      learner->delta.logXi[r] = logXi;
     }
     /* for multipass, we wait until logZ stabilizes */
     if( fabs(1.0 - mp_logz/learner->logZ) < 0.01 ) {
@@ -3588,6 +5196,32 @@ void minimize_learner_divergence(learner_t *learner) {
     mp_logz = learner->logZ;
   }
 
+  if( delta.active ) {
+    learner->delta.drift += drift;
+    if( learner->delta.drift > qtol_drift ) {
+      if( u_options & (1<<U_OPTION_VERBOSE) ) {
+	fprintf(stdout, "the weights drifted by %f, optimizing them all\n",
+		learner->delta.drift);
+      }
+      free_learner_delta();
+      goto full_pass;
+    }
+  }
+
+  free_learner_features();
+  /* update_online_lambdas() only writes back the slots which changed */
+  if( delta.active ) {
+    free(delta.active);
+    delta.active = NULL;
+  }
+
+  if( u_options & (1<<U_OPTION_VERBOSE) ) {
+    gettimeofday(&stop, NULL);
+    fprintf(stdout, "optimized the weights in %ld iterations, %.2f seconds\n",
+	    passes, (stop.tv_sec - start.tv_sec) + 
+	    (stop.tv_usec - start.tv_usec)/1000000.0);
+  }
+
   /* compute the probability mass of each token class (medium) separately */
   compute_mediaprobs(learner);
 }
@@ -3608,7 +5242,7 @@ void dump_model(learner_t *learner, FILE *out, FILE *in) {
 
   /* preamble - this is copied from save_learner */
 
-  fprintf(out, MAGIC1, learner->filename, 
+  fprintf(out, MAGIC1, HASHTAG(m_hf), learner->filename, 
 	  (m_options & (1<<M_OPTION_REFMODEL)) ? "(ref)" : "");
   fprintf(out, MAGIC2_o, learner->divergence, learner->logZ, learner->max_order,
 	  (m_options & (1<<M_OPTION_MULTINOMIAL)) ? "multinomial" : "hierarchical" );
@@ -3766,6 +5400,10 @@ void optimize_and_save(learner_t *learner) {
   hash_count_t i;
   token_order_t c;
   category_t *opencat = NULL;
+  options_t u_sav;
+
+  /* the optimizer needs every entry in one table */
+  finish_learner_growth(learner);
 
   if(100 * learner->unique_token_count >= HASH_FULL * learner->max_tokens) { 
     errormsg(E_WARNING,
@@ -3789,6 +5427,9 @@ void optimize_and_save(learner_t *learner) {
     fprintf(stdout, 
 	    "picked up %i (%i distinct) tokens\n", 
 	    learner->full_token_count, learner->unique_token_count);
+    fprintf(stdout, 
+	    "token cache: %ld hits, %ld misses\n", 
+	    token_cache_hits, token_cache_misses);
     fprintf(stdout, 
 	    "calculating reference word weights\n");
   }
@@ -3853,6 +5494,19 @@ void optimize_and_save(learner_t *learner) {
 
   minimize_learner_divergence(learner);
 
+  if( (u_options & (1<<U_OPTION_INCREMENTAL)) && *online ) {
+    update_online_lambdas(learner, online);
+  }
+  free_learner_delta();
+
+  /* the remaining weights are optimized again, from where they are */
+  if( (budget_features || budget_bytes) && prune_learner(learner) ) {
+    u_sav = u_options;
+    u_options |= (1<<U_OPTION_NOZEROLEARN);
+    minimize_learner_divergence(learner);
+    u_options = u_sav;
+  }
+
   calc_shannon(learner);
 
   if( u_options & (1<<U_OPTION_DUMP) ) {
@@ -3865,9 +5519,19 @@ void optimize_and_save(learner_t *learner) {
 /*   if( learner->tmpiobuf ) { free(learner->tmpiobuf); } */
 #endif
 
-  /* now save the model to a file */
-  if( !opencat || !fast_partial_save_learner(learner, opencat) ) {
+  /* now save the model to a file, a pruned table has a layout of
+     its own */
+  if( pruned_hash_bits ) {
     save_learner(learner, online);
+    /* an online dump used in place must not keep the marks */
+    for(i = 0; i < learner->max_tokens; i++) {
+      learner->hash[i].typ.mark = 0;
+    }
+  } else if( !(u_options & (1<<U_OPTION_JOURNAL)) || 
+	     !journal_learner(learner, opencat) ) {
+    if( !opencat || !fast_partial_save_learner(learner, opencat) ) {
+      save_learner(learner, online);
+    }
   }
   if( opencat ) { free_category(opencat); }
 }
@@ -3919,11 +5583,26 @@ void learner_preprocess_fun() {
 
   init_learner(&learner, online, 0);
 
+  /* a loaded dump has no temporary token file of its own */
+  if( (u_options & (1<<U_OPTION_INCREMENTAL)) && !ronline_count &&
+      learner.tmp.file && !learner.tmp.filename ) {
+    init_learner_delta(&learner);
+  }
+
   for(r = 0; r < ronline_count; r++) {
     merge_learner_struct(&learner, ronline[r]);
   }
 }
 
+void tokenizer_preprocess_fun() {
+  if( !check_magic_write(tokcache, MAGIC_TOKENS, strlen(MAGIC_TOKENS)) ) {
+    exit(1);
+  }
+  if( !open_token_cache(tokcache) ) {
+    errormsg(E_FATAL, "couldn't create token cache %s\n", tokcache);
+  }
+}
+
 void learner_post_line_fun(char *buf) {
   /* only call this when buf is NULL, ie end of file */
   if( !buf && (m_options & (1<<M_OPTION_MBOX_FORMAT)) ) {
@@ -3932,7 +5611,11 @@ void learner_post_line_fun(char *buf) {
 }
 
 void learner_postprocess_fun() {
-  optimize_and_save(&learner);
+  if( workers.id > -1 ) {
+    finish_learner_worker(&learner);
+  } else {
+    optimize_and_save(&learner);
+  }
 }
 
 void learner_cleanup_fun() {
@@ -3943,6 +5626,10 @@ void learner_word_fun(char *tok, token_type_t tt, regex_count_t re) {
   hash_word_and_learn(&learner, tok, tt, re);
 }
 
+void learner_mbox_state_fun(Mstate state) {
+  count_mbox_messages(&learner, state, "");
+}
+
 void classifier_preprocess_fun() {
   category_count_t c;
   /* no need to "load" the categories, this is done in set_option() */
@@ -3997,9 +5684,7 @@ void classifier_cleanup_fun() {
 
 
 int email_line_filter(MBOX_State *mbox, char *buf) {
-  int retval = mbox_line_filter(mbox, buf, &xml);
-  count_mbox_messages(&learner, mbox->state, buf);
-  return retval;
+  return mbox_line_filter(mbox, buf, &xml);
 }
 
 #if defined HAVE_MBRTOWC
@@ -4008,8 +5693,397 @@ int w_email_line_filter(MBOX_State *mbox, wchar_t *buf) {
 }
 #endif
 
+/* the tokens of a manifest are routed to the token caches of the
+   categories which get the current document */
+manifest_route_t mroute;
+
+static int compare_manifest_entries(const void *a, const void *b) {
+  const manifest_entry_t *x = (const manifest_entry_t *)a;
+  const manifest_entry_t *y = (const manifest_entry_t *)b;
+
+  if( x->file != y->file ) {
+    return (x->file < y->file) ? -1 : 1;
+  }
+  return (x->msg < y->msg) ? -1 : ((x->msg > y->msg) ? 1 : 0);
+}
+
+/* selects the categories of the current message, the entries of a
+   file are visited in message order */
+static void route_select_categories() {
+  int k;
+
+  for(k = 0; k < mroute.ncats; k++) {
+    mroute.on[k] = 0;
+  }
+  for(k = mroute.first; k < mroute.whole; k++) {
+    mroute.on[mroute.entry[k].cat] = 1;
+  }
+  while( (mroute.next < mroute.last) && 
+	 (mroute.entry[mroute.next].msg < mroute.msg) ) {
+    mroute.next++;
+  }
+  for(k = mroute.next; 
+      (k < mroute.last) && (mroute.entry[k].msg == mroute.msg); k++) {
+    mroute.on[mroute.entry[k].cat] = 1;
+  }
+  for(k = 0; k < mroute.ncats; k++) {
+    mroute.touched[k] = mroute.touched[k] || mroute.on[k];
+  }
+}
+
+void route_word_fun(char *tok, token_type_t tt, regex_count_t re) {
+  int k;
+
+  for(k = 0; k < mroute.ncats; k++) {
+    if( mroute.on[k] ) {
+      select_token_cache(mroute.stream[k]);
+      token_cache_word_fun(tok, tt, re);
+    }
+  }
+}
+
+void route_mbox_state_fun(Mstate state) {
+  int k;
+
+  /* a header after anything else starts the next message, 
+     as in count_mbox_messages() */
+  if( state == msHEADER ) {
+    if( !mroute.in_header ) {
+      mroute.msg++;
+      route_select_categories();
+    }
+    mroute.in_header = 1;
+  } else {
+    mroute.in_header = 0;
+  }
+  for(k = 0; k < mroute.ncats; k++) {
+    if( mroute.on[k] ) {
+      select_token_cache(mroute.stream[k]);
+      token_cache_mbox_state_fun(state);
+    }
+  }
+}
+
+/* the end of a file also ends the last document of every 
+   category which got some of it */
+void route_post_line_fun(char *buf) {
+  int k;
+
+  if( !buf ) {
+    for(k = 0; k < mroute.ncats; k++) {
+      if( mroute.touched[k] ) {
+	select_token_cache(mroute.stream[k]);
+	token_cache_post_line_fun(NULL);
+      }
+    }
+  }
+}
+
+void route_post_file_fun(char *name) {
+  int k;
+
+  for(k = 0; k < mroute.ncats; k++) {
+    if( mroute.touched[k] ) {
+      select_token_cache(mroute.stream[k]);
+      token_cache_post_file_fun(name);
+    }
+  }
+}
+
+/* tokenizes the files of the manifest once each, into the token
+   caches of their categories */
+static void route_manifest_files(int (*line_filter)(MBOX_State *, char *),
+				 void (*character_filter)(XML_State *, char *),
+				 char *(*pre_line_fun)(char *)) {
+  void (*mstate_fun)(Mstate) = mbox_state_fun;
+  struct stat statinfo;
+  FILE *input;
+  int k, n;
+
+  if( mbox_state_fun ) {
+    mbox_state_fun = route_mbox_state_fun;
+  }
+  init_file_handling();
+
+  for(n = 0, k = 0; n < mroute.nfiles; n++) {
+    mroute.first = k;
+    for(; (k < mroute.nentries) && (mroute.entry[k].file == n); k++);
+    mroute.last = k;
+    for(mroute.whole = mroute.first; 
+	(mroute.whole < mroute.last) && (mroute.entry[mroute.whole].msg == 0);
+	mroute.whole++);
+    mroute.next = mroute.whole;
+    mroute.msg = 0;
+    mroute.in_header = 0;
+    memset(mroute.touched, 0, mroute.ncats * sizeof(bool_t));
+    route_select_categories();
+
+    input = fopen(mroute.files[n], "rb");
+    if( !input ) {
+      for(k = 0; k < mroute.ncats; k++) {
+	unlink(mroute.cache[k]);
+      }
+      errormsg(E_FATAL, "couldn't open %s\n", mroute.files[n]);
+    }
+    inputfile = mroute.files[n];
+    if( u_options & (1<<U_OPTION_VERBOSE) ) {
+      fprintf(stdout, "processing file %s\n", inputfile);
+    }
+
+    reset_xml_character_filter(&xml, xmlRESET);
+    if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+      reset_mbox_line_filter(&mbox);
+    }
+
+    if( fstat(fileno(input), &statinfo) != 0 ) {
+      errormsg(E_FATAL, "couldn't open %s\n", inputfile);
+    }
+    if( S_ISDIR(statinfo.st_mode) ) {
+      if( mroute.whole < mroute.last ) {
+	errormsg(E_WARNING, 
+		 "message numbers are ignored for directory %s\n", inputfile);
+	mroute.last = mroute.whole;
+      }
+      if( !(m_options & (1<<M_OPTION_I18N)) ) {
+	process_directory(inputfile, line_filter, character_filter,
+			  route_word_fun, pre_line_fun, 
+			  route_post_line_fun, route_post_file_fun);
+      } else {
+#if defined HAVE_MBRTOWC
+	w_process_directory(inputfile, 
+			    line_filter ? w_email_line_filter : NULL, 
+			    character_filter ? w_xml_character_filter : NULL,
+			    route_word_fun, pre_line_fun, 
+			    route_post_line_fun, route_post_file_fun);
+#else
+	errormsg(E_ERROR, "international support not available (recompile).\n");
+#endif
+      }
+    } else if( S_ISREG(statinfo.st_mode) && is_token_cache(input) ) {
+      /* a token cache has its own file names */
+      process_token_cache(input, route_word_fun, 
+			  route_post_line_fun, route_post_file_fun);
+    } else {
+      if( !(m_options & (1<<M_OPTION_I18N)) ) {
+	process_file(input, line_filter, character_filter,
+		     route_word_fun, pre_line_fun, route_post_line_fun);
+      } else {
+#if defined HAVE_MBRTOWC
+	w_process_file(input, 
+		       line_filter ? w_email_line_filter : NULL, 
+		       character_filter ? w_xml_character_filter : NULL,
+		       route_word_fun, pre_line_fun, route_post_line_fun);
+#else
+	errormsg(E_ERROR, "international support not available (recompile).\n");
+#endif
+      }
+      route_post_file_fun(inputfile);
+    }
+    fclose(input);
+  }
+
+  cleanup_file_handling();
+  mbox_state_fun = mstate_fun;
+  select_token_cache(NULL);
+}
+
+/* reads a manifest of "category file [message]" lines. Every file is
+   tokenized only once, and each of its documents is routed to the
+   token caches of its categories, which are then learned by their own
+   processes, up to max_threads of them at a time. Returns NULL in the
+   parent once all the categories are learned, otherwise the token
+   cache which the calling process must learn into learner.filename */
+char **learner_fork_manifest(char *name,
+			     int (*line_filter)(MBOX_State *, char *),
+			     void (*character_filter)(XML_State *, char *),
+			     char *(*pre_line_fun)(char *)) {
+  static char *cache[2] = { NULL, NULL };
+  FILE *f;
+  char buf[BUFSIZ];
+  char *p, *q, *r, *path;
+  pid_t *pids;
+  pid_t pid;
+  long msg;
+  int k, n, running, slots, status;
+  bool_t ok;
+
+  f = fopen(name, "rb");
+  if( !f ) {
+    errormsg(E_FATAL, "couldn't open manifest %s\n", name);
+  }
+  memset(&mroute, 0, sizeof(mroute));
+  while( fgets(buf, BUFSIZ, f) ) {
+    for(q = buf + strlen(buf); (q > buf) && isspace((int)q[-1]); q--);
+    *q = '\0';
+    for(p = buf; isspace((int)*p); p++);
+    if( !*p || (*p == '#') ) {
+      continue;
+    }
+    for(q = p; *q && !isspace((int)*q); q++);
+    if( *q ) {
+      *q++ = '\0';
+    }
+    for(; isspace((int)*q); q++);
+    if( !*q ) {
+      errormsg(E_WARNING, "no file given for category %s in %s\n", p, name);
+      continue;
+    }
+    /* a last field of digits is a message number */
+    msg = 0;
+    for(r = q + strlen(q); (r > q) && isdigit((int)r[-1]); r--);
+    if( *r && (r > q) && isspace((int)r[-1]) ) {
+      msg = atol(r);
+      for(; (r > q) && isspace((int)r[-1]); r--);
+      *r = '\0';
+      if( msg < 1 ) {
+	errormsg(E_WARNING, "messages are numbered from 1 in %s\n", name);
+	continue;
+      }
+      if( !(m_options & (1<<M_OPTION_MBOX_FORMAT)) ) {
+	errormsg(E_FATAL, 
+		 "message numbers in manifest %s need the -T email switch\n",
+		 name);
+      }
+    }
+
+    path = sanitize_path(p, extn);
+    for(k = 0; (k < mroute.ncats) && (strcmp(mroute.cats[k], path) != 0); 
+	k++);
+    if( k == mroute.ncats ) {
+      mroute.cats = (char **)realloc(mroute.cats, 
+				     (k + 1) * sizeof(char *));
+      if( !mroute.cats ) {
+	errormsg(E_FATAL, "not enough memory for the manifest\n");
+      }
+      mroute.cats[k] = path;
+      mroute.ncats++;
+    } else {
+      free(path);
+    }
+    for(n = 0; (n < mroute.nfiles) && (strcmp(mroute.files[n], q) != 0); 
+	n++);
+    if( n == mroute.nfiles ) {
+      mroute.files = (char **)realloc(mroute.files, 
+				      (n + 1) * sizeof(char *));
+      if( !mroute.files || !(mroute.files[n] = strdup(q)) ) {
+	errormsg(E_FATAL, "not enough memory for the manifest\n");
+      }
+      mroute.nfiles++;
+    }
+    mroute.entry = (manifest_entry_t *)
+      realloc(mroute.entry, (mroute.nentries + 1) * sizeof(manifest_entry_t));
+    if( !mroute.entry ) {
+      errormsg(E_FATAL, "not enough memory for the manifest\n");
+    }
+    mroute.entry[mroute.nentries].file = n;
+    mroute.entry[mroute.nentries].cat = k;
+    mroute.entry[mroute.nentries].msg = msg;
+    mroute.nentries++;
+  }
+  fclose(f);
+
+  if( mroute.ncats == 0 ) {
+    errormsg(E_FATAL, "no categories found in manifest %s\n", name);
+  }
+  qsort(mroute.entry, mroute.nentries, sizeof(manifest_entry_t), 
+	compare_manifest_entries);
+
+  mroute.cache = (char **)calloc(mroute.ncats, sizeof(char *));
+  mroute.stream = (FILE **)calloc(mroute.ncats, sizeof(FILE *));
+  mroute.on = (bool_t *)calloc(mroute.ncats, sizeof(bool_t));
+  mroute.touched = (bool_t *)calloc(mroute.ncats, sizeof(bool_t));
+  pids = (pid_t *)calloc(mroute.ncats, sizeof(pid_t));
+  if( !mroute.cache || !mroute.stream || !mroute.on || 
+      !mroute.touched || !pids ) {
+    errormsg(E_FATAL, "not enough memory for the manifest\n");
+  }
+
+  for(k = 0; k < mroute.ncats; k++) {
+    mroute.stream[k] = mytmpfile(mroute.cats[k], &mroute.cache[k]);
+    if( !mroute.stream[k] ) {
+      errormsg(E_FATAL, "cannot create a token cache for %s\n", 
+	       mroute.cats[k]);
+    }
+    start_token_cache(mroute.stream[k]);
+  }
+
+  route_manifest_files(line_filter, character_filter, pre_line_fun);
+
+  ok = 1;
+  for(k = 0; k < mroute.ncats; k++) {
+    if( ferror(mroute.stream[k]) || (fclose(mroute.stream[k]) != 0) ) {
+      errormsg(E_ERROR, "couldn't write token cache %s\n", mroute.cache[k]);
+      ok = 0;
+    }
+  }
+
+  slots = MAXIMUM(1, MINIMUM(max_threads, mroute.ncats));
+
+  fflush(stdout);
+  fflush(stderr);
+  running = 0;
+  for(k = 0; ok && (k <= mroute.ncats); k++) {
+    /* wait for a free slot, or for everybody at the end */
+    while( (running > 0) && ((running >= slots) || (k == mroute.ncats)) ) {
+      do {
+	pid = waitpid(-1, &status, 0);
+      } while( (pid == -1) && (errno == EINTR) );
+      if( pid == -1 ) {
+	break;
+      }
+      running--;
+      for(n = 0; (n < mroute.ncats) && (pids[n] != pid); n++);
+      if( !WIFEXITED(status) || (WEXITSTATUS(status) != 0) ) {
+	errormsg(E_WARNING, "could not learn category %s\n", 
+		 (n < mroute.ncats) ? mroute.cats[n] : "?");
+	ok = 0;
+      }
+    }
+    if( k == mroute.ncats ) {
+      break;
+    }
+
+    pids[k] = fork();
+    if( pids[k] == 0 ) {
+      learner.filename = mroute.cats[k];
+      /* the categories share the -J processors */
+      max_threads = MAXIMUM(1, max_threads / slots);
+      cache[0] = mroute.cache[k];
+      return cache;
+    } else if( pids[k] == -1 ) {
+      errormsg(E_WARNING, "could not learn category %s\n", mroute.cats[k]);
+      ok = 0;
+    } else {
+      running++;
+    }
+  }
+
+  for(k = 0; k < mroute.ncats; k++) {
+    unlink(mroute.cache[k]);
+    free(mroute.cache[k]);
+    free(mroute.cats[k]);
+  }
+  for(n = 0; n < mroute.nfiles; n++) {
+    free(mroute.files[n]);
+  }
+  free(mroute.cache);
+  free(mroute.stream);
+  free(mroute.on);
+  free(mroute.touched);
+  free(mroute.cats);
+  free(mroute.files);
+  free(mroute.entry);
+  free(pids);
+
+  exit_code = ok ? 0 : 1;
+  return NULL;
+}
+
 int set_option(int op, char *optarg) {
   int c = 0;
+  hashfun_t hf = HF_DEFAULT;
+  long budget;
+  char *p;
   switch(op) {
   case '@':
     /* this is an official NOOP, it MUST be ignored (see spherecl) */
@@ -4026,6 +6100,24 @@ int set_option(int op, char *optarg) {
   case 'a':
     u_options |= (1<<U_OPTION_APPEND);
     break;
+  case 'b':
+    if( u_options & (1<<U_OPTION_CLASSIFY) ) {
+      errormsg(E_ERROR,
+	       "cannot use options -b and -c together\n");
+      exit(1);
+    } else if( u_options & (1<<U_OPTION_LEARN) ) {
+      errormsg(E_ERROR,
+	       "cannot use options -l and -b together\n");
+      exit(1);
+    } else if( !*optarg ) {
+      errormsg(E_ERROR, "manifest name must not be empty\n");
+      exit(1);
+    } else {
+      u_options |= (1<<U_OPTION_LEARN);
+      manifest = optarg;
+    }
+    c++;
+    break;
   case 'e':
     if( !strcasecmp(optarg, "alnum") ) {
       m_cp = CP_ALNUM;
@@ -4048,9 +6140,30 @@ int set_option(int op, char *optarg) {
     }
     c++;
     break;
+  case 'k':
+    if( !strcasecmp(optarg, "lookup2") ) {
+      hf = HF_LOOKUP2;
+    } else if( !strcasecmp(optarg, "murmur") ) {
+      hf = HF_MURMUR;
+    } else {
+      errormsg(E_FATAL, 
+	       "-k option needs one of \"lookup2\", \"murmur\"\n");
+    }
+    /* categories given with -c may already have fixed the hash */
+    if( (m_hf != HF_DEFAULT) && (m_hf != hf) ) {
+      errormsg(E_FATAL,
+	       "-k %s conflicts with the token hash of the categories\n",
+	       optarg);
+    }
+    m_hf = hf;
+    c++;
+    break;
   case 'D':
     u_options |= (1<<U_OPTION_DEBUG);
     break;
+  case 'E':
+    u_options |= (1<<U_OPTION_ACCELERATE);
+    break;
   case 'm':
 #if defined HAVE_MMAP      
     u_options |= (1<<U_OPTION_MMAP);
@@ -4080,6 +6193,38 @@ int set_option(int op, char *optarg) {
       cat_count++;
     }
     break;
+  case 's':
+    budget = strtol(optarg, &p, 10);
+    if( (*p == 'k') || (*p == 'K') ) {
+      budget_bytes = budget<<10;
+      p++;
+    } else if( (*p == 'm') || (*p == 'M') ) {
+      budget_bytes = budget<<20;
+      p++;
+    } else {
+      budget_features = budget;
+    }
+    if( (budget <= 0) || *p ) {
+      errormsg(E_ERROR, 
+	       "option -s needs a number of features, or a size in kilobytes "
+	       "(k) or megabytes (m)\n");
+      exit(1);
+    } else if( budget_bytes && (budget_bytes < prune_overhead_bytes()) ) {
+      errormsg(E_ERROR, "option -s needs at least %ldk for a category\n",
+	       (prune_overhead_bytes()>>10) + 1);
+      exit(1);
+    }
+    c++;
+    break;
+  case 't':
+    if( !*optarg ) {
+      errormsg(E_ERROR, "token cache name must not be empty\n");
+      exit(1);
+    }
+    u_options |= (1<<U_OPTION_TOKENIZE);
+    tokcache = optarg;
+    c++;
+    break;
   case 'T':
     if( !strncasecmp(optarg, "text", 4) ) {
       /* this is the default */
@@ -4210,6 +6355,9 @@ int set_option(int op, char *optarg) {
     if( cat_count >= MAX_CAT ) {
       errormsg(E_WARNING,
 	       "maximum reached, category ignored\n");
+    } else if( *manifest ) {
+      errormsg(E_ERROR, "cannot use options -b and -c together\n");
+      exit(1);
     } else if( u_options & (1<<U_OPTION_LEARN) ) {
       errormsg(E_ERROR, "cannot use options -l and -c together\n");
       exit(1);
@@ -4225,7 +6373,7 @@ int set_option(int op, char *optarg) {
 	errormsg(E_FATAL, "could not load category %s\n",
 		 cat[cat_count].fullfilename);
       }
-      if( sanitize_model_options(&m_options,&m_cp,&cat[cat_count]) ) {
+      if( sanitize_model_options(&m_options,&m_cp,&m_hf,&cat[cat_count]) ) {
 	ngram_order = (ngram_order < cat[cat_count].max_order) ? 
 	  cat[cat_count].max_order : ngram_order;
 	cat_count++;
@@ -4351,6 +6499,10 @@ int set_option(int op, char *optarg) {
       errormsg(E_ERROR,
 	       "cannot use options -l and -c together\n");
       exit(1);
+    } else if( *manifest ) {
+      errormsg(E_ERROR,
+	       "cannot use options -l and -b together\n");
+      exit(1);
     } else if( u_options & (1<<U_OPTION_LEARN) ) {
       errormsg(E_ERROR,
 	       "option -l can only occur once\n");
@@ -4411,6 +6563,34 @@ int set_option(int op, char *optarg) {
     zthreshold = atoi(optarg);
     c++;
     break;
+  case 'I':
+    u_options |= (1<<U_OPTION_INODE_ORDER);
+    break;
+  case 'J':
+    max_threads = atoi(optarg);
+#if !defined HAVE_LIBPTHREAD
+    if( max_threads > 1 ) {
+      errormsg(E_WARNING,
+	       "threads not available (recompile), ignoring -J\n");
+      max_threads = 1;
+    }
+#endif
+    c++;
+    break;
+  case 'K':
+    u_options |= (1<<U_OPTION_JOURNAL);
+    break;
+  case 'Q':
+    delta.interval = atoi(optarg);
+    if( delta.interval < 1 ) {
+      errormsg(E_WARNING,
+	       "-Q needs a positive document count, ignoring\n");
+      delta.interval = 0;
+    } else {
+      u_options |= (1<<U_OPTION_INCREMENTAL);
+    }
+    c++;
+    break;
   default:
     c--;
     break;
@@ -4423,8 +6603,9 @@ void sanitize_options() {
 
   /* consistency checks */
   if( ((u_options>>U_OPTION_CLASSIFY) & 1) + 
-      ((u_options>>U_OPTION_LEARN) & 1) != 1 ) {
-    errormsg(E_ERROR, "please use either -c or -l option.\n");
+      ((u_options>>U_OPTION_LEARN) & 1) +
+      ((u_options>>U_OPTION_TOKENIZE) & 1) != 1 ) {
+    errormsg(E_ERROR, "please use either -c, -l or -t option.\n");
     exit(1);
   }
 
@@ -4442,6 +6623,46 @@ void sanitize_options() {
     u_options &= ~(1<<U_OPTION_DECIMATE);
   }
 
+  if( (u_options & (1<<U_OPTION_INCREMENTAL)) &&
+      (!*online || !(u_options & (1<<U_OPTION_LEARN))) ) {
+    errormsg(E_WARNING,
+	    "option -Q ignored, applies only with -l and -o.\n");
+    u_options &= ~(1<<U_OPTION_INCREMENTAL);
+  }
+
+  if( (u_options & (1<<U_OPTION_JOURNAL)) &&
+      !(u_options & (1<<U_OPTION_LEARN)) ) {
+    errormsg(E_WARNING,
+	    "option -K ignored, applies only when learning.\n");
+    u_options &= ~(1<<U_OPTION_JOURNAL);
+  }
+
+  if( (u_options & (1<<U_OPTION_ACCELERATE)) &&
+      !(u_options & (1<<U_OPTION_LEARN)) ) {
+    errormsg(E_WARNING,
+	    "option -E ignored, applies only when learning.\n");
+    u_options &= ~(1<<U_OPTION_ACCELERATE);
+  }
+
+  if( *manifest && (*online || (ronline_count > 0)) ) {
+    errormsg(E_ERROR, "cannot use options -b and -o together\n");
+    exit(1);
+  }
+
+  if( (budget_features || budget_bytes) &&
+      !(u_options & (1<<U_OPTION_LEARN)) ) {
+    errormsg(E_WARNING,
+	    "option -s ignored, applies only when learning.\n");
+    budget_features = budget_bytes = 0;
+  }
+
+  if( (budget_features || budget_bytes) &&
+      (u_options & (1<<U_OPTION_INCREMENTAL)) ) {
+    errormsg(E_WARNING,
+	    "option -s ignored, cannot be used with -Q.\n");
+    budget_features = budget_bytes = 0;
+  }
+
   if( u_options & (1<<U_OPTION_DUMP) ) {
     if( u_options & (1<<U_OPTION_VERBOSE) ) {
       u_options &= ~(1<<U_OPTION_VERBOSE); /* verbose writes garbage to stdout */
@@ -4496,7 +6717,8 @@ void sanitize_options() {
 
   /* decide if we need some options */
 
-  if( u_options & (1<<U_OPTION_LEARN) ) {
+  if( (u_options & (1<<U_OPTION_LEARN)) ||
+      (u_options & (1<<U_OPTION_TOKENIZE)) ) {
     if( !regex_count ) {
       m_options |= (1<<M_OPTION_USE_STDTOK);
     } else {
@@ -4600,7 +6822,7 @@ int main(int argc, char **argv) {
 
   /* parse the options */
   while( (op = getopt(argc, argv, 
-		      "01Aac:Dde:f:FG:g:H:h:ijL:l:mMNno:O:Ppq:RrST:UVvw:x:XYz:@")) > -1 ) {
+		      "01Aab:c:DdEe:f:FG:g:H:h:iIjJ:Kk:L:l:mMNno:O:Ppq:Q:Rrs:St:T:UVvw:x:XYz:@")) > -1 ) {
     set_option(op, optarg);
   }
 
@@ -4635,10 +6857,26 @@ int main(int argc, char **argv) {
     preprocess_fun = learner_preprocess_fun;
     word_fun = learner_word_fun;
     post_line_fun =  learner_post_line_fun;
+    if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+      mbox_state_fun = learner_mbox_state_fun;
+    }
     post_file_fun = NULL;
     postprocess_fun = learner_postprocess_fun;
     cleanup_fun = learner_cleanup_fun;
 
+  } else if( u_options & (1<<U_OPTION_TOKENIZE) ) {
+    /* tokens are saved for later learning or classification */
+
+    preprocess_fun = tokenizer_preprocess_fun;
+    word_fun = token_cache_word_fun;
+    post_line_fun = token_cache_post_line_fun;
+    if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+      mbox_state_fun = token_cache_mbox_state_fun;
+    }
+    post_file_fun = token_cache_post_file_fun;
+    postprocess_fun = NULL;
+    cleanup_fun = close_token_cache;
+
   } else { /* something wrong ? */
     usage(argv);
     exit(1);
@@ -4671,6 +6909,28 @@ int main(int argc, char **argv) {
 #endif
 
 
+  /* each category in a manifest is learned by its own process */
+  if( *manifest ) {
+    if( *(argv + optind) ) {
+      errormsg(E_WARNING, "files on the command line are ignored with -b\n");
+    }
+    argv = learner_fork_manifest(manifest, line_filter, character_filter,
+				 pre_line_fun);
+    if( !argv ) {
+      exit(exit_code);
+    }
+    for(argc = 0; argv[argc]; argc++);
+    optind = 0;
+  }
+
+  /* several input files can be learned by worker processes */
+  if( (u_options & (1<<U_OPTION_LEARN)) &&
+      learner_fork_workers(argv + optind) ) {
+    preprocess_fun = NULL;
+    optind = argc;
+    u_options |= (1<<U_OPTION_STDIN);
+  }
+
   if( preprocess_fun ) { (*preprocess_fun)(); }
 
 
@@ -4714,6 +6974,15 @@ int main(int argc, char **argv) {
 	  }
 	  break;
 	default:
+	  if( claim_file_fun && !(*claim_file_fun)() ) {
+	    break;
+	  }
+	  /* a token cache has its own file names */
+	  if( S_ISREG(statinfo.st_mode) && is_token_cache(input) &&
+	      !(u_options & (1<<U_OPTION_TOKENIZE)) ) {
+	    process_token_cache(input, word_fun, post_line_fun, post_file_fun);
+	    break;
+	  }
 	  if( !(m_options & (1<<M_OPTION_I18N)) ) {
 	    process_file(input, line_filter, character_filter,
 			 word_fun, pre_line_fun, post_line_fun);
@@ -4725,12 +6994,12 @@ int main(int argc, char **argv) {
 	    errormsg(E_ERROR, "international support not available (recompile).\n");
 #endif
 	  }
+	  /* files inside directories are reported as they are read */
+	  if( post_file_fun ) { (*post_file_fun)(inputfile); }
 	}
       }
       fclose(input);
 
-      if( post_file_fun ) { (*post_file_fun)(inputfile); }
-
     } else { /* unrecognized file name */
 
       errormsg(E_FATAL, "couldn't open %s\n", argv[optind]);
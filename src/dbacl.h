@@ -83,6 +83,7 @@
 #endif
 
 #include <limits.h>
+#include <float.h>
 #include <stdio.h>
 
 
@@ -93,6 +94,8 @@
 
 #endif
 
+#include <sys/stat.h>
+
 #if defined HAVE_NETINET_IN_H
 #include <netinet/in.h>
 #endif
@@ -132,12 +135,14 @@ typedef uint64_t u_int64_t;
 #define MUNLOCK(x,y) munlock((caddr_t)(x),y)
 #define MUNMAP(x,y) munmap((void *)(x),y)
 #define MMAP(x,y,z,t,u,v) mmap((void *)(x),y,z,t,u,v)
+#define MSYNC(x,y,z) msync((caddr_t)(x),y,z)
 #else
 #define MADVISE(x,y,z) madvise(x,y,z)
 #define MLOCK(x,y) mlock(x,y)
 #define MUNLOCK(x,y) munlock(x,y)
 #define MUNMAP(x,y) munmap((void *)(x), y)
 #define MMAP(x,y,z,t,u,v) mmap((void *)(x),y,z,t,u,v)
+#define MSYNC(x,y,z) msync((void *)(x),y,z)
 #endif
 
 #endif
@@ -151,6 +156,7 @@ typedef uint64_t u_int64_t;
 #define MUNLOCK(x,y)
 #define MUNMAP(x,y)
 #define MMAP(x,y,z,t,u,v) NULL
+#define MSYNC(x,y,z)
 #endif
 
 /* constants used by mmap */
@@ -160,8 +166,12 @@ typedef uint64_t u_int64_t;
 #define PROT_EXEC  0
 #define PROT_NONE  0
 #endif
+#ifndef MS_ASYNC
+#define MS_ASYNC 0
+#endif
 
 #define PAGEALIGN(x) ((x) / system_pagesize) * system_pagesize
+#define PAGEROUND(x) PAGEALIGN((x) + system_pagesize - 1)
 
 /* below, FMT_* macros are used in printf/scanf format strings */
 #if defined HUGE_MEMORY_MODEL
@@ -401,10 +411,16 @@ typedef u_int16_t digitized_weight_t;
 #define DIGITIZED_WEIGHT_MIN ((digitized_weight_t)0)
 #define DIGITIZED_WEIGHT_MAX ((digitized_weight_t)USHRT_MAX)
 #define DIG_FACTOR           5
+/* digram counts are floats, whose increments stall at 2^FLT_MANT_DIG */
+#define K_DIGRAM_COUNT_EXACT ((weight_t)(1L<<FLT_MANT_DIG))
 /* maximum number of categories we can handle simultaneously */
 #define MAX_CAT ((category_count_t)64)
 /* percentage of hash we use */
 #define HASH_FULL ((hash_percentage_t)95)
+/* with -s, the category headers are assumed to fit in this many lines */
+#define PRUNE_HEADER_LINES 8
+/* slots moved into a grown learner hash for each token learned */
+#define LEARNER_GROW_STEP 32
 /* alphabet size */
 #define ASIZE ((alphabet_size_t)256)
 /* we need three special markers, which cannot be part 
@@ -455,6 +471,8 @@ typedef u_int16_t digitized_weight_t;
  */
 #define MAX_TOKEN_LEN ((charbuf_len_t)30) 
 #define TOKEN_LIST_GROW 1048576L
+/* temporary tokens are kept in memory up to this size */
+#define TOKEN_LIST_MEMORY (64 * TOKEN_LIST_GROW)
 
 /* user options */
 #define U_OPTION_CLASSIFY               1
@@ -467,12 +485,16 @@ typedef u_int16_t digitized_weight_t;
 #define U_OPTION_POSTERIOR              8
 #define U_OPTION_FILTER                 9
 #define U_OPTION_DEBUG                  10
+#define U_OPTION_INCREMENTAL            11
 #define U_OPTION_DUMP                   12
 #define U_OPTION_APPEND                 13
 #define U_OPTION_DECIMATE               14
 #define U_OPTION_GROWHASH               15
 #define U_OPTION_INDENTED               16
 #define U_OPTION_NOZEROLEARN            17
+#define U_OPTION_JOURNAL                18
+#define U_OPTION_ACCELERATE             19
+#define U_OPTION_TOKENIZE               20
 #define U_OPTION_MMAP                   21
 #define U_OPTION_CONFIDENCE             22
 #define U_OPTION_VAR                    23
@@ -480,6 +502,7 @@ typedef u_int16_t digitized_weight_t;
 #define U_OPTION_CLASSIFY_MULTIFILE     25
 #define U_OPTION_PRIOR_CORRECTION       26
 #define U_OPTION_MEDIACOUNTS            27
+#define U_OPTION_INODE_ORDER            28
 
 /* model options */
 #define M_OPTION_REFMODEL               1
@@ -490,6 +513,7 @@ typedef u_int16_t digitized_weight_t;
 #define M_OPTION_CASEN                  6
 #define M_OPTION_CALCENTROPY            7
 #define M_OPTION_MULTINOMIAL            8
+#define M_OPTION_HASH_MURMUR            9
 #define M_OPTION_HEADERS                13
 #define M_OPTION_PLAIN                  14
 #define M_OPTION_NOPLAIN                15
@@ -510,6 +534,8 @@ typedef u_int16_t digitized_weight_t;
 
 /* category options */
 #define C_OPTION_MMAPPED_HASH            1
+#define C_OPTION_JOURNAL                 2
+#define C_OPTION_BAD_JOURNAL             3
 
 
 typedef u_int32_t options_t; /* make sure big enough for all options */
@@ -522,6 +548,10 @@ typedef enum {
   CP_CHAR, CP_ALPHA, CP_ALNUM, CP_GRAPH, 
   CP_CEF, CP_ADP, CP_CEF2
 } charparser_t;
+typedef enum {
+  HF_DEFAULT=0,
+  HF_LOOKUP2, HF_MURMUR
+} hashfun_t;
 #define FMT_printf_options_t "d"
 #define FMT_scanf_options_t "ld"
 
@@ -530,6 +560,8 @@ typedef long int re_bitfield;
 #define INVALID_RE 0
 /* maximum number of tagged subexpressions we can handle for each regex */
 #define MAX_SUBMATCH ((token_order_t)9)
+/* room for the longest token, submatches and class included */
+#define MAX_FULL_TOKEN_LEN ((MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN)
 
 typedef enum {gcUNDEF = 0, gcDISCARD, gcTOKEN, gcTOKEN_END, gcIGNORE} good_char_t;
 
@@ -606,6 +638,7 @@ typedef enum {gcUNDEF = 0, gcDISCARD, gcTOKEN, gcTOKEN_END, gcIGNORE} good_char_
 #define NOTNULL(x) ((x) > 0)
 
 #define MAXIMUM(x,y) (((x)<(y))?(y):(x))
+#define MINIMUM(x,y) (((x)<(y))?(x):(y))
 #define INCREMENT(x,y,z) if( (x) < (y) ) { (x)++; } else { z = 1; }
 #define INCREASE(x,d,y,z) if( (x) < ((y)-(d)) ) { (x) += (d); } else { z = 1; }
 
@@ -637,8 +670,11 @@ typedef enum {gcUNDEF = 0, gcDISCARD, gcTOKEN, gcTOKEN_END, gcIGNORE} good_char_
 
 /* used by both category load and learner save functions */
 #define MAGIC_BUFSIZE 512
-#define MAGIC1    "# dbacl " SIGNATURE " category %s %s\n"
-#define MAGIC1_LEN (17 + strlen(SIGNATURE))
+#define MAGIC1    "# dbacl " SIGNATURE "%s category %s %s\n"
+#define MAGIC1_LEN (8 + strlen(SIGNATURE))
+/* token hash recorded after the signature, lookup2 has none */
+#define HASHTAG_MURMUR " murmur"
+#define HASHTAG(hf) (((hf) == HF_MURMUR) ? HASHTAG_MURMUR : "")
 #define MAGIC2_i  "# entropy %" FMT_scanf_score_t \
                   " logZ %" FMT_scanf_score_t " max_order %hd" \
                   " type %s\n"
@@ -673,7 +709,27 @@ typedef enum {gcUNDEF = 0, gcDISCARD, gcTOKEN, gcTOKEN_END, gcIGNORE} good_char_
                   " s2 %" FMT_printf_score_t "\n"
 #define MAGIC11   "# medialp "
 
-#define MAGIC_ONLINE "# dbacl " SIGNATURE " online memory dump\n"
+#define MAGIC_ONLINE "# dbacl " SIGNATURE " online memory dump v2\n"
+/* the header which follows MAGIC_ONLINE, see online_header_t */
+#define ONLINE_VERSION 2
+#define ONLINE_BYTEORDER 0x01020304
+
+/* a category journal (-K switch) starts with the inode, size and
+   modification time of the category file it applies to. Each record
+   then gives the number of changed digrams and weights, the MAGIC2_o,
+   MAGIC3, MAGIC8_o and MAGIC10_o lines, the digram positions (two
+   bytes each), the digram values and the c_item_t weights */
+#define JOURNAL_EXTN ".jnl"
+#define MAGIC_JOURNAL_o "# dbacl " SIGNATURE " journal %lu %ld %ld\n"
+#define MAGIC_JOURNAL_i "# dbacl " SIGNATURE " journal %lu %ld %ld"
+#define MAGIC_RECORD "# record %ld %ld\n"
+/* the journal is folded back once it is this fraction of the category */
+#define JOURNAL_COMPACT 4
+
+/* a token cache made with -t starts with these lines, then the regex
+   lines and MAGIC6, followed by binary records (see fh.c) */
+#define MAGIC_TOKENS "# dbacl " SIGNATURE " token cache v1\n"
+#define MAGIC_TOKENS_OPT "# options %" FMT_printf_options_t " %hd %u %d\n"
 
 #define MAGIC_DUMP "# lambda | dig_ref | count | id     | token\n"
 #define MAGIC_DUMPTBL_o "%9.3f %9.3f %7d %8lx "
@@ -751,6 +807,7 @@ typedef struct {
     options_t options;
     charparser_t cp;
     digtype_t dt;
+    hashfun_t hf;
   } model;
   options_t c_options;
   c_item_t *hash;
@@ -763,14 +820,12 @@ typedef struct {
 #endif
 } category_t;
 
+/* the learner hash entries are kept naturally aligned and small, as
+   every token probes them. The entropy weights B, which are only
+   needed at the end of each document, live in learner_t instead */
 typedef struct {
+  hash_value_t id;
   token_count_t count;
-  weight_t B; /* mustn't digitize this :-( */
-#if defined DIGITIZE_LAMBDA
-  digitized_weight_t lam; 
-#else
-  weight_t lam;
-#endif
   union {
     struct {
 #if defined DIGITIZE_LWEIGHTS
@@ -785,9 +840,13 @@ typedef struct {
       token_count_t eff;
     } read;
   } tmp;
-  hash_value_t id;
+#if defined DIGITIZE_LAMBDA
+  digitized_weight_t lam; 
+#else
+  weight_t lam;
+#endif
   token_type_t typ;
-} PACK_STRUCTS l_item_t;
+} l_item_t;
 
 typedef struct {
   hash_value_t *stack;
@@ -828,6 +887,14 @@ typedef struct {
   score_t mu;
   score_t s2;
   score_t mediaprobs[TOKEN_CLASS_MAX];
+  struct {
+    /* with -Q, the optimum of the last run, and how far logZ/r may
+       be from the optimum of a full pass, since the weights which
+       weren't optimized again drifted from it */
+    score_t logzonr[MAX_SUBMATCH];
+    score_t logXi[MAX_SUBMATCH];
+    score_t drift;
+  } delta;
   struct {
     options_t options;
     charparser_t cp;    
@@ -836,9 +903,20 @@ typedef struct {
   } model;
   options_t u_options;
   byte_t *mmap_start;
+  size_t mmap_length;
   long mmap_learner_offset;
   long mmap_hash_offset;
+  hash_count_t mmap_capacity; /* slots the mapped file has room for */
   l_item_t *hash;
+  weight_t *B; /* one per hash slot, mustn't digitize this :-( */
+  struct {
+    l_item_t *hash; /* smaller table, moved into the hash above */
+    weight_t *B;
+    hash_count_t max_tokens;
+    hash_count_t next; /* slots before this one were moved */
+    byte_t *mmap_start;
+    size_t mmap_length;
+  } old;
   weight_t dig[ASIZE][ASIZE];
   long int regex_token_count[MAX_RE + 1];
   struct {
@@ -859,9 +937,163 @@ typedef struct {
     emplist_t reservoir[RESERVOIR_SIZE];
   } doc;
 } learner_t;
+
+/* an online memory dump (-o switch) is the MAGIC_ONLINE line, this
+   header, then the learner_t, hash table, entropy sums (if any) and
+   token list at the page aligned offsets below. The hash section has
+   room for capacity slots, so that it can grow in place when mapped. */
+typedef struct {
+  u_int32_t byteorder; /* ONLINE_BYTEORDER */
+  u_int32_t version;   /* ONLINE_VERSION */
+  u_int32_t learner_size;
+  u_int32_t item_size;
+  u_int32_t weight_size;
+  u_int32_t reserved;
+  u_int64_t capacity;
+  u_int64_t learner_offset;
+  u_int64_t hash_offset;
+  u_int64_t B_offset; /* zero if there are no entropy sums */
+  u_int64_t token_offset;
+} online_header_t;
+
+/* a feature ranked for pruning with -s */
+typedef struct {
+  weight_t score;
+  hash_count_t slot;
+} prune_item_t;
+
+/* learning from several input files with worker processes (-J switch).
+   Input file number k is read by worker k % count, which records where
+   each file ends in its token list, and the entropies of the documents
+   in that file. The parent then merges the workers in file order. */
+typedef struct {
+  pid_t pid;
+  char *dump; /* online memory dump of the worker's learner */
+  char *part; /* file boundaries and document entropies */
+} learner_worker_t;
+
+typedef struct {
+  int count;
+  int id; /* this worker, or -1 in the parent */
+  long file; /* sequence number of the next input file */
+  bool_t claimed; /* this worker has read a file */
+  FILE *part;
+  learner_worker_t *w;
+  score_t *shannon;
+  document_count_t top;
+  document_count_t max;
+} learner_workers_t;
+
+/* learning several categories from a manifest (-b switch). Each input
+   file is tokenized only once, and the tokens of each document are
+   routed to a token cache per category, which a process of its own
+   then learns. */
+typedef struct {
+  int file; /* index of the file name */
+  int cat;
+  long msg; /* message number in an mbox, or 0 for the whole file */
+} manifest_entry_t;
+
+typedef struct {
+  int ncats;
+  char **cats;
+  char **cache; /* token cache of each category */
+  FILE **stream;
+  bool_t *on; /* category gets the current document */
+  bool_t *touched; /* category got part of the current file */
+  int nfiles;
+  char **files;
+  int nentries;
+  manifest_entry_t *entry; /* sorted by file, then message */
+  int first, whole, next, last; /* entries of the current file */
+  long msg;
+  bool_t in_header;
+} manifest_route_t;
+
+/* incremental learning with an online memory dump (-Q switch). The
+   hash slots of the tokens learned since the dump was loaded are
+   flagged, and only their weights, and those of the features they are
+   a suffix of, are optimized again. A full optimization is done every
+   interval documents, or if the hash had to grow. */
+typedef struct {
+  document_count_t interval;
+  document_count_t base; /* documents in the loaded dump */
+  byte_t *active; /* one flag per hash slot */
+  token_count_t *slot;
+  token_count_t count;
+  token_count_t slot_max;
+} learner_delta_t;
+
+/* hash slots of the emp.stack entries of the current document, so
+   that update_shannon_partials() needn't look them up again. They go
+   stale when the hash grows, and are then looked up as before. */
+typedef struct {
+  l_item_t **slot;
+  hash_count_t max;
+  bool_t valid;
+} learner_emp_slots_t;
+
 /* this is used when minimizing learner divergence */
 #define MAX_LAMBDA_JUMP 100
 
+/* the optimizer sums over fixed chunks of the learner hash, and adds
+   the partial sums in chunk order, so that the weights don't depend on
+   how many threads (-J switch) share the chunks */
+#define LEARNER_CHUNK_BITS 12
+#define LEARNER_CHUNK (1L<<LEARNER_CHUNK_BITS)
+
+/* the filled slots of the learner hash, grouped by chunk, then by
+   order, in slot order. The order r features of chunk k are
+   slot[start[k * orders + r]] up to slot[start[k * orders + r + 1] - 1].
+   The tokens of the temporary token file are also resolved once, to
+   their slot, reference weight and the slots of their suffixes */
+typedef struct {
+  token_order_t orders;
+  long chunks;
+  token_count_t *slot;
+  token_count_t *start;
+  struct {
+    token_count_t count;
+    token_count_t max;
+    token_count_t *slot;
+    weight_t *dref;
+    token_count_t *suffix_start;
+    token_count_t *suffix;
+    token_count_t suffix_max;
+  } tok;
+} learner_features_t;
+
+typedef enum {
+  lrMAXLOGZ, lrLOGZ, lrDIVERGENCE, lrEXTRABITS, lrLUNCH, lrLAMBDA, lrSLOPE
+} learner_reduce_op_t;
+
+typedef struct {
+  score_t sum;
+  score_t max;
+  token_count_t count;
+} learner_reduce_part_t;
+
+typedef struct {
+  learner_t *learner;
+  learner_features_t *features;
+  learner_reduce_op_t op;
+  token_order_t r;
+  bool_t fwd;
+  score_t maxlogz, logzonr, logXi;
+  token_count_t zcut;
+  long chunks;
+  int thread, threads;
+  learner_reduce_part_t *part;
+  learner_reduce_part_t total;
+} learner_reduce_t;
+
+/* scores of the reservoir documents, shared among threads */
+typedef struct {
+  learner_t *learner;
+  score_t *score;
+  int thread, threads;
+} learner_reservoir_t;
+
 typedef struct {
   double alpha;
   double u[ASIZE];
@@ -876,6 +1108,20 @@ typedef struct {
 
 #define MAX_BOUNDARIES 8
 
+/* wide character class bits, cached for the first code points
+   (see fill_wc_textbuf() and mbw.h) */
+#define WCTYPE_CACHE_SIZE 0x800
+#define WCT_ALNUM  0x0001
+#define WCT_ALPHA  0x0002
+#define WCT_GRAPH  0x0004
+#define WCT_SPACE  0x0008
+#define WCT_BLANK  0x0010
+#define WCT_CNTRL  0x0020
+#define WCT_PUNCT  0x0040
+#define WCT_XDIGIT 0x0080
+#define WCT_DIGIT  0x0100
+#define WCT_PRINT  0x0200
+
 #define MAX_BOUNDARY_BUFSIZE 70
 
 typedef enum { ceUNDEF, ceID, ceB64, ceQP, ceBIN, ceSEVEN} MIME_Content_Encoding;
@@ -968,6 +1214,7 @@ typedef struct {
   w_decoding_cache w_b64_dc;
   w_decoding_cache w_qp_dc;
 #endif
+  long skipped_bytes; /* non-text MIME parts skipped without parsing */
 } MBOX_State;
 
 typedef enum {TEXT=1, XTAG, XTAGQUOTE, XTAGDQUOTE, XTAGPREQ, TAG, TAGQUOTE, TAGDQUOTE, TAGPREQ, CMNT, DISABLED} Xstate;
@@ -1000,25 +1247,46 @@ extern "C"
   void count_mbox_messages(learner_t *learner, Mstate mbox_state, char *buf);
   void calc_shannon(learner_t *learner);
   void update_shannon_partials(learner_t *learner, bool_t fulldoc);
+  void emp_slots_grow(hash_count_t max);
+  void free_emp_slots();
   void optimize_and_save(learner_t *learner);
 
   l_item_t *find_in_learner(learner_t *learner, hash_value_t id);
   bool_t grow_learner_hash(learner_t *learner);
+  void grow_learner_step(learner_t *learner);
+  weight_t *find_learner_B(learner_t *learner, l_item_t *i);
+  void finish_learner_growth(learner_t *learner);
   void hash_word_and_learn(learner_t *learner, 
 			   char *tok, token_type_t tt, regex_count_t re);
 
+  void init_learner_delta(learner_t *learner);
+  void learner_delta_add(token_count_t s);
+  void free_learner_delta();
+  bool_t update_online_lambdas(learner_t *learner, char *path);
+  void build_learner_features(learner_t *learner);
+  void free_learner_features();
+
   void make_dirichlet_digrams(learner_t *learner);
   void make_uniform_digrams(learner_t *learner);
   void transpose_digrams(learner_t *learner);
 
   bool_t read_online_learner_struct(learner_t *learner, char *opath, bool_t readonly);
   void write_online_learner_struct(learner_t *learner, char *opath);
+  bool_t write_online_learner_file(learner_t *learner, FILE *output);
+  bool_t learner_fork_workers(char **files);
+  char **learner_fork_manifest(char *name,
+			       int (*line_filter)(MBOX_State *, char *),
+			       void (*character_filter)(XML_State *, char *),
+			       char *(*pre_line_fun)(char *));
   error_code_t save_learner(learner_t *learner, char *opath);
+  long prune_overhead_bytes();
+  bool_t prune_learner(learner_t *learner);
+  error_code_t journal_learner(learner_t *learner, category_t *xcat);
 
 
   /* these are defined in catfun.c */
   char *sanitize_path(char *in, char *extension);
-  error_code_t sanitize_model_options(options_t *to, charparser_t *mcp, category_t *cat);
+  error_code_t sanitize_model_options(options_t *to, charparser_t *mcp, hashfun_t *mhf, category_t *cat);
   /*@shared@*/ char *print_model_options(options_t opt, charparser_t mcp, /*@out@*/ char *buf);
   char *print_user_options(options_t opt, char *buf);
 
@@ -1034,8 +1302,11 @@ extern "C"
   c_item_t *find_in_category(category_t *cat, hash_value_t id);
   void init_purely_random_text_category(category_t *cat);
   error_code_t load_category(category_t *cat);
+  error_code_t load_category_stats(FILE *input, category_t *cat);
   error_code_t load_category_header(FILE *input, category_t *cat);
   error_code_t open_category(category_t *cat);
+  char *journal_filename(char *fullfilename);
+  int stat_category(char *path, struct stat *st);
   void reload_all_categories();
 
   void score_word(char *tok, token_type_t tt, regex_count_t re);
@@ -1088,12 +1359,26 @@ extern "C"
 			 char *(*pre_line_fun)(char *),
 			 void (*post_line_fun)(char *),
 			 void (*post_file_fun)(char *));
+  void start_token_cache(FILE *output);
+  FILE *select_token_cache(FILE *output);
+  bool_t open_token_cache(char *path);
+  void close_token_cache();
+  void token_cache_word_fun(char *tok, token_type_t tt, regex_count_t re);
+  void token_cache_mbox_state_fun(Mstate state);
+  void token_cache_post_line_fun(char *buf);
+  void token_cache_post_file_fun(char *name);
+  bool_t is_token_cache(FILE *input);
+  void process_token_cache(FILE *input,
+			   void (*word_fun)(char *, token_type_t, regex_count_t),
+			   void (*post_line_fun)(char *),
+			   void (*post_file_fun)(char *));
 
   void init_mbox_line_filter(MBOX_State *mbox);
   void free_mbox_line_filter(MBOX_State *mbox);
   void reset_mbox_line_filter(MBOX_State *mbox);
   void reset_xml_character_filter(XML_State *xml, XML_Reset reset);
   XML_Reset select_xml_defaults(MIME_Struct *mime);
+  bool_t mbox_part_skippable(MBOX_State *mbox);
 
   /* probabilities in probs.c */
   double log_poisson(int k, double lambda);
@@ -1129,6 +1414,7 @@ extern "C"
   bool_t w_strings1_filter(wchar_t *line);
 
   int wcsncasecmp(const wchar_t *s1, const wchar_t *s2, size_t n);
+  charbuf_len_t utf8_wcrtomb(char *s, wchar_t wc);
 
   void w_xml_character_filter(XML_State *xml, wchar_t *line);
   void w_process_file(FILE *input, 
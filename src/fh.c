@@ -36,11 +36,16 @@
 #include <unistd.h> 
 #endif
 
+#if defined HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
 #include "util.h"
 #include "dbacl.h"
 
 extern options_t u_options;
 extern options_t m_options;
+extern charparser_t m_cp;
 
 extern myregex_t re[MAX_RE];
 extern regex_count_t regex_count;
@@ -72,6 +77,10 @@ extern int cmd;
 extern char *inputfile;
 extern long inputline;
 
+extern int max_threads;
+extern void (*mbox_state_fun)(Mstate);
+extern bool_t (*claim_file_fun)(void);
+
 /***********************************************************
  * EXPERIMENTAL:                                           *
  * this code is an experiment to see if memory mapping is  *
@@ -254,6 +263,35 @@ XML_Reset select_xml_defaults(MIME_Struct *mime) {
   return xmlUNDEF;
 }
 
+/* True if the mbox line filter is in the middle of a MIME part whose
+ * lines are all going to be thrown away (eg images, or everything
+ * after a closing boundary), and nothing except an empty line or a
+ * boundary candidate can change that. Such lines can be skipped
+ * without looking at them, see skip_textbuf().
+ */
+bool_t mbox_part_skippable(MBOX_State *mbox) {
+  if( (mbox->state != msBODY) || (mbox->substate != msuTRACK) ||
+      mbox->prev_line_empty || (mbox->corruption_check > 0) ) {
+    return 0;
+  }
+  if( mbox->skip_until_boundary ) {
+    return 1;
+  }
+  switch(mbox->body.type) {
+  case ctIMAGE:
+  case ctAUDIO:
+  case ctVIDEO:
+  case ctMODEL:
+  case ctOTHER:
+    return 1;
+  case ctOCTET_STREAM:
+  case ctAPPLICATION_MSWORD:
+    return !(m_options & (1<<M_OPTION_ATTACHMENTS));
+  default:
+    return 0;
+  }
+}
+
 void reset_xml_character_filter(XML_State *xml, XML_Reset reset) {
   if( xml ) {
     switch(reset) {
@@ -306,7 +344,9 @@ void reset_xml_character_filter(XML_State *xml, XML_Reset reset) {
 void reset_mbox_line_filter(MBOX_State *mbox) {
   mbox->state = msUNDEF;
   mbox->substate = msuUNDEF;
+  mbox->hstate = mhsUNDEF;
   mbox->hid = hidUNDEF;
+  mbox->armor = maUNDEF;
   mbox->header.type = mbox->body.type = ctUNDEF;
   mbox->header.encoding = mbox->body.encoding = ceUNDEF;
   mbox->prev_line_empty = 1;
@@ -495,63 +535,312 @@ bool_t finalize_textbuf(int *final) {
   return 0;
 }
 
-void process_directory(char *name,
-		       int (*line_filter)(MBOX_State *, char *),
-		       void (*character_filter)(XML_State *, char *), 
-		       void (*word_fun)(char *, token_type_t, regex_count_t), 
-		       char *(*pre_line_fun)(char *),
-		       void (*post_line_fun)(char *),
-		       void (*post_file_fun)(char *)) {
-  DIR *d;
+/***********************************************************
+ * DIRECTORY HANDLING                                      *
+ * directories are walked recursively, which covers the    *
+ * cur/ and new/ subdirectories of a maildir. Directories  *
+ * whose name starts with a dot (eg Maildir++ folders) are *
+ * skipped, and so are symbolic links to directories.      *
+ ***********************************************************/
+
+/* how many upcoming files are opened ahead of time, so that
+   the kernel can start reading them in */
+#define DIR_READAHEAD 8
+
+typedef enum { deUNKNOWN = 0, deFILE, deDIR, deOTHER } dir_entry_type_t;
+
+typedef struct {
+  charbuf_len_t name; /* offset into the names buffer */
+  ino_t ino;
+  dir_entry_type_t type;
+  int fd;
+} dir_entry_t;
+
+typedef struct {
+  char *path;
+  charbuf_len_t path_max;
+  bool_t wide;
+  int (*line_filter)(MBOX_State *, char *);
+  void (*character_filter)(XML_State *, char *); 
+#if defined HAVE_MBRTOWC
+  int (*w_line_filter)(MBOX_State *, wchar_t *);
+  void (*w_character_filter)(XML_State *, wchar_t *); 
+#endif
+  void (*word_fun)(char *, token_type_t, regex_count_t);
+  char *(*pre_line_fun)(char *);
+  void (*post_line_fun)(char *);
+  void (*post_file_fun)(char *);
+} dir_walk_t;
+
+static void *dir_reserve(void *p, charbuf_len_t *max, 
+			 charbuf_len_t need, size_t size) {
+  if( need > *max ) {
+    while( need > *max ) { *max = 2 * (*max) + 16; }
+    p = realloc(p, *max * size);
+    if( !p ) {
+      errormsg(E_FATAL, "not enough memory for directory listing\n");
+    }
+  }
+  return p;
+}
+
+/* puts name after the first len characters of the path */
+static void dir_path(dir_walk_t *dw, charbuf_len_t len, const char *name) {
+  charbuf_len_t n = strlen(name);
+  dw->path = (char *)dir_reserve(dw->path, &dw->path_max, 
+				 len + n + 2, sizeof(char));
+  memcpy(dw->path + len, name, n + 1);
+}
+
+static int dir_stat(DIR *d, dir_walk_t *dw, const char *name, 
+		    struct stat *st, bool_t follow) {
+#if defined HAVE_FSTATAT
+  return fstatat(dirfd(d), name, st, follow ? 0 : AT_SYMLINK_NOFOLLOW);
+#else
+  return follow ? stat(dw->path, st) : lstat(dw->path, st);
+#endif
+}
+
+/* only called when readdir() can't tell, dw->path must be set */
+static dir_entry_type_t dir_entry_type(DIR *d, dir_walk_t *dw, 
+				       const char *name) {
+  struct stat st;
+  if( dir_stat(d, dw, name, &st, 0) == 0 ) {
+    if( S_ISLNK(st.st_mode) ) {
+      /* follow links to files, but not to directories */
+      return ((dir_stat(d, dw, name, &st, 1) == 0) && 
+	      S_ISREG(st.st_mode)) ? deFILE : deOTHER;
+    }
+    return S_ISREG(st.st_mode) ? deFILE : 
+      (S_ISDIR(st.st_mode) ? deDIR : deOTHER);
+  }
+  return deOTHER;
+}
+
+static int dir_open(DIR *d, dir_walk_t *dw, const char *name) {
+#if defined HAVE_OPENAT
+  return openat(dirfd(d), name, O_RDONLY);
+#else
+  return open(dw->path, O_RDONLY);
+#endif
+}
+
+static DIR *dir_opendir(DIR *d, dir_walk_t *dw, const char *name) {
+#if defined HAVE_OPENAT && defined HAVE_FDOPENDIR
+  DIR *sub;
+  int fd = openat(dirfd(d), name, O_RDONLY);
+  if( fd > -1 ) {
+    if( (sub = fdopendir(fd)) ) {
+      return sub;
+    }
+    close(fd);
+  }
+  return NULL;
+#else
+  return opendir(dw->path);
+#endif
+}
+
+static int dir_entry_cmp_ino(const void *a, const void *b) {
+  const dir_entry_t *x = (const dir_entry_t *)a;
+  const dir_entry_t *y = (const dir_entry_t *)b;
+  return (x->ino < y->ino) ? -1 : ((x->ino > y->ino) ? 1 : 0);
+}
+
+static void dir_process_file(dir_walk_t *dw, FILE *input) {
+  inputfile = dw->path;
+  /* set some initial options */
+  reset_xml_character_filter(&xml, xmlRESET);
+
+  if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
+    reset_mbox_line_filter(&mbox);
+  }
+#if defined HAVE_MBRTOWC
+  if( dw->wide ) {
+    w_process_file(input, dw->w_line_filter, dw->w_character_filter, 
+		   dw->word_fun, dw->pre_line_fun, dw->post_line_fun);
+  } else
+#endif
+  process_file(input, dw->line_filter, dw->character_filter, 
+	       dw->word_fun, dw->pre_line_fun, dw->post_line_fun);
+  fclose(input);
+
+  if( dw->post_file_fun ) { (*dw->post_file_fun)(dw->path); }
+}
+
+/* dw->path holds the directory name in its first len characters,
+   including the trailing slash */
+static void walk_directory(dir_walk_t *dw, DIR *d, charbuf_len_t len) {
   struct dirent *sd;
+  dir_entry_t *e = NULL;
+  charbuf_len_t count = 0, max = 0;
+  char *names = NULL;
+  charbuf_len_t names_len = 0, names_max = 0;
+  charbuf_len_t i, n, ahead;
+  char *name;
+  DIR *sub;
   FILE *input;
-  struct stat statinfo;
-  char fullp[_POSIX_PATH_MAX + 1];
-  char *fp;
+  int fd;
+
+  /* read the whole directory first, so we can look ahead */
+  for(sd = readdir(d); sd; sd = readdir(d)) {
+    name = sd->d_name;
+    if( (name[0] == '.') && 
+	(!name[1] || ((name[1] == '.') && !name[2])) ) {
+      continue;
+    }
+    n = strlen(name) + 1;
+    e = (dir_entry_t *)dir_reserve(e, &max, count + 1, sizeof(dir_entry_t));
+    names = (char *)dir_reserve(names, &names_max, names_len + n, 
+				sizeof(char));
+    memcpy(names + names_len, name, n);
+    e[count].name = names_len;
+    e[count].ino = sd->d_ino;
+    e[count].fd = -1;
+    e[count].type = deUNKNOWN;
+#if defined DT_UNKNOWN
+    switch(sd->d_type) {
+    case DT_REG:
+      e[count].type = deFILE;
+      break;
+    case DT_DIR:
+      e[count].type = deDIR;
+      break;
+    case DT_LNK:
+    case DT_UNKNOWN:
+      break;
+    default:
+      e[count].type = deOTHER;
+      break;
+    }
+#endif
+    names_len += n;
+    count++;
+  }
+
+  if( u_options & (1<<U_OPTION_INODE_ORDER) ) {
+    qsort(e, count, sizeof(dir_entry_t), dir_entry_cmp_ino);
+  }
+
+  ahead = 0;
+  for(i = 0; (i < count) && !(cmd & (1<<CMD_QUITNOW)); i++) {
+    name = names + e[i].name;
+    dir_path(dw, len, name);
+
+#if defined HAVE_OPENAT && defined HAVE_POSIX_FADVISE
+    for(; (ahead < count) && (ahead <= i + DIR_READAHEAD); ahead++) {
+      if( e[ahead].type == deFILE ) {
+	e[ahead].fd = openat(dirfd(d), names + e[ahead].name, O_RDONLY);
+	if( e[ahead].fd > -1 ) {
+	  posix_fadvise(e[ahead].fd, 0, 0, POSIX_FADV_WILLNEED);
+	}
+      }
+    }
+#endif
+
+    if( e[i].type == deUNKNOWN ) {
+      e[i].type = dir_entry_type(d, dw, name);
+    }
+
+    switch(e[i].type) {
+    case deFILE:
+      fd = (e[i].fd > -1) ? e[i].fd : dir_open(d, dw, name);
+      e[i].fd = -1;
+      if( claim_file_fun && !(*claim_file_fun)() ) {
+	if( fd > -1 ) { close(fd); }
+      } else if( fd > -1 ) {
+	if( (input = fdopen(fd, "rb")) ) {
+	  dir_process_file(dw, input);
+	} else {
+	  close(fd);
+	}
+      }
+      break;
+    case deDIR:
+      if( name[0] != '.' ) {
+	sub = dir_opendir(d, dw, name);
+	if( sub ) {
+	  n = len + strlen(name);
+	  dw->path[n++] = '/';
+	  dw->path[n] = '\0';
+	  walk_directory(dw, sub, n);
+	  closedir(sub);
+	} else {
+	  errormsg(E_WARNING, "could not open %s, skipping\n", dw->path);
+	}
+      }
+      break;
+    default:
+      /* nothing */
+      break;
+    }
+  }
+
+  /* in case we quit early */
+  for(; ahead > i; ahead--) {
+    if( e[ahead - 1].fd > -1 ) { close(e[ahead - 1].fd); }
+  }
+
+  if( e ) { free(e); }
+  if( names ) { free(names); }
+}
+
+static void walk_directory_tree(dir_walk_t *dw, char *name) {
+  DIR *d;
+  charbuf_len_t len;
 
   d = opendir(name);
   if( d ) {
     /* directory returns relative file names, but we need full paths */
-    strcpy(fullp, name);
-    fp = fullp + strlen(name); 
-    if( (fp > fullp) && (fp[-1] != '/') ) {
-      *fp++ = '/';
-    }
-
-    for(sd = readdir(d); sd; sd = readdir(d)) {
-      strcpy(fp, sd->d_name);
-
-      if( stat(fullp, &statinfo) == 0 ) {
-	switch(statinfo.st_mode & S_IFMT) {
-	case S_IFREG:
-	  input = fopen(fullp, "rb");
-	  if( input ) {
-	    inputfile = fullp;
-	    /* set some initial options */
-	    reset_xml_character_filter(&xml, xmlRESET);
-      
-	    if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
-	      reset_mbox_line_filter(&mbox);
-	    }
-	    process_file(input, line_filter, character_filter, 
-			 word_fun, pre_line_fun, post_line_fun);
-	    fclose(input);
-
-	    if( post_file_fun ) { (*post_file_fun)(fullp); }
-
-	  }
-	default:
-	  /* nothing */
-	  break;
-	}
-      }
+    len = strlen(name);
+    dw->path = NULL;
+    dw->path_max = 0;
+    dir_path(dw, 0, name);
+    if( (len > 0) && (dw->path[len - 1] != '/') ) {
+      dw->path[len++] = '/';
+      dw->path[len] = '\0';
     }
+
+    walk_directory(dw, d, len);
     closedir(d);
+
+    /* don't leave a dangling pointer */
+    inputfile = name;
+    free(dw->path);
   } else {
     errormsg(E_WARNING, "could not open %s, skipping\n", name);
   }
 }
 
+void process_directory(char *name,
+		       int (*line_filter)(MBOX_State *, char *),
+		       void (*character_filter)(XML_State *, char *), 
+		       void (*word_fun)(char *, token_type_t, regex_count_t), 
+		       char *(*pre_line_fun)(char *),
+		       void (*post_line_fun)(char *),
+		       void (*post_file_fun)(char *)) {
+  dir_walk_t dw;
+
+  dw.wide = 0;
+  dw.line_filter = line_filter;
+  dw.character_filter = character_filter;
+  dw.word_fun = word_fun;
+  dw.pre_line_fun = pre_line_fun;
+  dw.post_line_fun = post_line_fun;
+  dw.post_file_fun = post_file_fun;
+  walk_directory_tree(&dw, name);
+}
+
+static
+void report_skipped_bytes(long skipped) {
+  if( (skipped > 0) && 
+      (u_options & (1<<U_OPTION_VERBOSE)) &&
+      !(u_options & (1<<U_OPTION_CLASSIFY)) ) {
+    fprintf(stdout, "skipped %ld bytes of non-text MIME parts in %s\n", 
+	    skipped, inputfile);
+  }
+}
+
 void reset_current_token(char *tokbuf, char **q, token_order_t *how_many) {
   tokbuf[0] = DIAMOND;
   tokbuf[1] = '\0';
@@ -559,6 +848,358 @@ void reset_current_token(char *tokbuf, char **q, token_order_t *how_many) {
   *how_many = 0;
 }
 
+/***********************************************************
+ * PIPELINED FILE HANDLING                                 *
+ * with several threads, reading and filtering, tokenizing *
+ * and the word_fun() calls happen on separate threads.    *
+ * Lines and tokens are passed along in batches, and the   *
+ * word_fun() sees exactly the same token sequence as with *
+ * process_file(), so the results don't change.            *
+ ***********************************************************/
+#if defined HAVE_LIBPTHREAD
+
+#define PIPE_BATCHES    8
+#define PIPE_TEXT_LEN   (1<<16)
+
+/* line flags */
+#define PLF_TOKENIZE    (1<<0) /* line passed the line filter */
+#define PLF_MSTATE      (1<<1) /* line filter was called */
+#define PLF_RELOAD      (1<<2) /* reload categories after this line */
+
+typedef struct {
+  charbuf_len_t text;        /* offset into batch text */
+  charbuf_len_t tokens_end;  /* one past the last token of this line */
+  token_class_t cls;
+  Mstate mstate;
+  int flags;
+} pipe_line_t;
+
+typedef struct {
+  charbuf_len_t tok;         /* offset into batch toks */
+  token_type_t tt;
+  regex_count_t re;
+} pipe_token_t;
+
+typedef struct {
+  char *text;
+  charbuf_len_t text_len, text_max;
+  pipe_line_t *line;
+  charbuf_len_t line_count, line_max;
+  char *toks;
+  charbuf_len_t toks_len, toks_max;
+  pipe_token_t *token;
+  charbuf_len_t token_count, token_max;
+  token_class_t final_cls;   /* class of tokens flushed at end of file */
+  bool_t last;
+} pipe_batch_t;
+
+/* batches are only ever owned by one stage at a time, so the queues
+   can't overflow */
+typedef struct {
+  pipe_batch_t *slot[PIPE_BATCHES];
+  int head, count;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+} pipe_queue_t;
+
+typedef struct {
+  FILE *input;
+  int (*line_filter)(MBOX_State *, char *);
+  void (*character_filter)(XML_State *, char *);
+  bool_t keep_text;
+  pipe_queue_t empty, filtered, tokenized;
+  pipe_batch_t batch[PIPE_BATCHES];
+} pipeline_t;
+
+/* only used by the tokenizer thread */
+static pipe_batch_t *pipe_current = NULL;
+static token_class_t pipe_cls = 0;
+
+static void *pipe_reserve(void *p, charbuf_len_t *max, 
+			  charbuf_len_t need, size_t size) {
+  if( need > *max ) {
+    while( need > *max ) { *max *= 2; }
+    p = realloc(p, *max * size);
+    if( !p ) {
+      errormsg(E_FATAL, "not enough memory for input pipeline\n");
+    }
+  }
+  return p;
+}
+
+static void pipe_init_queue(pipe_queue_t *pq) {
+  pq->head = pq->count = 0;
+  pthread_mutex_init(&pq->lock, NULL);
+  pthread_cond_init(&pq->ready, NULL);
+}
+
+static void pipe_free_queue(pipe_queue_t *pq) {
+  pthread_mutex_destroy(&pq->lock);
+  pthread_cond_destroy(&pq->ready);
+}
+
+static void pipe_push(pipe_queue_t *pq, pipe_batch_t *b) {
+  pthread_mutex_lock(&pq->lock);
+  pq->slot[(pq->head + pq->count++) % PIPE_BATCHES] = b;
+  pthread_cond_signal(&pq->ready);
+  pthread_mutex_unlock(&pq->lock);
+}
+
+static pipe_batch_t *pipe_pop(pipe_queue_t *pq) {
+  pipe_batch_t *b;
+  pthread_mutex_lock(&pq->lock);
+  while( pq->count == 0 ) {
+    pthread_cond_wait(&pq->ready, &pq->lock);
+  }
+  b = pq->slot[pq->head];
+  pq->head = (pq->head + 1) % PIPE_BATCHES;
+  pq->count--;
+  pthread_mutex_unlock(&pq->lock);
+  return b;
+}
+
+static void pipe_init_batch(pipe_batch_t *b) {
+  /* these grow as needed */
+  b->text_max = 4096;
+  b->text = (char *)malloc(b->text_max);
+  b->line_max = 64;
+  b->line = (pipe_line_t *)malloc(b->line_max * sizeof(pipe_line_t));
+  b->toks_max = 4096;
+  b->toks = (char *)malloc(b->toks_max);
+  b->token_max = 512;
+  b->token = (pipe_token_t *)malloc(b->token_max * sizeof(pipe_token_t));
+  if( !b->text || !b->line || !b->toks || !b->token ) {
+    errormsg(E_FATAL, "not enough memory for input pipeline\n");
+  }
+  b->text_len = b->line_count = b->toks_len = b->token_count = 0;
+  b->final_cls = 0;
+  b->last = 0;
+}
+
+static void pipe_free_batch(pipe_batch_t *b) {
+  free(b->text);
+  free(b->line);
+  free(b->toks);
+  free(b->token);
+}
+
+/* the tokenizers call this instead of word_fun() */
+static void pipe_word_fun(char *tok, token_type_t tt, regex_count_t re) {
+  pipe_batch_t *b = pipe_current;
+  charbuf_len_t n = strlen(tok) + 1;
+
+  b->toks = (char *)pipe_reserve(b->toks, &b->toks_max, 
+				 b->toks_len + n, sizeof(char));
+  b->token = (pipe_token_t *)pipe_reserve(b->token, &b->token_max, 
+					  b->token_count + 1, 
+					  sizeof(pipe_token_t));
+  memcpy(b->toks + b->toks_len, tok, n);
+  b->token[b->token_count].tok = b->toks_len;
+  b->token[b->token_count].tt = tt;
+  b->token[b->token_count].re = re;
+  b->token_count++;
+  b->toks_len += n;
+}
+
+/* the token class was worked out when the line was filtered */
+static token_type_t pipe_token_type(token_order_t o) {
+  token_type_t tt;
+  tt.order = o;
+  tt.mark = 0;
+  tt.cls = pipe_cls;
+  return tt;
+}
+
+/* first stage: reads lines and applies the line and character filters */
+static void *pipe_filter_stage(void *arg) {
+  pipeline_t *pl = (pipeline_t *)arg;
+  pipe_batch_t *b;
+  pipe_line_t *l;
+  int extra_lines = 2;
+  charbuf_len_t n;
+  bool_t skip_parts = (pl->line_filter != NULL);
+
+  b = pipe_pop(&pl->empty);
+  while( fill_textbuf(pl->input, &extra_lines) ) {
+    inputline++;
+
+    b->line = (pipe_line_t *)pipe_reserve(b->line, &b->line_max, 
+					  b->line_count + 1, 
+					  sizeof(pipe_line_t));
+    l = &b->line[b->line_count++];
+    l->flags = 0;
+    if( *textbuf ) {
+      if( !pl->line_filter ) {
+	l->flags |= PLF_TOKENIZE;
+      } else {
+	if( (*pl->line_filter)(&mbox, textbuf) ) { 
+	  l->flags |= PLF_TOKENIZE;
+	}
+	l->flags |= PLF_MSTATE;
+	l->mstate = mbox.state;
+      }
+    }
+    if( l->flags & PLF_TOKENIZE ) {
+      if( pl->character_filter ) { (*pl->character_filter)(&xml, textbuf); }
+      l->cls = get_token_type(1).cls;
+    }
+
+    if( cmd & (1<<CMD_RELOAD_CATS) ) {
+      l->flags |= PLF_RELOAD;
+      cmd &= ~(1<<CMD_RELOAD_CATS);
+    }
+
+    n = ((l->flags & PLF_TOKENIZE) || pl->keep_text) ? strlen(textbuf) : 0;
+    b->text = (char *)pipe_reserve(b->text, &b->text_max, 
+				   b->text_len + n + 1, sizeof(char));
+    memcpy(b->text + b->text_len, textbuf, n);
+    b->text[b->text_len + n] = '\0';
+    l->text = b->text_len;
+    b->text_len += n + 1;
+
+    if( skip_parts && mbox_part_skippable(&mbox) ) {
+      mbox.skipped_bytes += skip_textbuf(pl->input);
+    }
+
+    if( b->text_len >= PIPE_TEXT_LEN ) {
+      pipe_push(&pl->filtered, b);
+      b = pipe_pop(&pl->empty);
+    }
+  }
+
+  b->final_cls = get_token_type(1).cls;
+  b->last = 1;
+  pipe_push(&pl->filtered, b);
+  return NULL;
+}
+
+/* second stage: tokenizes the filtered lines */
+static void *pipe_tokenize_stage(void *arg) {
+  pipeline_t *pl = (pipeline_t *)arg;
+  pipe_batch_t *b;
+  pipe_line_t *l;
+  char tokbuf[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  char *q;
+  token_order_t how_many;
+  regex_count_t i;
+  charbuf_len_t k;
+  bool_t last;
+
+  reset_current_token(tokbuf, &q, &how_many);
+  do {
+    b = pipe_pop(&pl->filtered);
+    pipe_current = b;
+    for(k = 0; k < b->line_count; k++) {
+      l = &b->line[k];
+      if( l->flags & PLF_TOKENIZE ) {
+	pipe_cls = l->cls;
+	for(i = 0; i < regex_count; i++) {
+	  regex_tokenizer(b->text + l->text, i, 
+			  pipe_word_fun, pipe_token_type);
+	}
+	if( (m_options & (1<<M_OPTION_USE_STDTOK)) ) {
+	  std_tokenizer(b->text + l->text, &q, tokbuf, &how_many, 
+			ngram_order, pipe_word_fun, pipe_token_type);
+	}
+      }
+      if( !(m_options & (1<<M_OPTION_NGRAM_STRADDLE_NL)) ) {
+	reset_current_token(tokbuf, &q, &how_many);
+      }
+      l->tokens_end = b->token_count;
+    }
+    last = b->last;
+    if( last && (m_options & (1<<M_OPTION_USE_STDTOK)) ) {
+      pipe_cls = b->final_cls;
+      std_tokenizer(NULL, &q, tokbuf, &how_many, ngram_order,
+		    pipe_word_fun, pipe_token_type);
+    }
+    pipe_push(&pl->tokenized, b);
+  } while( !last );
+  return NULL;
+}
+
+/* same as process_file(), but the filters and tokenizers run on their
+   own threads, while word_fun() and post_line_fun() are called from
+   this one */
+static
+void pipeline_process_file(FILE *input, 
+			   int (*line_filter)(MBOX_State *, char *),
+			   void (*character_filter)(XML_State *, char *), 
+			   void (*word_fun)(char *, token_type_t, regex_count_t), 
+			   void (*post_line_fun)(char *)) {
+  pipeline_t pl;
+  pthread_t filter_thread, tokenize_thread;
+  pipe_batch_t *b;
+  pipe_token_t *t;
+  charbuf_len_t k, j;
+  bool_t last;
+  int z;
+  long skipped = mbox.skipped_bytes;
+
+  set_iobuf_mode(input);
+
+  inputline = 0;
+
+  pl.input = input;
+  pl.line_filter = line_filter;
+  pl.character_filter = character_filter;
+  pl.keep_text = (post_line_fun != NULL);
+  pipe_init_queue(&pl.empty);
+  pipe_init_queue(&pl.filtered);
+  pipe_init_queue(&pl.tokenized);
+  for(z = 0; z < PIPE_BATCHES; z++) {
+    pipe_init_batch(&pl.batch[z]);
+    pipe_push(&pl.empty, &pl.batch[z]);
+  }
+
+  if( (pthread_create(&filter_thread, NULL, pipe_filter_stage, &pl) != 0) ||
+      (pthread_create(&tokenize_thread, NULL, pipe_tokenize_stage, &pl) != 0) ) {
+    errormsg(E_FATAL, "could not create input pipeline threads\n");
+  }
+
+  do {
+    b = pipe_pop(&pl.tokenized);
+    for(k = 0, j = 0; k < b->line_count; k++) {
+      if( (b->line[k].flags & PLF_MSTATE) && mbox_state_fun ) {
+	(*mbox_state_fun)(b->line[k].mstate);
+      }
+      for(; j < b->line[k].tokens_end; j++) {
+	t = &b->token[j];
+	(*word_fun)(b->toks + t->tok, t->tt, t->re);
+      }
+      if( post_line_fun ) { (*post_line_fun)(b->text + b->line[k].text); }
+      if( b->line[k].flags & PLF_RELOAD ) { reload_all_categories(); }
+    }
+    /* tokens flushed at end of file */
+    for(; j < b->token_count; j++) {
+      t = &b->token[j];
+      (*word_fun)(b->toks + t->tok, t->tt, t->re);
+    }
+    last = b->last;
+    if( last && (m_options & (1<<M_OPTION_USE_STDTOK)) && post_line_fun ) {
+      (*post_line_fun)(NULL);
+    }
+
+    b->text_len = b->line_count = b->toks_len = b->token_count = 0;
+    b->last = 0;
+    pipe_push(&pl.empty, b);
+  } while( !last );
+
+  pthread_join(filter_thread, NULL);
+  pthread_join(tokenize_thread, NULL);
+
+  for(z = 0; z < PIPE_BATCHES; z++) {
+    pipe_free_batch(&pl.batch[z]);
+  }
+  pipe_free_queue(&pl.empty);
+  pipe_free_queue(&pl.filtered);
+  pipe_free_queue(&pl.tokenized);
+
+  report_skipped_bytes(mbox.skipped_bytes - skipped);
+}
+
+#endif
+
 /* reads a text file as input and applies several filters. */
 void process_file(FILE *input, 
 		  int (*line_filter)(MBOX_State *, char *),
@@ -572,6 +1213,20 @@ void process_file(FILE *input,
   char *q;
   token_order_t how_many;
   int extra_lines = 2;
+  bool_t skip_parts;
+  bool_t keep;
+  long skipped = mbox.skipped_bytes;
+
+#if defined HAVE_LIBPTHREAD
+  /* the pipeline can't interleave per line output with the scores */
+  if( (max_threads > 1) && !pre_line_fun &&
+      !(u_options & (1<<U_OPTION_FILTER)) &&
+      !(u_options & (1<<U_OPTION_DEBUG)) ) {
+    pipeline_process_file(input, line_filter, character_filter,
+			  word_fun, post_line_fun);
+    return;
+  }
+#endif
 
   /* initialize the norex state */
   reset_current_token(tokbuf, &q, &how_many);
@@ -584,6 +1239,11 @@ void process_file(FILE *input,
      needed for plain text */
   if( u_options & (1<<U_OPTION_FILTER) ) { extra_lines = 0; }
 
+  /* useless MIME parts are skipped wholesale, unless someone 
+     wants to see every line */
+  skip_parts = line_filter && !pre_line_fun && 
+    !(u_options & (1<<U_OPTION_FILTER));
+
   /* now start processing */
   while( fill_textbuf(input, &extra_lines) ) {
     inputline++;
@@ -596,7 +1256,16 @@ void process_file(FILE *input,
     }
 
     /* next we check to see if this line should be skipped */
-    if( *pptextbuf && (!line_filter || (*line_filter)(&mbox, pptextbuf)) ) {
+    keep = 0;
+    if( *pptextbuf ) {
+      if( !line_filter ) {
+	keep = 1;
+      } else {
+	keep = (*line_filter)(&mbox, pptextbuf);
+	if( mbox_state_fun ) { (*mbox_state_fun)(mbox.state); }
+      }
+    }
+    if( keep ) {
       /* now filter some of the characters in the current line */
       if( character_filter ) { (*character_filter)(&xml, pptextbuf); }
 
@@ -636,6 +1305,10 @@ void process_file(FILE *input,
       cmd &= ~(1<<CMD_RELOAD_CATS);
     }
 
+    if( skip_parts && mbox_part_skippable(&mbox) ) {
+      mbox.skipped_bytes += skip_textbuf(input);
+    }
+
   }
   /* since std_tokenizer tokens can straddle lines, we should
      flush the last token fragment - note this has nothing to do with
@@ -646,8 +1319,214 @@ void process_file(FILE *input,
 		  word_fun, get_token_type);
     if( post_line_fun ) { (*post_line_fun)(NULL); }
   }
+
+  report_skipped_bytes(mbox.skipped_bytes - skipped);
+}
+
+
+/***********************************************************
+ * TOKEN CACHE                                             *
+ * with -t, the tokens which would be passed to word_fun() *
+ * are saved instead, together with the few other events   *
+ * the learner and classifier need. Replaying the cache    *
+ * later gives the same results as reading the original    *
+ * files, without parsing them again.                      *
+ ***********************************************************/
+
+/* record tags */
+#define TC_TOKEN  'T' /* type, regex, NUL terminated token */
+#define TC_MSTATE 'M' /* mbox state */
+#define TC_FLUSH  'E' /* end of file, post_line_fun(NULL) */
+#define TC_FILE   'F' /* end of file, NUL terminated name */
+
+/* these switches don't change the tokens */
+#define TC_IGNORED_OPTIONS ((1<<M_OPTION_REFMODEL)|		\
+			    (1<<M_OPTION_CALCENTROPY)|		\
+			    (1<<M_OPTION_MULTINOMIAL)|		\
+			    (1<<M_OPTION_HASH_MURMUR)|		\
+			    (1<<M_OPTION_WARNING_BAD))
+
+static FILE *tcache = NULL;
+static char *tcache_path = NULL;
+
+/* writes the lines which a cache must match to be replayed */
+static void write_token_cache_options(FILE *output) {
+  regex_count_t c;
+
+  fprintf(output, MAGIC_TOKENS_OPT, 
+	  (m_options & ~TC_IGNORED_OPTIONS), (short int)m_cp, 
+	  ngram_order, (int)regex_count);
+  for(c = 0; c < regex_count; c++) {
+    fprintf(output, MAGIC5_i, re[c].string);
+  }
+  fprintf(output, MAGIC6);
+}
+
+static bool_t check_token_cache_options(FILE *input) {
+  char buf[MAGIC_BUFSIZE];
+  char expected[MAGIC_BUFSIZE];
+  regex_count_t c;
+  bool_t ok;
+
+  snprintf(expected, MAGIC_BUFSIZE, MAGIC_TOKENS_OPT, 
+	   (m_options & ~TC_IGNORED_OPTIONS), (short int)m_cp, 
+	   ngram_order, (int)regex_count);
+  ok = fgets(buf, MAGIC_BUFSIZE, input) && 
+    (strcmp(buf, MAGIC_TOKENS) == 0) &&
+    fgets(buf, MAGIC_BUFSIZE, input) && 
+    (strcmp(buf, expected) == 0);
+  for(c = 0; ok && (c < regex_count); c++) {
+    snprintf(expected, MAGIC_BUFSIZE, MAGIC5_i, re[c].string);
+    ok = fgets(buf, MAGIC_BUFSIZE, input) && (strcmp(buf, expected) == 0);
+  }
+  return ok && fgets(buf, MAGIC_BUFSIZE, input) && 
+    (strcmp(buf, MAGIC6) == 0);
 }
 
+/* writes the header of a new cache */
+void start_token_cache(FILE *output) {
+  fprintf(output, MAGIC_TOKENS);
+  write_token_cache_options(output);
+}
+
+/* the token_cache_*_fun() callbacks write to the selected cache,
+   the previous one is returned */
+FILE *select_token_cache(FILE *output) {
+  FILE *prev = tcache;
+  tcache = output;
+  return prev;
+}
+
+bool_t open_token_cache(char *path) {
+  tcache = fopen(path, "wb");
+  if( !tcache ) {
+    return (bool_t)0;
+  }
+  tcache_path = path;
+  set_iobuf_mode(tcache);
+  start_token_cache(tcache);
+  return (bool_t)1;
+}
+
+void close_token_cache() {
+  bool_t ok;
+
+  if( tcache ) {
+    ok = !ferror(tcache);
+    ok = (fclose(tcache) == 0) && ok;
+    if( !ok ) {
+      errormsg(E_ERROR, "couldn't write token cache %s\n", tcache_path);
+      unlink(tcache_path);
+      exit(1);
+    }
+    tcache = NULL;
+  }
+}
+
+void token_cache_word_fun(char *tok, token_type_t tt, regex_count_t re) {
+  putc(TC_TOKEN, tcache);
+  putc((tt.cls<<4)|(tt.order<<1)|tt.mark, tcache);
+  putc(re, tcache);
+  fputs(tok, tcache);
+  putc('\0', tcache);
+}
+
+void token_cache_mbox_state_fun(Mstate state) {
+  putc(TC_MSTATE, tcache);
+  putc(state, tcache);
+}
+
+void token_cache_post_line_fun(char *buf) {
+  if( !buf ) {
+    putc(TC_FLUSH, tcache);
+  }
+}
+
+void token_cache_post_file_fun(char *name) {
+  putc(TC_FILE, tcache);
+  fputs(name, tcache);
+  putc('\0', tcache);
+}
+
+/* looks at the start of a regular file, without disturbing the
+   stream, in case it's not a cache */
+bool_t is_token_cache(FILE *input) {
+  char buf[MAGIC_BUFSIZE];
+  ssize_t n;
+
+  n = pread(fileno(input), buf, strlen(MAGIC_TOKENS), 0);
+  return (n == (ssize_t)strlen(MAGIC_TOKENS)) && 
+    (strncmp(buf, MAGIC_TOKENS, (size_t)n) == 0);
+}
+
+static bool_t read_token_cache_string(FILE *input, char *buf, size_t len) {
+  int c;
+  char *p = buf;
+
+  while( (c = getc(input)) > 0 ) {
+    if( p < buf + len - 1 ) { 
+      *p++ = (char)c; 
+    }
+  }
+  *p = '\0';
+  return (c == 0);
+}
+
+/* replays the tokens and events of a cache, instead of process_file() */
+void process_token_cache(FILE *input,
+			 void (*word_fun)(char *, token_type_t, regex_count_t),
+			 void (*post_line_fun)(char *),
+			 void (*post_file_fun)(char *)) {
+  char tokbuf[(MAX_TOKEN_LEN+1)*MAX_SUBMATCH+EXTRA_TOKEN_LEN];
+  char name[BUFSIZ];
+  token_type_t tt;
+  int c, t, r;
+  bool_t ok;
+
+  set_iobuf_mode(input);
+
+  /* the tokens must have been made with the same switches */
+  ok = 1;
+  if( !check_token_cache_options(input) ) {
+    errormsg(E_FATAL, 
+	     "the token cache %s was made with different switches\n",
+	     inputfile);
+  }
+
+  while( ok && ((c = getc(input)) != EOF) ) {
+    switch(c) {
+    case TC_TOKEN:
+      t = getc(input);
+      r = getc(input);
+      tt.cls = (t>>4) & 0x0f;
+      tt.order = (t>>1) & 0x07;
+      tt.mark = t & 0x01;
+      ok = (r != EOF) && 
+	read_token_cache_string(input, tokbuf, sizeof(tokbuf));
+      if( ok ) { (*word_fun)(tokbuf, tt, (regex_count_t)r); }
+      break;
+    case TC_MSTATE:
+      t = getc(input);
+      ok = (t != EOF);
+      if( ok && mbox_state_fun ) { (*mbox_state_fun)((Mstate)t); }
+      break;
+    case TC_FLUSH:
+      if( post_line_fun ) { (*post_line_fun)(NULL); }
+      break;
+    case TC_FILE:
+      ok = read_token_cache_string(input, name, sizeof(name));
+      if( ok && post_file_fun ) { (*post_file_fun)(name); }
+      break;
+    default:
+      ok = 0;
+      break;
+    }
+  }
+  if( !ok ) {
+    errormsg(E_FATAL, "the token cache %s is truncated or corrupt\n", 
+	     inputfile);
+  }
+}
 
 /***********************************************************
  * WIDE CHARACTER FILE HANDLING FUNCTIONS                  *
@@ -663,54 +1542,16 @@ void w_process_directory(char *name,
 			 char *(*pre_line_fun)(char *),
 			 void (*post_line_fun)(char *),
 			 void (*post_file_fun)(char *)) {
-  DIR *d;
-  struct dirent *sd;
-  FILE *input;
-  struct stat statinfo;
-  char fullp[_POSIX_PATH_MAX + 1];
-  char *fp;
-
-  d = opendir(name);
-  if( d ) {
-    /* directory returns relative file names, but we need full paths */
-    strcpy(fullp, name);
-    fp = fullp + strlen(name); 
-    if( (fp > fullp) && (fp[-1] != '/') ) {
-      *fp++ = '/';
-    }
-
-    for(sd = readdir(d); sd; sd = readdir(d)) {
-      strcpy(fp, sd->d_name);
-
-      if( stat(fullp, &statinfo) == 0 ) {
-	switch(statinfo.st_mode & S_IFMT) {
-	case S_IFREG:
-	  input = fopen(fullp, "rb");
-	  if( input ) {
-	    inputfile = fullp;
-	    /* set some initial options */
-	    reset_xml_character_filter(&xml, xmlRESET);
-      
-	    if( m_options & (1<<M_OPTION_MBOX_FORMAT) ) {
-	      reset_mbox_line_filter(&mbox);
-	    }
-	    w_process_file(input, w_line_filter, w_character_filter, 
-			   word_fun, pre_line_fun, post_line_fun);
-	    fclose(input);
-
-	    if( post_file_fun ) { (*post_file_fun)(fullp); }
-	    
-	  }
-	default:
-	  /* nothing */
-	  break;
-	}
-      }
-    }
-    closedir(d);
-  } else {
-    errormsg(E_WARNING, "could not open %s, skipping\n", name);
-  }
+  dir_walk_t dw;
+
+  dw.wide = 1;
+  dw.w_line_filter = w_line_filter;
+  dw.w_character_filter = w_character_filter;
+  dw.word_fun = word_fun;
+  dw.pre_line_fun = pre_line_fun;
+  dw.post_line_fun = post_line_fun;
+  dw.post_file_fun = post_file_fun;
+  walk_directory_tree(&dw, name);
 }
 
 /* reads a text file as input, converting each line
@@ -731,6 +1572,8 @@ void w_process_file(FILE *input,
   int extra_lines = 2;
   wchar_t *wcp;
   char wcq[MB_LEN_MAX+1];
+  bool_t skip_parts;
+  long skipped = mbox.skipped_bytes;
 
   set_iobuf_mode(input);
 
@@ -743,6 +1586,11 @@ void w_process_file(FILE *input,
      needed for plain text */
   if( u_options & (1<<U_OPTION_FILTER) ) { extra_lines = 0; }
 
+  /* useless MIME parts are skipped wholesale, unless someone 
+     wants to see every line */
+  skip_parts = line_filter && !pre_line_fun && 
+    !(u_options & (1<<U_OPTION_FILTER));
+
   while( fill_textbuf(input, &extra_lines) ) {
     inputline++;
     /* preprocesses textbuf, optionally censors it */
@@ -799,6 +1647,10 @@ void w_process_file(FILE *input,
       cmd &= ~(1<<CMD_RELOAD_CATS);
     }
 
+    if( skip_parts && mbox_part_skippable(&mbox) ) {
+      mbox.skipped_bytes += skip_textbuf(input);
+    }
+
   }
   /* since w_std_tokenizer tokens can straddle lines, we should
      flush the last token fragment */
@@ -808,6 +1660,8 @@ void w_process_file(FILE *input,
     if( post_line_fun ) { (*post_line_fun)(NULL); }
   }
 
+  report_skipped_bytes(mbox.skipped_bytes - skipped);
+
 }
 
 #endif /* DISABLE_WCHAR */
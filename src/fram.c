@@ -36,6 +36,7 @@ options_t m_options = 0;
 
 charparser_t m_cp = 0;
 digtype_t m_dt = 0;
+hashfun_t m_hf = 0;
 
 /* default value in case we don't have getpagesize() */
 long system_pagesize = BUFSIZ;
@@ -78,6 +79,17 @@ void *out_iobuf = NULL; /* used for all category/learner file operations */
 
 token_order_t ngram_order = 1;
 
+/* number of threads used to read and tokenize input */
+int max_threads = 1;
+
+/* if set, process_file() calls this with the mbox state after
+   each line filter, and before that line's tokens are seen */
+void (*mbox_state_fun)(Mstate) = NULL;
+
+/* if set, every input file (on the command line or in a directory)
+   is counted, but only read if this returns true */
+bool_t (*claim_file_fun)(void) = NULL;
+
 
 decoding_cache b64_dc = {NULL, NULL, 0, 0};
 decoding_cache qp_dc = {NULL, NULL, 0, 0};
@@ -465,6 +465,11 @@ bool_t process_dump_pair(const char *d1, const char *d2, category_pair_t *cp) {
   }
 
   if( load_category_dump(d1, cp, 0) && load_category_dump(d2, cp, 1) ) {
+    if( cp->cat[0].model.hf != cp->cat[1].model.hf ) {
+      errormsg(E_FATAL, 
+	       "%s and %s use different token hashes, cannot compare\n",
+	       d1, d2);
+    }
     if( u_options & (1<<U_OPTION_VERBOSE) ) {
       fprintf(stdout, "loaded successfully (%s, %s)\n", d1, d2);
     }
@@ -35,6 +35,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <sys/stat.h>
 
 #if defined HAVE_UNISTD_H
 #include <unistd.h> 
@@ -103,6 +104,7 @@ extern int optind, opterr, optopt;
 extern options_t u_options;
 extern options_t m_options;
 extern charparser_t m_cp;
+extern hashfun_t m_hf;
 extern char *extn;
 
 extern char *progname;
@@ -190,6 +192,7 @@ void init_emails() {
   }
   emails.list_size = INITIAL_LIST_SIZE;
   emails.num_emails = 0;
+  emails.num_indexed = 0;
   emails.num_limited = 0;
   emails.sortedby = 1;
 }
@@ -206,6 +209,30 @@ void free_emails() {
   free(emails.llist);
 }
 
+/* makes sure the list has room for more than n emails */
+void reserve_emails(email_count_t n) {
+  if( n >= emails.list_size ) {
+    while( n >= emails.list_size ) {
+      emails.list_size *= 2;
+    }
+
+    if( (emails.list = realloc(emails.list, 
+			       emails.list_size * sizeof(mbox_item))) == NULL ) {
+      errormsg(E_FATAL,
+	       "couldn't allocate memory for emails, failed at %ld bytes\n", 
+	       (long)emails.list_size * sizeof(mbox_item));
+    }
+    if( u_options & (1<<U_OPTION_INTERACTIVE) ) {
+      if( (emails.llist = realloc(emails.llist, 
+				  emails.list_size * sizeof(mbox_item *))) == NULL ) {
+	errormsg(E_FATAL,
+		 "couldn't allocate memory for emails, failed at %ld bytes\n", 
+		 (long)emails.list_size * sizeof(mbox_item *));
+      }
+    }
+  }
+}
+
 void build_scores(weight_t *s) {
   double lambda;
 
@@ -253,7 +280,7 @@ char *process_email_line(char *textbuf) {
     if( strncmp(textbuf, "From ", 5) == 0 ) {
 
       /* save the previous email's score etc */
-      if( emails.num_emails > 0 ) {
+      if( emails.num_emails > emails.num_indexed ) {
 	
 	emails.list[emails.num_emails - 1].state &= ~(1<<STATE_TAGGED);
 	build_scores(emails.list[emails.num_emails - 1].score);
@@ -266,6 +293,7 @@ char *process_email_line(char *textbuf) {
 
       /* reset calculations */
       cat[0].score = 0.0;
+      cat[0].score_shannon = 0.0;
       cat[0].complexity = 0.0;
       cat[0].fcomplexity = 0;
 
@@ -275,24 +303,7 @@ char *process_email_line(char *textbuf) {
 
       /* now increment email number */
       emails.num_emails++;
-      if( emails.num_emails >= emails.list_size ) {
-	emails.list_size *= 2;
-
-	if( (emails.list = realloc(emails.list, 
-				   emails.list_size * sizeof(mbox_item))) == NULL ) {
-	  errormsg(E_FATAL,
-		  "couldn't allocate memory for emails, failed at %ld bytes\n", 
-		  (long)emails.list_size * sizeof(mbox_item));
-	}
-	if( u_options & (1<<U_OPTION_INTERACTIVE) ) {
-	  if( (emails.llist = realloc(emails.llist, 
-				      emails.list_size * sizeof(mbox_item *))) == NULL ) {
-	    errormsg(E_FATAL,
-		    "couldn't allocate memory for emails, failed at %ld bytes\n", 
-		    (long)emails.list_size * sizeof(mbox_item *));
-	  }
-	}
-      }
+      reserve_emails(emails.num_emails);
       if( emails.list[emails.num_emails - 1].state & (1<<STATE_LIMITED) ) {
 	++emails.num_limited; 
       }
@@ -341,7 +352,7 @@ char *process_email_line(char *textbuf) {
 /* this is a companion function for process_email_line() */
 void process_last_email() {
 
-  if( emails.num_emails > 0 ) {
+  if( emails.num_emails > emails.num_indexed ) {
     
     emails.list[emails.num_emails - 1].state &= ~(1<<STATE_TAGGED);
     build_scores(emails.list[emails.num_emails - 1].score);
@@ -353,6 +364,7 @@ void process_last_email() {
   }
 
   cat[0].score = 0.0;
+  cat[0].score_shannon = 0.0;
   cat[0].complexity = 0;
   cat[0].fcomplexity = 0;
   
@@ -483,6 +495,176 @@ int w_email_line_filter(MBOX_State *mbox, wchar_t *buf) {
 }
 #endif
 
+/***********************************************************
+ * EMAIL INDEX                                             *
+ ***********************************************************/
+
+/* The index is a sidecar file which remembers the position, 
+   descriptions and scores of every email, in mbox order. It is only
+   valid for the category and options it was made with, and for a
+   mailbox which hasn't changed, except for appended emails. */
+
+#define INDEX_MAGIC "# mailinspect index version 1\n"
+
+/* reads a description of known length */
+static char *read_index_description(FILE *idx, long len) {
+  char *d;
+
+  if( (len < 0) || !(d = malloc(len + 1)) ) {
+    return NULL;
+  }
+  if( fread(d, 1, len, idx) != (size_t)len ) {
+    free(d);
+    return NULL;
+  }
+  d[len] = '\0';
+  return d;
+}
+
+/* checks that the mbox still contains this email's From line */
+static bool_t check_index_email(FILE *input, mbox_item *w) {
+  long len = strlen(w->description[0]);
+  char buf[HEADER_BUFLEN];
+
+  if( (w->seekpos < len) || 
+      (fseek(input, w->seekpos - len, SEEK_SET) != 0) ) {
+    return 0;
+  }
+  if( len >= HEADER_BUFLEN ) { len = HEADER_BUFLEN - 1; }
+  return (fread(buf, 1, len, input) == (size_t)len) &&
+    (memcmp(buf, w->description[0], len) == 0);
+}
+
+/* Fills the email list from the index, except for the last email,
+   which may have grown since and is read again. On return, the input
+   is positioned where processing should resume. If the index doesn't
+   fit, the list is left empty and the input is rewound. */
+void load_mbox_index(FILE *input) {
+  FILE *idx;
+  struct stat cs, ms;
+  long csize, cmtime, msize, mmtime;
+  unsigned long opts;
+  long n, len0, len1;
+  email_count_t i;
+  mbox_item *w;
+  char buf[PIPE_BUFLEN];
+  bool_t ok = 0;
+
+  if( !(idx = fopen(emails.index_filename, "rb")) ) {
+    return;
+  }
+
+  if( (stat_category(cat[0].fullfilename, &cs) == 0) && 
+      (fstat(fileno(input), &ms) == 0) &&
+      fgets(buf, PIPE_BUFLEN, idx) && !strcmp(buf, INDEX_MAGIC) &&
+      fgets(buf, PIPE_BUFLEN, idx) && 
+      (sscanf(buf, "# category %ld %ld %lx", &csize, &cmtime, &opts) == 3) &&
+      fgets(buf, PIPE_BUFLEN, idx) &&
+      (sscanf(buf, "# mbox %ld %ld", &msize, &mmtime) == 2) &&
+      fgets(buf, PIPE_BUFLEN, idx) && 
+      (sscanf(buf, "# emails %ld", &n) == 1) ) {
+
+    /* a grown mbox is assumed to have new emails appended */
+    ok = (csize == (long)cs.st_size) && (cmtime == (long)cs.st_mtime) &&
+      (opts == (unsigned long)m_options) && (n > 0) && (n < msize) &&
+      ((msize < (long)ms.st_size) || 
+       ((msize == (long)ms.st_size) && (mmtime == (long)ms.st_mtime)));
+
+    if( ok ) { 
+      reserve_emails(n); 
+    }
+    for(i = 0; ok && (i < n); i++) {
+      w = &emails.list[i];
+      ok = fgets(buf, PIPE_BUFLEN, idx) &&
+	(sscanf(buf, "%ld %ld %ld %g %g %g %g", 
+		&w->seekpos, &len0, &len1, 
+		&w->score[0], &w->score[1], &w->score[2], &w->score[3]) == 7) &&
+	(w->description[0] = read_index_description(idx, len0));
+      if( ok ) {
+	if( !(w->description[1] = read_index_description(idx, len1)) ) {
+	  free(w->description[0]);
+	  ok = 0;
+	} else {
+	  w->state = (1<<STATE_LIMITED);
+	  emails.num_emails++;
+	}
+      }
+    }
+
+    ok = ok && check_index_email(input, &emails.list[0]) &&
+      check_index_email(input, &emails.list[n - 1]);
+  }
+  fclose(idx);
+
+  if( ok ) {
+    /* drop the last email and resume at its From line */
+    w = &emails.list[--emails.num_emails];
+    fseek(input, w->seekpos - strlen(w->description[0]), SEEK_SET);
+    free(w->description[0]);
+    free(w->description[1]);
+    emails.num_indexed = emails.num_emails;
+  } else {
+    while( emails.num_emails > 0 ) {
+      w = &emails.list[--emails.num_emails];
+      free(w->description[0]);
+      free(w->description[1]);
+    }
+    rewind(input);
+  }
+}
+
+/* writes the email list (in mbox order) to the index */
+void save_mbox_index(FILE *input) {
+  FILE *idx;
+  struct stat cs, ms;
+  char *tmpname;
+  email_count_t i;
+  mbox_item *w;
+  bool_t ok;
+
+  if( (stat_category(cat[0].fullfilename, &cs) != 0) || 
+      (fstat(fileno(input), &ms) != 0) ) {
+    return;
+  }
+
+  /* write a temporary file and rename it, so the index is never
+     left half written */
+  if( !(tmpname = malloc(strlen(emails.index_filename) + 5)) ) {
+    return;
+  }
+  strcpy(tmpname, emails.index_filename);
+  strcat(tmpname, ".tmp");
+
+  if( (idx = fopen(tmpname, "wb")) ) {
+    ok = (fputs(INDEX_MAGIC, idx) >= 0) &&
+      (fprintf(idx, "# category %ld %ld %lx\n", (long)cs.st_size, 
+	       (long)cs.st_mtime, (unsigned long)m_options) > 0) &&
+      (fprintf(idx, "# mbox %ld %ld\n", (long)ms.st_size, 
+	       (long)ms.st_mtime) > 0) &&
+      (fprintf(idx, "# emails %ld\n", (long)emails.num_emails) > 0);
+    for(i = 0; ok && (i < emails.num_emails); i++) {
+      w = &emails.list[i];
+      ok = w->description[0] && w->description[1] &&
+	(fprintf(idx, "%ld %ld %ld %.9g %.9g %.9g %.9g\n", (long)w->seekpos,
+		 (long)strlen(w->description[0]), 
+		 (long)strlen(w->description[1]), 
+		 w->score[0], w->score[1], w->score[2], w->score[3]) > 0) &&
+	(fputs(w->description[0], idx) >= 0) &&
+	(fputs(w->description[1], idx) >= 0);
+    }
+    ok = (fclose(idx) == 0) && ok;
+    if( !ok || (rename(tmpname, emails.index_filename) != 0) ) {
+      errormsg(E_WARNING, "could not write index %s\n", 
+	       emails.index_filename);
+      unlink(tmpname);
+    }
+  } else {
+    errormsg(E_WARNING, "could not write index %s\n", 
+	     emails.index_filename);
+  }
+  free(tmpname);
+}
+
 /* called when we want to read in and sort by category score */
 void read_mbox_and_sort_list(FILE *input) {
 
@@ -497,6 +679,11 @@ void read_mbox_and_sort_list(FILE *input) {
 
   inputfile = emails.filename;
 
+  /* only the emails which aren't in the index need scoring */
+  if( emails.index_filename ) {
+    load_mbox_index(input);
+  }
+
   /* process input file */
   reset_mbox_line_filter(&mbox);
   if( !(m_options & (1<<M_OPTION_I18N)) ) {
@@ -512,6 +699,11 @@ void read_mbox_and_sort_list(FILE *input) {
   }
   process_last_email(); /* don't forget last email */
   mbox_handle = NULL;
+
+  if( emails.index_filename ) {
+    save_mbox_index(input);
+  }
+
   /* sort the emails */
   qsort(emails.list, emails.num_emails, sizeof(mbox_item), compare_scores);
 
@@ -822,7 +1014,8 @@ void interactive_categorize() {
       if( load_category(&cat[1]) && 
 	  (input = fopen(emails.filename, "rb")) ) {
 
-	sanitize_model_options(&m_options, &m_cp, &cat[1]);
+	m_hf = HF_DEFAULT; /* the new category replaces the old one */
+	sanitize_model_options(&m_options, &m_cp, &m_hf, &cat[1]);
 	ephemeral_message("Please wait, recalculating scores");
 	/* loaded category successfully, now free old resources */
 	free_category(&cat[0]);
@@ -1304,7 +1497,7 @@ int main(int argc, char **argv) {
   if( system_pagesize == -1 ) { system_pagesize = BUFSIZ; }
 
   /* parse the options */
-  while( (op = getopt(argc, argv, "c:g:G:iIjo:p:s:VzZ")) > -1 ) {
+  while( (op = getopt(argc, argv, "c:g:G:iIjo:p:s:Vx:zZ")) > -1 ) {
 
     switch(op) {
     case 'j':
@@ -1367,7 +1560,7 @@ int main(int argc, char **argv) {
 		  "could not load category %s\n", 
 		  cat[cat_count].fullfilename);
 	}
-	sanitize_model_options(&m_options, &m_cp, &cat[cat_count]);
+	sanitize_model_options(&m_options, &m_cp, &m_hf, &cat[cat_count]);
 	cat_count++;
       }
       break;
@@ -1399,6 +1592,10 @@ int main(int argc, char **argv) {
       execute_command = optarg;
       break;
 
+    case 'x':
+      emails.index_filename = optarg;
+      break;
+
     default:
       break;
     }
@@ -1424,6 +1621,11 @@ int main(int argc, char **argv) {
   if( !(u_options & (1<<U_OPTION_SCORES)) ) {
     emails.score_type = 0;
   }
+  if( emails.index_filename && (tagre_count > 0) ) {
+    errormsg(E_WARNING,
+	     "the index can't be used with -g or -G, ignored\n");
+    emails.index_filename = NULL;
+  }
   if( m_options & (1<<M_OPTION_CASEN) ) {
     regcomp_flags = REG_EXTENDED|REG_NOSUB;
   } else {
@@ -78,8 +78,10 @@ typedef struct {
   email_count_t list_size;
   email_count_t num_limited;
   email_count_t num_emails;
+  email_count_t num_indexed;
   int sortedby;
   char *filename;
+  char *index_filename;
   unsigned char index_format;
   unsigned char score_type;
 } Emails;
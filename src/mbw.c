@@ -408,6 +408,9 @@ void mbw_prefix(init_dc)(mbw_prefix(decoding_cache) *dc, size_t len) {
     dc->data_ptr = dc->cache;
     dc->cache_len = dc->cache ? len : 0;
     dc->max_line_len = len; 
+  } else {
+    /* don't decode leftovers from the previous file */
+    dc->data_ptr = dc->cache;
   }
 }
 
@@ -431,8 +434,8 @@ void mbw_prefix(adjust_cache_size)(mbw_prefix(decoding_cache) *dc, size_t n) {
 
 static
 bool_t mbw_prefix(flush_cache)(mbw_prefix(decoding_cache) *dc, mbw_t *line, bool_t all) {
-  mbw_t *q;
   mbw_t *p;
+  size_t n;
   int i;
   if( dc->cache && (dc->data_ptr > dc->cache) ) {
     /* never output more bytes than will fit on output_line */
@@ -453,19 +456,21 @@ bool_t mbw_prefix(flush_cache)(mbw_prefix(decoding_cache) *dc, mbw_t *line, bool
     }
 
     if( p > dc->cache ) {
-      for(q = dc->cache; q < p; q++) {
-	*line++ = *q;
-      }
-      *line = mbw_lit('\0');
+      n = p - dc->cache;
+      mbw_memcpy(line, dc->cache, n);
+      line[n] = mbw_lit('\0');
 
-      dc->data_ptr = dc->cache;
       if( !all ) {
-	/* now fold unused part back into cache. Note that
-	 * b64_line_cache is always NUL terminated, so we don't
-	 * need b64_cache_ptr to mark the end. */
-	while( *p ) {
-	  *dc->data_ptr++ = *p++;
+	/* now fold unused part back into cache. The unused part
+	 * ends at data_ptr, and is at most a few dozen chars long, 
+	 * so this is much cheaper than the copy above. */
+	n = dc->data_ptr - p;
+	if( n > 0 ) {
+	  mbw_memmove(dc->cache, p, n);
 	}
+	dc->data_ptr = dc->cache + n;
+      } else {
+	dc->data_ptr = dc->cache;
       }
       *dc->data_ptr = mbw_lit('\0');
       return 1;
@@ -481,6 +486,10 @@ bool_t mbw_prefix(flush_cache)(mbw_prefix(decoding_cache) *dc, mbw_t *line, bool
 
 #define REPNUL mbw_lit('\t')
 
+/* true if x is a valid base64 digit (ie not padding, and not junk);
+ * as a side effect, its code is stored in v */
+#define B64_QUANTUM(v,x) (((unsigned int)((v) = mbw_prefix(b64_code)(x))) < 64)
+
 /* 
  * this code generates b64_line_filter2() and w_b64_line_filter2() 
  * works ok so long as q <= line, or q >> line 
@@ -497,9 +506,32 @@ mbw_t *mbw_prefix(b64_line_filter2)(mbw_t *line, mbw_t *q) {
   mbw_t buf[4];
   mbw_t *buf_start = buf;
   mbw_t *buf_end = buf + 4;
+  int a, b, c, d;
 
   if( q ) {
     while( *p ) {
+      if( buf_start == buf ) {
+	/* fast path: while we are aligned on a quantum, decode whole
+	 * blocks of four valid characters at once. The tests
+	 * short-circuit, so we never read past the terminating NUL,
+	 * and the padding character (code 64) always drops us into
+	 * the careful code below. Since q advances by three while p
+	 * advances by four, decoding in place remains safe. */
+	while( B64_QUANTUM(a,p[0]) && B64_QUANTUM(b,p[1]) &&
+	       B64_QUANTUM(c,p[2]) && B64_QUANTUM(d,p[3]) ) {
+	  q[0] = (a<<2) + (b>>4);
+	  q[1] = (b<<4) + (c>>2);
+	  q[2] = (c<<6) + d;
+	  if( !q[0] ) { q[0] = REPNUL; }
+	  if( !q[1] ) { q[1] = REPNUL; }
+	  if( !q[2] ) { q[2] = REPNUL; }
+	  q += 3;
+	  p += 4;
+	}
+	if( !*p ) {
+	  break;
+	}
+      }
       if( mbw_prefix(b64_code)(*p) > -1 ) {
 	*buf_start++ = *p;
 	if( buf_start == buf_end ) {
@@ -561,10 +593,20 @@ bool_t mbw_prefix(b64_line_filter)(mbw_prefix(decoding_cache) *b64cache,
  */
 mbw_t *mbw_prefix(qp_line_filter2)(mbw_t *line, mbw_t *q) {
   mbw_t *p = line;
+  mbw_t *r;
+  size_t n;
   if( q ) {
     while( *p ) {
       if( *p != mbw_lit('=') ) {
-	*q++ = *p++;
+	/* most of a QP line is literal text, so copy the whole
+	 * stretch up to the next escape (or the end) in one go */
+	r = mbw_strchr(p, mbw_lit('='));
+	n = r ? (size_t)(r - p) : mbw_strlen(p);
+	if( q != p ) {
+	  mbw_memmove(q, p, n);
+	}
+	q += n;
+	p += n;
       } else {
 	if( !*(++p) || mbw_isspace(*p) ) { 
 	  break;
@@ -1682,6 +1724,7 @@ bool_t mbw_prefix(mhe_line_filter)(mbw_t *line) {
   mbw_t *p = line;
   mbw_t *q = line;
   mbw_t *r;
+  size_t n;
 
   while( *p ) {
     if( (p[0] == mbw_lit('=')) && (p[1] == mbw_lit('?')) ) {
@@ -1729,7 +1772,14 @@ bool_t mbw_prefix(mhe_line_filter)(mbw_t *line) {
 	*q++ = *p++;
       }
     } else {
-      *q++ = *p++;      
+      /* copy plain text up to the next possible encoded word at once */
+      r = mbw_strchr(p + 1, mbw_lit('='));
+      n = r ? (size_t)(r - p) : mbw_strlen(p);
+      if( q != p ) {
+	mbw_memmove(q, p, n);
+      }
+      q += n;
+      p += n;
     }
   }
   *q = '\0';
@@ -3829,6 +3879,57 @@ void mbw_prefix(xml_attribute_filter)(XML_State *xml, mbw_t **lline, mbw_t **qq)
   }
 }
 
+/* For each state of xml_character_filter(), the characters which can
+ * make a difference. Everything in between is skipped (or copied) 
+ * wholesale with strcspn(), which is much faster than looking at 
+ * every character in turn. This matters for script and style blocks,
+ * and for long tags. A NULL entry means every character counts. 
+ * The TEXT and CMNT entries apply only when the text is discarded.
+ */
+static const mbw_t *mbw_prefix(xml_stop_chars)[] = {
+  NULL,                /* unused */
+  mbw_lit("<"),        /* TEXT */
+  NULL,                /* XTAG */
+  NULL,                /* XTAGQUOTE */
+  NULL,                /* XTAGDQUOTE */
+  NULL,                /* XTAGPREQ */
+  mbw_lit("=>"),       /* TAG */
+  mbw_lit("\\'"),      /* TAGQUOTE */
+  mbw_lit("\\\""),     /* TAGDQUOTE */
+  NULL,                /* TAGPREQ */
+  mbw_lit("-"),        /* CMNT */
+  NULL                 /* DISABLED */
+};
+
+/* returns the characters worth stopping at in the current state, and
+   sets copy if the characters in between are shown verbatim */
+static __inline__
+const mbw_t *mbw_prefix(xml_skip_set)(XML_State *xml, bool_t *copy) {
+  bool_t shown;
+
+  shown = ((xml->hide == SCRIPT) && (m_options & (1<<M_OPTION_SHOW_SCRIPT))) ||
+    ((xml->hide == STYLE) && (m_options & (1<<M_OPTION_SHOW_STYLE)));
+
+  *copy = 0;
+  switch(xml->state) {
+  case TEXT:
+    if( (xml->parser != xpSMART) && 
+	(shown || (xml->hide == VISIBLE) || (xml->hide == TITLE)) ) {
+      *copy = 1;
+      return mbw_lit("<&");
+    }
+    break;
+  case CMNT:
+    if( shown || (m_options & (1<<M_OPTION_SHOW_HTML_COMMENTS)) ) {
+      return NULL;
+    }
+    break;
+  default:
+    break;
+  }
+  return mbw_prefix(xml_stop_chars)[xml->state];
+}
+
 /* Removes tags in the string - modifies in place 
  * the name of this function is a misnomer, since it doesn't
  * parse xml properly. 
@@ -3866,6 +3967,9 @@ void mbw_prefix(xml_attribute_filter)(XML_State *xml, mbw_t **lline, mbw_t **qq)
  */
 void mbw_prefix(xml_character_filter)(XML_State *xml, mbw_t *line) {
   mbw_t *q;
+  const mbw_t *stop;
+  bool_t copy;
+  size_t n;
   q = line;
 /*   int k; */
 
@@ -3887,6 +3991,18 @@ void mbw_prefix(xml_character_filter)(XML_State *xml, mbw_t *line) {
   }
 
   while( *line ) {
+    /* jump to the next character which matters */
+    if( (stop = mbw_prefix(xml_skip_set)(xml, &copy)) ) {
+      n = mbw_strcspn(line, stop);
+      if( copy && (n > 0) ) {
+	mbw_memmove(q, line, n);
+	q += n;
+      }
+      line += n;
+      if( !*line ) {
+	break;
+      }
+    }
 /*     printf("%d %d ->", xml->state, xml->attribute); */
 /*     PDEBUG(LINE); */
     switch(xml->state) {
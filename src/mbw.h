@@ -25,6 +25,38 @@
 #define mbw_lit(x) L##x
 #define mbw_t wchar_t
 #define mbw_prefix(f) w_##f
+#if defined HAVE_MBRTOWC
+extern bool_t utf8_codeset;
+extern bool_t wctype_cached;
+extern unsigned short wctype_cache[WCTYPE_CACHE_SIZE];
+extern wchar_t wctolower_cache[WCTYPE_CACHE_SIZE];
+
+/* the first code points are looked up in the tables 
+   filled by fill_wc_textbuf(), the others in the C library */
+static __inline__ 
+int wctype_lookup(wint_t c, unsigned short bit, int (*isw)(wint_t)) {
+  return (wctype_cached && ((unsigned long)c < WCTYPE_CACHE_SIZE)) ? 
+    (wctype_cache[c] & bit) : (*isw)(c);
+}
+
+static __inline__ 
+wint_t wctolower_lookup(wint_t c) {
+  return (wctype_cached && ((unsigned long)c < WCTYPE_CACHE_SIZE)) ? 
+    (wint_t)wctolower_cache[c] : towlower(c);
+}
+
+#define mbw_isalnum(c) wctype_lookup(c, WCT_ALNUM, iswalnum)
+#define mbw_isalpha(c) wctype_lookup(c, WCT_ALPHA, iswalpha)
+#define mbw_isgraph(c) wctype_lookup(c, WCT_GRAPH, iswgraph)
+#define mbw_isspace(c) wctype_lookup(c, WCT_SPACE, iswspace)
+#define mbw_isblank(c) wctype_lookup(c, WCT_BLANK, iswblank)
+#define mbw_iscntrl(c) wctype_lookup(c, WCT_CNTRL, iswcntrl)
+#define mbw_ispunct(c) wctype_lookup(c, WCT_PUNCT, iswpunct)
+#define mbw_isxdigit(c) wctype_lookup(c, WCT_XDIGIT, iswxdigit)
+#define mbw_isdigit(c) wctype_lookup(c, WCT_DIGIT, iswdigit)
+#define mbw_isprint(c) wctype_lookup(c, WCT_PRINT, iswprint)
+#define mbw_tolower(x) wctolower_lookup(x)
+#else
 #define mbw_isalnum(c) iswalnum(c)
 #define mbw_isalpha(c) iswalpha(c)
 #define mbw_isgraph(c) iswgraph(c)
@@ -35,21 +67,36 @@
 #define mbw_isxdigit(c) iswxdigit(c)
 #define mbw_isdigit(c) iswdigit(c)
 #define mbw_isprint(c) iswprint(c)
+#define mbw_tolower(x) towlower(x)
+#endif
 #define mbw_isascii(c) (c <= 127)
 #define mbw_strncmp(x,y,z) wcsncmp(x,y,z)
 #define mbw_strcmp(x,y) wcscmp(x,y)
 #define mbw_strncasecmp(x,y,z) mbw_prefix(mystrncasecmp)(x,y,z) /* wcsncasecmp is broken in glibc */
 #define mbw_strtol(x,y,z) wcstol(x,y,z)
-#define mbw_tolower(x) towlower(x)
 #define mbw_strchr(x,y) wcschr(x,y)
+#define mbw_strcspn(x,y) wcscspn(x,y)
 #define mbw_strncpy(x,y,z) wcsncpy(x,y,z)
 #define mbw_strlen(x) wcslen(x)
+#define mbw_memcpy(x,y,z) wmemcpy(x,y,z)
+#define mbw_memmove(x,y,z) wmemmove(x,y,z)
 
 #if defined HAVE_MBRTOWC
 static mbstate_t copychar_shiftstate;
 static charbuf_len_t copychar_len;
+static wchar_t copychar_wc;
 #define mbw_copychar(x,y) { \
-            copychar_len = wcrtomb((x), (y), &copychar_shiftstate); \
+            copychar_wc = (y); \
+            if( utf8_codeset ) { \
+               if( (unsigned long)copychar_wc < 0x80 ) { \
+                  *(x)++ = (char)copychar_wc; \
+                  copychar_len = 0; \
+               } else { \
+                  copychar_len = utf8_wcrtomb((x), copychar_wc); \
+               } \
+            } else { \
+               copychar_len = wcrtomb((x), copychar_wc, &copychar_shiftstate); \
+            } \
             if( copychar_len > -1) { \
                x += copychar_len; \
             } \
@@ -89,8 +136,11 @@ static charbuf_len_t copychar_len;
 #define mbw_strtol(x,y,z) strtol(x,y,z)
 #define mbw_tolower(x) tolower(x)
 #define mbw_strchr(x,y) strchr(x,y)
+#define mbw_strcspn(x,y) strcspn(x,y)
 #define mbw_strncpy(x,y,z) strncpy(x,y,z)
 #define mbw_strlen(x) strlen(x)
+#define mbw_memcpy(x,y,z) memcpy(x,y,z)
+#define mbw_memmove(x,y,z) memmove(x,y,z)
 #define mbw_copychar(x,y) { *(x)++ = (y); }
 
 #define mbw_regcomp(x,y,z) regcomp(x,y,z)
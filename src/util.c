@@ -35,6 +35,10 @@
 #include <math.h>
 #include "util.h"
 
+#if defined HAVE_LANGINFO_H
+#include <langinfo.h>
+#endif
+
 /*@constant double M_LN2@*/
 
 extern char *progname;
@@ -42,11 +46,15 @@ extern char *inputfile;
 extern long inputline;
 extern options_t u_options;
 extern options_t m_options;
+extern hashfun_t m_hf;
 extern int cmd;
 
 extern char *textbuf;
 extern charbuf_len_t textbuf_len;
 
+extern char *aux_textbuf;
+extern charbuf_len_t aux_textbuf_len;
+
 #if defined HAVE_MBRTOWC
 extern wchar_t *wc_textbuf;
 extern charbuf_len_t wc_textbuf_len;
@@ -60,6 +68,11 @@ extern long system_pagesize;
 int sa_signal = 0;
 signal_cleanup_t cleanup = { NULL };
 
+/* input which was read ahead by skip_textbuf(), but not yet consumed
+   by fill_textbuf(). The data lives in aux_textbuf. */
+static char *aux_pos = NULL;
+static char *aux_end = NULL;
+
 /***********************************************************
  * GLOBAL BUFFERS                                          *
  ***********************************************************/
@@ -95,6 +108,11 @@ void init_buffers() {
 void cleanup_buffers() {
   /* free some global resources */
   free(textbuf);
+  if( aux_textbuf ) { 
+    free(aux_textbuf); 
+    aux_textbuf = NULL;
+    aux_pos = aux_end = NULL;
+  }
 #if defined HAVE_POSIX_MEMALIGN
   if( in_iobuf ) { free(in_iobuf); }
   if( out_iobuf ) { free(out_iobuf); }
@@ -137,13 +155,109 @@ void set_iobuf_mode(FILE *input) {
 /***********************************************************
  * TOKEN HASHING                                           *
  ***********************************************************/
+
+/* MurmurHash64A, by Austin Appleby, placed in the public domain.
+ * The key is read in little endian order, so that token ids are the
+ * same on all platforms. Selected with -k murmur. */
+static
+u_int64_t murmur_hash(const unsigned char *k, unsigned long len, 
+		      u_int64_t seed) {
+  const u_int64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  u_int64_t h = seed ^ (len * m);
+  u_int64_t x;
+  const unsigned char *e = k + (len & ~7UL);
+
+  for(; k < e; k += 8) {
+    x = (u_int64_t)k[0] | ((u_int64_t)k[1] << 8) | 
+      ((u_int64_t)k[2] << 16) | ((u_int64_t)k[3] << 24) |
+      ((u_int64_t)k[4] << 32) | ((u_int64_t)k[5] << 40) | 
+      ((u_int64_t)k[6] << 48) | ((u_int64_t)k[7] << 56);
+    x *= m;
+    x ^= x >> r;
+    x *= m;
+    h ^= x;
+    h *= m;
+  }
+
+  switch(len & 7) {
+  case 7: h ^= (u_int64_t)k[6] << 48;
+  case 6: h ^= (u_int64_t)k[5] << 40;
+  case 5: h ^= (u_int64_t)k[4] << 32;
+  case 4: h ^= (u_int64_t)k[3] << 24;
+  case 3: h ^= (u_int64_t)k[2] << 16;
+  case 2: h ^= (u_int64_t)k[1] << 8;
+  case 1: h ^= (u_int64_t)k[0];
+    h *= m;
+  }
+
+  h ^= h >> r;
+  h *= m;
+  h ^= h >> r;
+  return h;
+}
+
+static __inline__
+hash_value_t hash_token_pieces(const char *tok, int len, const char *extra) {
+  JENKINS_HASH_VALUE h;
+  u_int64_t m;
+  if( m_hf == HF_MURMUR ) {
+    m = murmur_hash((const unsigned char *)tok, len, 0);
+    return (hash_value_t)murmur_hash((const unsigned char *)extra, 
+				     EXTRA_CLASS_LEN, m);
+  }
+  h = hash((unsigned char *)tok, len, 0);
+  return (hash_value_t)hash((unsigned char *)extra, EXTRA_CLASS_LEN, h);
+}
+
+/* Short tokens (including the class bytes) are interned in a small
+ * direct mapped table, so that frequent tokens skip the full hash
+ * computation. An entry is simply overwritten on collision. */
+#define TOKEN_CACHE_SIZE 2048
+#define TOKEN_CACHE_KEYLEN 15
+
+typedef struct {
+  char key[TOKEN_CACHE_KEYLEN + 1];
+  hash_value_t id;
+} token_cache_t;
+
+static token_cache_t token_cache[TOKEN_CACHE_SIZE];
+static hashfun_t token_cache_hf = HF_DEFAULT;
+long token_cache_hits = 0;
+long token_cache_misses = 0;
+
 hash_value_t hash_full_token(const char *tok) {
   const char *q;
-  JENKINS_HASH_VALUE h;
-  q = strchr(tok,EOTOKEN);
-  if( q ) {
-    h = hash((unsigned char *)tok, q - tok, 0);
-    return (hash_value_t)hash((unsigned char *)q, EXTRA_CLASS_LEN, h);
+  unsigned int c;
+  charbuf_len_t len;
+  token_cache_t *e;
+
+  /* find the class separator, and mix a cheap slot index as we go */
+  c = 0;
+  for(q = tok; *q && (*q != EOTOKEN); q++) {
+    c = (c * 31) + (unsigned char)*q;
+  }
+  if( *q ) {
+    len = (q - tok) + EXTRA_CLASS_LEN;
+    if( len <= TOKEN_CACHE_KEYLEN ) {
+      if( token_cache_hf != m_hf ) {
+	/* cached ids belong to the other hash function */
+	memset(token_cache, 0, sizeof(token_cache));
+	token_cache_hf = m_hf;
+      }
+      c = (c * 31) + (unsigned char)q[1];
+      e = &token_cache[(c ^ (c >> 11)) & (TOKEN_CACHE_SIZE - 1)];
+      if( (e->key[len] == '\0') && !memcmp(e->key, tok, len) ) {
+	token_cache_hits++;
+	return e->id;
+      }
+      token_cache_misses++;
+      e->id = hash_token_pieces(tok, q - tok, q);
+      memcpy(e->key, tok, len);
+      e->key[len] = '\0';
+      return e->id;
+    }
+    return hash_token_pieces(tok, q - tok, q);
   } else {
     errormsg(E_FATAL,
 	    "hash_full_token called with missing class [%s]\n",
@@ -153,9 +267,7 @@ hash_value_t hash_full_token(const char *tok) {
 }
 
 hash_value_t hash_partial_token(const char *tok, int len, const char *extra) {
-  JENKINS_HASH_VALUE h;
-  h = hash((unsigned char *)tok, len, 0);
-  return (hash_value_t)hash((unsigned char *)extra, EXTRA_CLASS_LEN, h);
+  return hash_token_pieces(tok, len, extra);
 }
 
 /***********************************************************
@@ -184,6 +296,109 @@ double nats2bits(double score) {
   return score/M_LN2;
 }
 
+/***********************************************************
+ * VECTOR FUNCTIONS                                        *
+ ***********************************************************/
+
+/* exp() and log() of an array of weights, in place, for the digram
+   models. The arrays are done in blocks of WEIGHTS_BLOCK without
+   branches, so that the compiler can turn the blocks into SIMD
+   instructions. The polynomials are those of the Cephes expf() and
+   logf(), accurate to a few float ulps, far below the digitization of
+   the digrams. The weights must be finite, and not negative for
+   log_weights(), which returns -inf for zero like log(). */
+
+typedef union {
+  float f;
+  int32_t i;
+} float_bits_t;
+
+static __inline__
+float exp_weight(float t) {
+  float_bits_t s;
+  float n, p, c;
+  int32_t k;
+
+  c = (float)(t < -87.33f);
+  t = t + (-87.33f - t) * c;
+  c = (float)(t > 88.37f);
+  t = t + (88.37f - t) * c;
+  /* exp(t) = 2^k exp(t - k log 2) */
+  c = (float)(t < 0.0f);
+  k = (int32_t)(t * 1.44269504088896341f + (0.5f - c));
+  n = (float)k;
+  t = t - n * 0.693359375f + n * 2.12194440e-4f;
+  p = 1.9875691500e-4f;
+  p = p * t + 1.3981999507e-3f;
+  p = p * t + 8.3334519073e-3f;
+  p = p * t + 4.1665795894e-2f;
+  p = p * t + 1.6666665459e-1f;
+  p = p * t + 5.0000001201e-1f;
+  p = p * t * t + t + 1.0f;
+  s.i = (k + 127) << 23;
+  return p * s.f;
+}
+
+static __inline__
+float log_weight(float x) {
+  float_bits_t s;
+  float m, z, p, e;
+  int32_t k, c, zero;
+
+  /* log(x) = e log 2 + log(1 + m), with 1 + m in [sqrt(1/2), sqrt(2)) */
+  s.f = x;
+  zero = -(int32_t)(s.i == 0);
+  k = ((s.i >> 23) & 0xff) - 126;
+  s.i = (s.i & 0x007fffff) | 0x3f000000;
+  /* doubles the mantissa if it is below sqrt(1/2) */
+  c = (s.f < 0.707106781186547524f);
+  s.i += c << 23;
+  e = (float)(k - c);
+  m = s.f - 1.0f;
+  z = m * m;
+  p = 7.0376836292e-2f;
+  p = p * m - 1.1514610310e-1f;
+  p = p * m + 1.1676998740e-1f;
+  p = p * m - 1.2420140846e-1f;
+  p = p * m + 1.4249322787e-1f;
+  p = p * m - 1.6668057665e-1f;
+  p = p * m + 2.0000714765e-1f;
+  p = p * m - 2.4999993993e-1f;
+  p = p * m + 3.3333331174e-1f;
+  p = p * m * z;
+  p += e * -2.12194440e-4f;
+  p -= 0.5f * z;
+  s.f = m + p + e * 0.693359375f;
+  s.i = (s.i & ~zero) | (0xff800000 & zero); /* -inf */
+  return s.f;
+}
+
+void exp_weights(weight_t *x, int n) {
+  int b, j;
+
+  for(b = 0; b < (n & ~(WEIGHTS_BLOCK - 1)); b += WEIGHTS_BLOCK) {
+    for(j = b; j < b + WEIGHTS_BLOCK; j++) {
+      x[j] = exp_weight(x[j]);
+    }
+  }
+  for(j = b; j < n; j++) {
+    x[j] = exp_weight(x[j]);
+  }
+}
+
+void log_weights(weight_t *x, int n) {
+  int b, j;
+
+  for(b = 0; b < (n & ~(WEIGHTS_BLOCK - 1)); b += WEIGHTS_BLOCK) {
+    for(j = b; j < b + WEIGHTS_BLOCK; j++) {
+      x[j] = log_weight(x[j]);
+    }
+  }
+  for(j = b; j < n; j++) {
+    x[j] = log_weight(x[j]);
+  }
+}
+
 
 
 /***********************************************************
@@ -357,6 +572,33 @@ void print_token(FILE *out, const char *tok) {
   }
 }
 
+/* copies the next line of read ahead input into textbuf, and returns
+ * the position where the line should be continued (if the read ahead
+ * data stopped in the middle of a line), or NULL if the line is complete.
+ */
+static char *drain_aux_textbuf() {
+  char *q;
+  charbuf_len_t n;
+
+  q = (char *)memchr(aux_pos, '\n', aux_end - aux_pos);
+  n = q ? (q + 1 - aux_pos) : (aux_end - aux_pos);
+  while( n >= textbuf_len ) {
+    textbuf = (char *)realloc(textbuf, 2 * textbuf_len);
+    if( !textbuf ) {
+      fprintf(stderr, 
+	      "error: not enough memory for input line (%d bytes)\n",
+	      textbuf_len);
+      cleanup_tempfiles();
+      exit(1);
+    }
+    textbuf_len *= 2;
+  }
+  memcpy(textbuf, aux_pos, n);
+  textbuf[n] = '\0';
+  aux_pos += n;
+  return q ? NULL : (textbuf + n);
+}
+
 /* even after the EOF is reached, this pretends there are
  * a few more blank lines, to allow filters to process
  * cached input.
@@ -365,7 +607,7 @@ bool_t fill_textbuf(FILE *input, int *extra_lines) {
   char *s;
   charbuf_len_t l, k;
   
-  if( !(cmd & (1<<CMD_QUITNOW)) && !feof(input) ) {
+  if( !(cmd & (1<<CMD_QUITNOW)) && ((aux_pos < aux_end) || !feof(input)) ) {
     process_pending_signal(input);
 
     /* read in a full line, allocating memory as necessary */
@@ -373,6 +615,13 @@ bool_t fill_textbuf(FILE *input, int *extra_lines) {
     s = textbuf;
     l = textbuf_len;
     k = 1;
+    if( aux_pos < aux_end ) {
+      s = drain_aux_textbuf();
+      if( !s ) { 
+	return 1; 
+      }
+      l = textbuf_len - (s - textbuf);
+    }
     while( fgets(s, l, input) && ((charbuf_len_t)strlen(s) >= (l - 1)) ) {
       textbuf = (char *)realloc(textbuf, 2 * textbuf_len);
       if( !textbuf ) {
@@ -392,13 +641,71 @@ bool_t fill_textbuf(FILE *input, int *extra_lines) {
     }
     return 1;
   } else if( *extra_lines > 0 ) {
+    aux_pos = aux_end = NULL;
     strcpy(textbuf, "\r\n");
     *extra_lines = (*extra_lines) - 1;
     return 1;
   }
+  aux_pos = aux_end = NULL;
   return 0;
 }
 
+/* Skips input lines which cannot change the state of the MIME parser,
+ * ie everything up to the next empty line or line starting with a
+ * dash (a boundary candidate). This is much cheaper than reading the
+ * lines one by one with fill_textbuf(), because the raw input is
+ * scanned in large blocks with memchr(). The first unskipped line is
+ * kept back for the next call of fill_textbuf(), so the caller must
+ * only use this when the previous line was read completely.
+ * Returns the number of bytes skipped.
+ */
+long skip_textbuf(FILE *input) {
+  char *q;
+  long skipped = 0;
+  size_t n;
+  bool_t bol = 1;
+
+  if( !aux_textbuf ) {
+    aux_textbuf_len = BUFFER_MAG * system_pagesize;
+    aux_textbuf = (char *)malloc(aux_textbuf_len);
+    if( !aux_textbuf ) {
+      aux_textbuf_len = 0;
+      return 0;
+    }
+    aux_pos = aux_end = NULL;
+  }
+
+  while( !(cmd & (1<<CMD_QUITNOW)) ) {
+    if( aux_pos >= aux_end ) {
+      n = fread(aux_textbuf, 1, aux_textbuf_len, input);
+      if( n == 0 ) {
+	aux_pos = aux_end = NULL;
+	break;
+      }
+      aux_pos = aux_textbuf;
+      aux_end = aux_textbuf + n;
+    }
+    if( bol && 
+	((*aux_pos == '-') || (*aux_pos == '\r') || (*aux_pos == '\n')) ) {
+      break;
+    }
+    q = (char *)memchr(aux_pos, '\n', aux_end - aux_pos);
+    if( q ) {
+      inputline++;
+      q++;
+      bol = 1;
+    } else {
+      /* line continues in the next block */
+      q = aux_end;
+      bol = 0;
+    }
+    skipped += q - aux_pos;
+    aux_pos = q;
+  }
+
+  return skipped;
+}
+
 /***********************************************************
  * WIDE CHARACTER FILE HANDLING FUNCTIONS                  *
  * this is needed for any locale whose character set       *
@@ -406,6 +713,123 @@ bool_t fill_textbuf(FILE *input, int *extra_lines) {
  ***********************************************************/
 #if defined HAVE_MBRTOWC
 
+/* In a UTF-8 locale, the conversions below bypass mbrtowc() and
+ * wcrtomb(), which go through the full C library converter for every
+ * single character. The inline coders accept and reject exactly the
+ * same sequences as glibc, including the old 5 and 6 byte forms. */
+bool_t utf8_codeset = 0;
+
+/* character classes and lowercase forms of the first code points,
+   see mbw.h */
+bool_t wctype_cached = 0;
+unsigned short wctype_cache[WCTYPE_CACHE_SIZE];
+wchar_t wctolower_cache[WCTYPE_CACHE_SIZE];
+
+static void init_wctype_cache() {
+  wint_t c;
+  unsigned short b;
+
+#if defined HAVE_LANGINFO_H
+  utf8_codeset = !strcmp(nl_langinfo(CODESET), "UTF-8");
+#endif
+
+  for(c = 0; c < WCTYPE_CACHE_SIZE; c++) {
+    b = 0;
+    if( iswalnum(c) ) { b |= WCT_ALNUM; }
+    if( iswalpha(c) ) { b |= WCT_ALPHA; }
+    if( iswgraph(c) ) { b |= WCT_GRAPH; }
+    if( iswspace(c) ) { b |= WCT_SPACE; }
+    if( iswblank(c) ) { b |= WCT_BLANK; }
+    if( iswcntrl(c) ) { b |= WCT_CNTRL; }
+    if( iswpunct(c) ) { b |= WCT_PUNCT; }
+    if( iswxdigit(c) ) { b |= WCT_XDIGIT; }
+    if( iswdigit(c) ) { b |= WCT_DIGIT; }
+    if( iswprint(c) ) { b |= WCT_PRINT; }
+    wctype_cache[c] = b;
+    wctolower_cache[c] = towlower(c);
+  }
+  wctype_cached = 1;
+}
+
+/* decodes one UTF-8 character at s, with the same return values as
+   mbrtowc(). Sequences which don't fit in the k available bytes are
+   left to mbrtowc(), so that partial characters are treated alike. */
+static __inline__
+charbuf_len_t utf8_mbrtowc(wchar_t *wp, const unsigned char *s, 
+			   charbuf_len_t k, mbstate_t *shiftstate) {
+  static const wchar_t utf8_min[7] = 
+    { 0, 0, 0x80, 0x800, 0x10000, 0x200000, 0x4000000 };
+  charbuf_len_t n, i;
+  wchar_t w;
+
+  if( *s < 0x80 ) {
+    *wp = *s;
+    return (*s != 0);
+  } else if( *s < 0xc2 ) {
+    return -1;
+  } else if( *s < 0xe0 ) {
+    n = 2; w = *s & 0x1f;
+  } else if( *s < 0xf0 ) {
+    n = 3; w = *s & 0x0f;
+  } else if( *s < 0xf8 ) {
+    n = 4; w = *s & 0x07;
+  } else if( *s < 0xfc ) {
+    n = 5; w = *s & 0x03;
+  } else if( *s < 0xfe ) {
+    n = 6; w = *s & 0x01;
+  } else {
+    return -1;
+  }
+
+  if( n > k ) {
+    return mbrtowc(wp, (const char *)s, k, shiftstate);
+  }
+
+  for(i = 1; i < n; i++) {
+    if( (s[i] & 0xc0) != 0x80 ) {
+      return -1;
+    }
+    w = (w << 6) | (s[i] & 0x3f);
+  }
+  if( (w < utf8_min[n]) || ((w >= 0xd800) && (w < 0xe000)) ) {
+    return -1;
+  }
+  *wp = w;
+  return n;
+}
+
+/* encodes wc as UTF-8 like wcrtomb(), returns the number of bytes 
+   written or -1 */
+charbuf_len_t utf8_wcrtomb(char *s, wchar_t wc) {
+  unsigned long w = (unsigned long)wc;
+  charbuf_len_t n, i;
+
+  if( w < 0x80 ) {
+    *s = (char)w;
+    return 1;
+  } else if( w < 0x800 ) {
+    n = 2; *s = (char)(0xc0 | (w >> 6));
+  } else if( w < 0x10000 ) {
+    if( (w >= 0xd800) && (w < 0xe000) ) { 
+      return -1; 
+    }
+    n = 3; *s = (char)(0xe0 | (w >> 12));
+  } else if( w < 0x200000 ) {
+    n = 4; *s = (char)(0xf0 | (w >> 18));
+  } else if( w < 0x4000000 ) {
+    n = 5; *s = (char)(0xf8 | (w >> 24));
+  } else if( w < 0x80000000UL ) {
+    n = 6; *s = (char)(0xfc | (w >> 30));
+  } else {
+    return -1;
+  }
+  for(i = n - 1; i > 0; i--) {
+    s[i] = (char)(0x80 | (w & 0x3f));
+    w >>= 6;
+  }
+  return n;
+}
+
 /* this does the same work as mbstowcs, but unlike the latter,
  * we continue converting even if an error is detected. That
  * is why we can't use the standard function.
@@ -420,6 +844,10 @@ bool_t fill_wc_textbuf(char *pptextbuf, mbstate_t *shiftstate) {
 
   if( !pptextbuf || !*pptextbuf ) { return 0; }
 
+  if( !wctype_cached ) {
+    init_wctype_cache();
+  }
+
   if( textbuf_len > wc_textbuf_len ) {
     wc_textbuf_len = textbuf_len;
     wc_textbuf = (wchar_t *)realloc(wc_textbuf, wc_textbuf_len * sizeof(wchar_t));
@@ -444,7 +872,17 @@ bool_t fill_wc_textbuf(char *pptextbuf, mbstate_t *shiftstate) {
   /* since we ensured textbuf_len <= wctextbuf_len
      there will never be overflow of wctextbuf below */
   while( k > 0 ) {
-    l = mbrtowc(wp, s, k, shiftstate);
+    if( utf8_codeset && mbsinit(shiftstate) ) {
+      /* fast path for plain ASCII */
+      while( (k > 0) && *s && ((unsigned char)*s < 0x80) ) {
+	*wp++ = *s++;
+	wclen++;
+	k--;
+      }
+      l = (k > 0) ? utf8_mbrtowc(wp, (unsigned char *)s, k, shiftstate) : 0;
+    } else {
+      l = mbrtowc(wp, s, k, shiftstate);
+    }
     if( l > 0 ) {
       wp++;
       wclen++;
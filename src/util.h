@@ -56,6 +56,10 @@ weight_t undigitize_a_weight(digitized_weight_t d, token_order_t o);
 
 double nats2bits(double score);
 
+#define WEIGHTS_BLOCK 8
+void exp_weights(weight_t *x, int n);
+void log_weights(weight_t *x, int n);
+
 double chi2_cdf(double df, double x);
 double gamma_tail(double a, double b, double x);
 double normal_cdf(double x);
@@ -77,6 +81,7 @@ void cleanup_tempfiles();
 void set_iobuf_mode(FILE *input);
 
 bool_t fill_textbuf(FILE *input, int *extra_lines);
+long skip_textbuf(FILE *input);
 #if defined HAVE_MBRTOWC
 bool_t fill_wc_textbuf(char *pptextbuf, mbstate_t *shiftstate);
 #endif